@@ -28,20 +28,104 @@
 #ifndef SerialFlash_h_
 #define SerialFlash_h_
 
+#if defined(SERIALFLASH_HOST)
+// Linux, using a Flash image file instead of a chip, see SerialFlashHost.cpp
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+uint32_t micros();
+#else
 #include <Arduino.h>
 #include <SPI.h>
+#endif
 
 class SerialFlashFile;
 
+// Partitions for createPartitions(), each a whole number of erase blocks
+#define SERIALFLASH_FILESYSTEM  1
+#define SERIALFLASH_RAW         2
+#ifndef SERIALFLASH_PARTITIONS
+#define SERIALFLASH_PARTITIONS  8	// most partitions in the table
+#endif
+
+struct SerialFlashPartition {
+	const char *name;	// up to 11 characters
+	uint32_t length;	// 0 = the rest of the chip
+	uint8_t type;
+};
+
+// Results of SerialFlash.check()
+struct SerialFlashCheck {
+	uint32_t files;		// files open() can find
+	uint32_t deleted;	// removed files, still using space
+	uint32_t damaged;	// entries with a bad location, name or hash
+	uint32_t unfinished;	// create() interrupted by power loss
+	uint32_t repaired;	// problems made into removed files
+	uint32_t free;		// bytes after the last file
+};
+
+// Progress of SerialFlash.scrub(), all zero to begin
+struct SerialFlashScrub {
+	uint32_t files;		// files with checksums, finished
+	uint32_t chunks;	// chunks matching their checksum
+	uint32_t damaged;	// chunks which do not match
+	uint32_t unfinished;	// chunks (or files) never completely written
+	uint32_t index;		// where the next scrub() continues
+	uint32_t chunk;
+	// optional, called with the name and offset of each damaged chunk
+	void (*found)(const char *filename, uint32_t offset);
+};
+
+// CRC-32 (as zip, PNG and Ethernet) of len bytes, continuing from crc,
+// which is 0 to begin.  Used by SerialFlashCopy and createChecked().
+uint32_t SerialFlashCRC32(uint32_t crc, const void *buf, uint32_t len);
+
+// One event recorded by SerialFlashChip when compiled with SERIALFLASH_TRACE
+// defined as the number of events to keep, see extras/trace-decode.py
+struct SerialFlashTraceEvent {
+	uint32_t micros;	// when the command began
+	uint32_t addr;
+	uint16_t len;		// 65535 = or more
+	uint8_t cmd;		// SPI command, 0 = none
+	uint8_t event;		// event << 4 | busy state
+};
+#define SERIALFLASH_TRACE_READ     1
+#define SERIALFLASH_TRACE_PROGRAM  2
+#define SERIALFLASH_TRACE_ERASE    3
+#define SERIALFLASH_TRACE_SUSPEND  4
+#define SERIALFLASH_TRACE_RESUME   5
+#define SERIALFLASH_TRACE_WAIT     6	// waiting for the chip begins
+#define SERIALFLASH_TRACE_WAITED   7	// and ends
+#define SERIALFLASH_TRACE_SLEEP    8
+#define SERIALFLASH_TRACE_WAKEUP   9
+
 class SerialFlashChip
 {
 public:
+#if defined(SERIALFLASH_HOST)
+	// use an image file, creating a blank one if size is given
+	static bool begin(const char *imagefile, uint32_t size = 0,
+		uint32_t blocksize = 65536);
+	static void end();
+	// len bytes of the image at addr, without copying, or NULL
+	static const uint8_t * map(uint32_t addr, uint32_t len);
+#else
 	static bool begin(SPIClass& device, uint8_t pin = 6);
 	static bool begin(uint8_t pin = 6);
+#endif
 	static uint32_t capacity(const uint8_t *id);
 	static uint32_t blockSize();
+	static uint32_t pageSize();
+	// bytes per die of stacked die chips, or 0
+	static uint32_t dieSize();
 	static void sleep();
 	static void wakeup();
+	// sleep after this many milliseconds idle, waking when used, 0 = off
+	static void setAutoSleep(uint32_t milliseconds);
+	// time asleep, number of wakeups and microseconds spent waking
+	static void sleepStats(uint32_t &asleepms, uint32_t &wakeupcount,
+		uint32_t &wakeupmicros);
 	static void readID(uint8_t *buf);
 	static void readSerialNumber(uint8_t *buf);
 	static void read(uint32_t addr, void *buf, uint32_t len);
@@ -50,29 +134,157 @@ public:
 	static void write(uint32_t addr, const void *buf, uint32_t len);
 	static void eraseAll();
 	static void eraseBlock(uint32_t addr);
+	// program data SPI NAND holds in RAM until a whole page is written
+	static void flush();
+	// SPI NAND error counts, and bad blocks from the factory or since
+	static void nandStats(uint32_t &corrected, uint32_t &uncorrectable,
+		uint32_t &failed, uint32_t &badblocks);
+	// limit how long reads may wait for writes and erases, 0 = off
+	static void setReadLatency(uint32_t microseconds);
+	// SPI clocks for reads, programs (and all other commands) and status polls
+	static void setClock(uint32_t read, uint32_t program, uint32_t status);
+	static void getClock(uint32_t &read, uint32_t &program, uint32_t &status);
+	// find the fastest clocks which work, using erase blocks at addr
+	static bool calibrate(uint32_t addr, uint32_t len);
+#if !defined(SERIALFLASH_HOST)
+	// the last count traced events, oldest first, none without SERIALFLASH_TRACE
+	static uint32_t readTrace(SerialFlashTraceEvent *list, uint32_t count);
+	// print all traced events, for extras/trace-decode.py
+	static void dumpTrace(Print &out);
+	static void clearTrace();
+#endif
+	// erase blocks in the background, while ready() or poll() is called
+	static bool recycle(uint32_t addr, uint32_t len);
+	static bool poll();
+	// bytes at addr already erased by recycle(), which then forgets them
+	static uint32_t recycled(uint32_t addr, uint32_t len);
+
+	// optional erase counts, kept in 2 or more erase blocks at addr
+	static bool beginWear(uint32_t addr, uint32_t len);
+	// save erase counts still held in RAM
+	static void flushWear();
+	// times the block holding addr has been erased
+	static uint32_t eraseCount(uint32_t addr);
+	// most and least erased blocks, and erases left for the most erased
+	static void wearStats(uint32_t &hotaddr, uint32_t &hotcount,
+		uint32_t &coldaddr, uint32_t &coldcount, uint32_t &remaining);
 
 	static SerialFlashFile open(const char *filename);
 	static bool create(const char *filename, uint32_t length, uint32_t align = 0);
 	static bool createErasable(const char *filename, uint32_t length) {
 		return create(filename, length, blockSize());
 	}
+	// file holding data compressed by extras/compress.py, read-only
+	// once written, length is the compressed size.  Needs a chip
+	// formatted with SERIALFLASH_FORMAT 2, false otherwise.
+	static bool createCompressed(const char *filename, uint32_t length);
+	// file with a checksum of every 4096 bytes, verified when read.
+	// Needs a chip formatted with SERIALFLASH_FORMAT 2, false otherwise.
+	static bool createChecked(const char *filename, uint32_t length);
 	static bool exists(const char *filename);
 	static bool remove(const char *filename);
 	static bool remove(SerialFlashFile &file);
 	static void opendir() { dirindex = 0; }
 	static bool readdir(char *filename, uint32_t strsize, uint32_t &filesize);
+	// divide a blank chip into filesystems and raw regions
+	static bool createPartitions(const SerialFlashPartition *list, uint32_t count);
+	// the filesystem partition used for files, default is the first
+	static bool useFilesystem(const char *name);
+	// a raw partition, read, written and erased as a file
+	static SerialFlashFile openPartition(const char *name);
+	// check the directory for damage, true if none (or all repaired)
+	static bool check(SerialFlashCheck &result, bool repair = false);
+	// verify createChecked() files for about this long, true until all done
+	static bool scrub(SerialFlashScrub &state, uint32_t microseconds);
+	// hold the SPI bus for many operations, see SerialFlashSession
+	static void beginSession();
+	static void endSession();
+	// optional lock for use by multiple threads, must be recursive,
+	// and a function giving a value unique to the calling thread
+	static void setLock(void (*lockfunction)(void), void (*unlockfunction)(void),
+		void *(*threadfunction)(void));
+	static void lock() {
+		if (lockfunc) {
+			lockfunc();
+			if (lockdepth++ == 0) lockowner = threadfunc();
+		}
+	}
+	static void unlock() {
+		if (lockfunc) {
+			if (--lockdepth == 0) lockowner = nullptr;
+			unlockfunc();
+		}
+	}
 private:
+	static bool createFile(const char *filename, uint32_t length,
+		uint32_t align, uint8_t fileflags);
+	static void waitUnlocked();
+	static bool holdsLock() { return lockowner == threadfunc(); }
+	static bool allReady();
+	static void recycleNext();
+	static bool eraseNext();
+	static uint32_t selectDie(uint32_t addr);
+	static uint32_t beginDie(uint32_t addr, bool next = true);
+	static void waitDie(bool next = true);
+	static bool dieReady();
+	static uint8_t suspend();
+	static void resume(uint8_t b);
+#if !defined(SERIALFLASH_HOST)
+	static void calibrateProgram(uint32_t addr, const SPISettings &test);
+#endif
+	static void wearNote(uint32_t addr);
 	static uint16_t dirindex; // current position for readdir()
+	static uint8_t session;	// nesting depth of beginSession()
+	static void (*lockfunc)(void);
+	static void (*unlockfunc)(void);
+	static void *(*threadfunc)(void);
+	static void * volatile lockowner; // thread holding the lock, if any
+	static uint8_t lockdepth; // nesting depth of lock(), by lockowner
+	static volatile uint8_t readers; // threads waiting for the lock to read
+	static volatile uint8_t readsdone; // readers which got the lock
 	static uint8_t flags;	// chip features
-	static uint8_t busy;	// 0 = ready
+	static uint8_t busy;	// selected die, 0 = ready
 				// 1 = suspendable program operation
 				// 2 = suspendable erase operation
 				// 3 = busy for realz!!
+				// 4 = page program, reads wait
+				// 5 = erase suspended by write()
+	static uint32_t readlatency; // setReadLatency() microseconds
+	static uint32_t erasenext;   // next block of a block by block eraseAll()
+	static uint32_t eraseend;
+	static uint32_t chipsize;    // capacity() of the chip found by begin()
+	static uint32_t wearaddr;    // beginWear() region, 0 length = off
+	static uint32_t wearlen;
 };
 
 extern SerialFlashChip SerialFlash;
 
 
+// Holds the lock given to SerialFlashChip::setLock(), if any.  With
+// a lock, SerialFlash may be used by several threads.  Each SerialFlash
+// function holds the lock while it uses the chip.  Writes and erases
+// release it while waiting for the chip, so reads from other threads
+// go first, suspending an erase in progress.
+class SerialFlashLock
+{
+public:
+	SerialFlashLock() { SerialFlashChip::lock(); }
+	~SerialFlashLock() { SerialFlashChip::unlock(); }
+};
+
+
+// While a SerialFlashSession exists, the SPI bus is claimed only once
+// and all SerialFlash operations reuse the same SPI transaction, which
+// saves the transaction overhead of many small reads and writes.  Other
+// SPI devices can not be used until the session goes out of scope.
+class SerialFlashSession
+{
+public:
+	SerialFlashSession() { SerialFlashChip::beginSession(); }
+	~SerialFlashSession() { SerialFlashChip::endSession(); }
+};
+
+
 class SerialFlashFile
 {
 public:
@@ -86,16 +298,24 @@ public:
 			if (offset >= length) return 0;
 			rdlen = length - offset;
 		}
-		SerialFlash.read(address + offset, buf, rdlen);
+		if (chunkbits) {
+			rdlen = readCompressed(buf, rdlen);
+		} else {
+			SerialFlash.read(address + offset, buf, rdlen);
+			// nothing is read from damaged chunks
+			if (checkbits && !verifyChecked(buf, rdlen)) return 0;
+		}
 		offset += rdlen;
 		return rdlen;
 	}
 	uint32_t write(const void *buf, uint32_t wrlen) {
+		if (chunkbits) return 0; // compressed files are read-only
 		if (offset + wrlen > length) {
 			if (offset >= length) return 0;
 			wrlen = length - offset;
 		}
 		SerialFlash.write(address + offset, buf, wrlen);
+		if (checkbits) writeChecked(offset, wrlen);
 		offset += wrlen;
 		return wrlen;
 	}
@@ -113,20 +333,292 @@ public:
 		return length - offset;
 	}
 	void erase();
+	// erase in the background, so a later erase() finishes at once
+	bool recycle() {
+		return SerialFlash.recycle(address, length);
+	}
 	void flush() {
+		SerialFlash.flush();
 	}
 	void close() {
+		SerialFlash.flush();
 	}
 	uint32_t getFlashAddress() {
 		return address;
 	}
+	// read() found data not matching its checksum, see createChecked()
+	bool damaged() {
+		return checkfailed;
+	}
 protected:
 	friend class SerialFlashChip;
+	bool openCompressed();
+	uint32_t readCompressed(void *buf, uint32_t rdlen);
+	bool openChecked();
+	bool verifyChecked(const void *buf, uint32_t rdlen);
+	void writeChecked(uint32_t start, uint32_t wrlen);
+	uint8_t checkChunk(uint32_t chunk, const void *buf);
 	uint32_t address = 0;  // where this file's data begins in the Flash, or zero
 	uint32_t length = 0;   // total length of the data in the Flash chip
 	uint32_t offset = 0; // current read/write offset in the file
 	uint16_t dirindex = 0;
+	uint8_t chunkbits = 0; // compressed in chunks of 1 << chunkbits bytes, or 0
+	uint8_t checkbits = 0; // checksums of 1 << checkbits bytes, or 0
+	bool checkfailed = false;
+	uint32_t checkaddr = 0;  // the checksum table
+	uint32_t checkedchunk = 0xFFFFFFFF; // most recently verified
+};
+
+
+// Directory entries are read in bursts of this many
+#ifndef SERIALFLASH_DIR_CHUNK
+#define SERIALFLASH_DIR_CHUNK    16
+#endif
+// Filenames are read through a buffer of this size
+#ifndef SERIALFLASH_DIR_STRBUF
+#define SERIALFLASH_DIR_STRBUF   64
+#endif
+
+// Directory listing, reading the hash table, file info and filenames
+// in large sequential reads rather than many small ones.  Each entry
+// gives the file's name, size, location in the Flash and its directory
+// index.  Entries are cached, so files created or removed while a
+// listing is in progress may not be seen until rewind().
+class SerialFlashDir
+{
+public:
+	constexpr SerialFlashDir() { }
+	void rewind() {
+		maxfiles = 0;
+		index = 0;
+		count = 0;
+		strcount = 0;
+	}
+	bool read(char *filename, uint32_t strsize, uint32_t &filesize) {
+		uint32_t address;
+		uint16_t dirindex;
+		return read(filename, strsize, filesize, address, dirindex);
+	}
+	bool read(char *filename, uint32_t strsize, uint32_t &filesize,
+		uint32_t &address, uint16_t &dirindex);
+private:
+	bool fill();
+	bool readname(uint32_t straddr, char *filename, uint32_t strsize);
+	uint32_t base = 0;	// start of the filesystem partition
+	uint32_t maxfiles = 0;	// 0 = signature not yet checked
+	uint8_t hashsize = 0;	// directory format, 2 or 4 byte hashes
+	uint8_t infosize = 0;	// 10 or 12 byte file info
+	uint16_t index = 0;	// next directory index to return
+	uint16_t first = 0;	// directory index of hashes[0]
+	uint16_t count = 0;	// number of entries cached
+	uint32_t hashes[SERIALFLASH_DIR_CHUNK] = {};
+	uint8_t fileinfo[SERIALFLASH_DIR_CHUNK * 12] = {};
+	uint32_t straddr = 0;	// flash address of strings[0]
+	uint16_t strcount = 0;	// number of bytes cached
+	char strings[SERIALFLASH_DIR_STRBUF] = {};
+};
+
+
+// Index of the files within each path, for filenames such as
+// "voices/en/0123.raw".  build() scans the directory once and keeps
+// an entry in RAM for every '/' in each filename, sorted by a hash of
+// the path.  Afterwards the files within any path can be listed,
+// counted or removed while reading only the matching entries.
+// build() returns false if the list is too small.  Files created
+// after build() are not found until build() is called again.  The
+// path given to opendir() must remain valid while using readdir().
+struct SerialFlashPathEntry {
+	uint32_t hash;
+	uint16_t dirindex;
+};
+
+class SerialFlashPathIndex
+{
+public:
+	SerialFlashPathIndex(SerialFlashPathEntry *entries, uint32_t count)
+		: list(entries), size(count) { }
+	bool build();
+	bool opendir(const char *path);
+	bool readdir(char *filename, uint32_t strsize, uint32_t &filesize);
+	uint32_t count(const char *path);
+	uint32_t remove(const char *path);
+	uint32_t entries() { return used; }
+private:
+	bool next(uint32_t &dirindex, uint32_t *fileinfo);
+	SerialFlashPathEntry *list;
+	uint32_t size;		// capacity of list
+	uint32_t used = 0;	// entries in list
+	bool valid = false;	// true after a successful build()
+	uint32_t base = 0;
+	uint32_t maxfiles = 0;
+	uint8_t hashsize = 0;
+	uint8_t infosize = 0;
+	uint32_t pos = 0;	// opendir() range of list
+	uint32_t end = 0;
+	const char *pathname = nullptr;
+	uint32_t pathlen = 0;
+};
+
+
+// Key-value store for many small settings and counters, kept in one
+// erasable file divided into 2 regions.  Each set() appends a record
+// to the active region, usually within a single page program.  begin()
+// reads every record once, building an index in RAM from the array of
+// entries given to the constructor (about 2 per key is best), so get()
+// normally needs only one read.  When the region is full, the latest
+// value of each key is copied to the other region, which then becomes
+// active.  Records are checked by CRC and regions by a generation
+// number, so a set() or compact() interrupted by power loss is ignored.
+#ifndef SERIALFLASH_KV_MAX
+#define SERIALFLASH_KV_MAX  128	// largest record, 6 + key + value
+#endif
+
+struct SerialFlashKVEntry {
+	uint32_t hash;
+	uint32_t addr;
 };
 
+class SerialFlashKV
+{
+public:
+	SerialFlashKV(SerialFlashKVEntry *entries, uint32_t count)
+		: list(entries), size(count) { }
+	bool begin(const char *filename, uint32_t regionsize);
+	bool get(const char *key, void *value, uint32_t valsize) {
+		uint32_t length;
+		return get(key, value, valsize, length);
+	}
+	bool get(const char *key, void *value, uint32_t valsize, uint32_t &length);
+	bool set(const char *key, const void *value, uint32_t length);
+	bool remove(const char *key);
+	bool compact();
+	uint32_t keys() { return used; }
+	uint32_t available() { return base ? base + regionsize - tail : 0; }
+private:
+	bool scan();
+	uint32_t lookup(const char *key, uint32_t keylen, uint32_t hash,
+		uint8_t *rec, uint32_t reclen, bool &found);
+	uint32_t append(const uint8_t *rec, uint32_t len);
+	SerialFlashKVEntry *list;
+	uint32_t size;		// capacity of list
+	uint32_t used = 0;	// keys with values
+	uint32_t slots = 0;	// entries of list in use
+	uint32_t base = 0;	// flash address of the active region, 0 = none
+	uint32_t other = 0;	// the other region
+	uint32_t regionsize = 0;
+	uint32_t tail = 0;	// where the next record is written
+	uint32_t generation = 0;
+};
+
+
+// Log of fixed size records, each beginning with a 32 bit timestamp,
+// stored in an ordinary file.  Records never cross a page, so the first
+// bytes of every page give the time of its first record.  seek() finds
+// the first record at or after any time by binary search over these
+// page headers, and then within one page, reading only a few pages of
+// even a very large log.  Timestamps must never decrease.
+class SerialFlashTimeLog
+{
+public:
+	bool begin(SerialFlashFile &file, uint32_t recordsize);
+	bool append(const void *record);
+	bool seek(uint32_t time);
+	bool read(void *record);
+	void rewind() { readpos = 0; }
+	uint32_t records() { return tail; }
+private:
+	uint32_t timeof(uint32_t n);
+	uint32_t search(uint32_t first, uint32_t last, uint32_t step, uint32_t time);
+	uint32_t addr(uint32_t n) {
+		return address + (n / perpage) * pagesize + (n % perpage) * recsize;
+	}
+	uint32_t address = 0;	// where the file begins in the Flash
+	uint32_t pagesize = 0;
+	uint32_t recsize = 0;
+	uint32_t perpage = 0;	// records in each page
+	uint32_t pages = 0;
+	uint32_t tail = 0;	// number of records written
+	uint32_t lasttime = 0;
+	uint32_t readpos = 0;	// next record read()
+};
+
+
+// Reads many files ahead of their use, such as voices of audio played
+// from the Flash.  Each stream has a ring buffer, given to open().  Call
+// update() often, from loop() or a low priority interrupt, to refill
+// the streams which are at least half empty, emptiest first, each with
+// one large read within a single SPI transaction.  read() then only
+// copies from RAM, so it is quick enough for audio interrupts.  One
+// update() and one read() may run at the same time.
+#ifndef SERIALFLASH_STREAMS
+#define SERIALFLASH_STREAMS  8
+#endif
+
+class SerialFlashStreams
+{
+public:
+	int open(SerialFlashFile &file, void *buffer, uint32_t size);
+	void close(int stream);
+	void update();
+	uint32_t read(int stream, void *buf, uint32_t len);
+	uint32_t available(int stream);
+	bool eof(int stream);
+	// reads which found too little data, and the least data buffered
+	// when read() was called, since the last stats()
+	void stats(int stream, uint32_t &underruns, uint32_t &lowest);
+private:
+	struct stream {
+		uint32_t address;	// where the file is in the Flash, 0 = unused
+		uint32_t length;
+		uint32_t pos;		// file offset of the next refill
+		uint8_t *buf;
+		uint32_t size;
+		volatile uint32_t head;	// written by update()
+		volatile uint32_t tail;	// written by read()
+		uint32_t underruns;
+		uint32_t lowest;
+	};
+	uint32_t level(const stream &s) {
+		return (s.head + s.size - s.tail) % s.size;
+	}
+	stream list[SERIALFLASH_STREAMS] = {};
+};
+
+
+// Copies data from any source, such as an SD card or serial port, into
+// a file.  The source is read while the Flash programs each page, and
+// a page is written whenever the Flash is ready, so copying takes about
+// as long as the slower of the two.  The buffer holds data read but
+// not yet written, and must be at least 2 pages (512 bytes, or 4096 on
+// NAND), or copy() returns false.
+typedef uint32_t (*SerialFlashSource)(void *buf, uint32_t len, void *context);
+
+class SerialFlashCopy
+{
+public:
+	SerialFlashCopy(void *buffer, uint32_t size)
+		: buf((uint8_t *)buffer), bufsize(size) {}
+	// create filename, length bytes long, and copy the source to it
+	bool copy(const char *filename, uint32_t length,
+		SerialFlashSource source, void *context = nullptr);
+	bool copy(SerialFlashFile &file, uint32_t length,
+		SerialFlashSource source, void *context = nullptr);
+	// read back each page as soon as it is written
+	void setVerify(bool verify) { verifypages = verify; }
+	// CRC-32 of the data copied, to compare with a known value
+	uint32_t crc() const { return crcvalue; }
+	// microseconds reading the source, and waiting for the Flash
+	void stats(uint32_t &sourceus, uint32_t &flashus) {
+		sourceus = sourcetime;
+		flashus = flashtime;
+	}
+private:
+	uint8_t *buf;
+	uint32_t bufsize;	// used in whole pages
+	bool verifypages = false;
+	uint32_t crcvalue = 0;
+	uint32_t sourcetime = 0;
+	uint32_t flashtime = 0;
+};
 
 #endif
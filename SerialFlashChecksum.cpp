@@ -0,0 +1,166 @@
+/* SerialFlash Library - for filesystem-like access to SPI Serial Flash memory
+ * https://github.com/PaulStoffregen/SerialFlash
+ * Copyright (C) 2015, Paul Stoffregen, paul@pjrc.com
+ *
+ * Development of this library was funded by PJRC.COM, LLC by sales of Teensy.
+ * Please support PJRC's efforts to develop open source software by purchasing
+ * Teensy or other genuine PJRC products.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "SerialFlash.h"
+
+/* Files with checksums, created by createChecked():
+
+  uint32_t length      // data bytes, 0xFFFFFFFF = not yet written
+  uint8_t  checkbits   // chunks of 1 << checkbits bytes
+  uint8_t  reserved[3]
+  uint32_t crc[chunks] // ~CRC-32 of each chunk, 0xFFFFFFFF = not yet written
+  data
+
+The checksum of each chunk is written when a write() reaches the end of
+the chunk, computed by reading back the data as the Flash holds it, so
+files must be written in order, as they normally are.  read() verifies
+each chunk it touches, except the one it verified most recently, so
+sequential reads verify each chunk only once, and a seek and read only
+the chunks it needs.  Whole chunks are verified from the data just
+read, others by reading the rest of the chunk.  A chunk with no
+checksum, written only partly when power was lost, is not verified,
+but scrub() counts it as unfinished.  Checksums are stored complemented,
+except a CRC-32 of 0, whose complement is the erased 0xFFFFFFFF, which
+is stored as 0xFFFFFFFE, so no checksum looks not yet written.
+*/
+
+static const uint32_t crc_table[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+// 4 bits at a time, for speed with only a small table
+uint32_t SerialFlashCRC32(uint32_t crc, const void *buf, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+
+	crc = ~crc;
+	while (len > 0) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crc_table[crc & 15];
+		crc = (crc >> 4) ^ crc_table[crc & 15];
+		len--;
+	}
+	return ~crc;
+}
+
+// CRC-32 of the Flash at addr
+static uint32_t check_crc(uint32_t addr, uint32_t len)
+{
+	uint8_t buf[256];
+	uint32_t crc = 0;
+	SerialFlashSession session;
+
+	while (len > 0) {
+		uint32_t n = (len < sizeof(buf)) ? len : sizeof(buf);
+		SerialFlash.read(addr, buf, n);
+		crc = SerialFlashCRC32(crc, buf, n);
+		addr += n;
+		len -= n;
+	}
+	return crc;
+}
+
+bool SerialFlashFile::openChecked()
+{
+	uint32_t head[2];
+
+	SerialFlash.read(address, head, 8);
+	// until the header is written, it's an ordinary file
+	if (head[0] == 0xFFFFFFFF) return true;
+	uint8_t bits = head[1] & 255;
+	if (bits < 8 || bits > 24) return false;
+	uint32_t table = 8 + ((head[0] + (1ul << bits) - 1) >> bits) * 4;
+	if (table > length || head[0] > length - table) return false;
+	checkaddr = address;
+	checkbits = bits;
+	address += table;
+	length = head[0];
+	return true;
+}
+
+// Verify a chunk, using buf if it holds the whole chunk.  Returns 0 if
+// it matches, 1 if it has no checksum yet, or 2 if damaged.
+uint8_t SerialFlashFile::checkChunk(uint32_t chunk, const void *buf)
+{
+	uint32_t start = chunk << checkbits;
+	uint32_t len = (length - start < (1ul << checkbits)) ? length - start : 1ul << checkbits;
+	uint32_t crc, stored;
+
+	SerialFlash.read(checkaddr + 8 + chunk * 4, &stored, 4);
+	if (stored == 0xFFFFFFFF) return 1;
+	if (buf) {
+		crc = SerialFlashCRC32(0, buf, len);
+	} else {
+		crc = check_crc(address + start, len);
+	}
+	if (~crc == stored || (crc == 0 && stored == 0xFFFFFFFE)) return 0;
+	return 2;
+}
+
+// Verify the chunks touched by a read of len bytes at offset, now in buf
+bool SerialFlashFile::verifyChecked(const void *buf, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint32_t end = offset + len;
+
+	if (len == 0) return true;
+	for (uint32_t chunk = offset >> checkbits; (chunk << checkbits) < end; chunk++) {
+		if (chunk == checkedchunk) continue;
+		uint32_t start = chunk << checkbits;
+		uint32_t stop = start + (1ul << checkbits);
+		if (stop > length) stop = length;
+		bool whole = start >= offset && stop <= end;
+		uint8_t r = checkChunk(chunk, whole ? p + (start - offset) : nullptr);
+		if (r == 2) {
+			checkfailed = true;
+			return false;
+		}
+		if (r == 0) checkedchunk = chunk;
+	}
+	return true;
+}
+
+// Record the checksum of every chunk which a write of len bytes at
+// start completed
+void SerialFlashFile::writeChecked(uint32_t start, uint32_t len)
+{
+	uint32_t end = start + len;
+
+	for (uint32_t chunk = start >> checkbits; (chunk << checkbits) < end; chunk++) {
+		uint32_t first = chunk << checkbits;
+		uint32_t stop = first + (1ul << checkbits);
+		if (stop > length) stop = length;
+		if (stop > end) break;
+		uint32_t crc = check_crc(address + first, stop - first);
+		crc = crc ? ~crc : 0xFFFFFFFE;
+		SerialFlash.write(checkaddr + 8 + chunk * 4, &crc, 4);
+	}
+}
@@ -26,121 +26,1406 @@
  */
 
 #include "SerialFlash.h"
+#if !defined(SERIALFLASH_HOST)	// Linux image files use SerialFlashHost.cpp
 #include "util/SerialFlash_directwrite.h"
+#include "util/SerialFlash_chiptraits.h"
 
 #define CSASSERT()  DIRECT_WRITE_LOW(cspin_basereg, cspin_bitmask)
 #define CSRELEASE() DIRECT_WRITE_HIGH(cspin_basereg, cspin_bitmask)
-#define SPICONFIG   SPISettings(50000000, MSBFIRST, SPI_MODE0)
+
+#if defined(SERIALFLASH_CHIP)
+// chip known at compile time, see util/SerialFlash_chiptraits.h
+#define CHIPFLAGS   (SERIALFLASH_CHIP::flags)
+#define SERIALFLASH_CLOCK  (SERIALFLASH_CHIP::clock)
+#else
+#define CHIPFLAGS   (flags)
+#ifndef SERIALFLASH_CLOCK
+#define SERIALFLASH_CLOCK  50000000	// fastest for the read (0x03) command
+#endif
+#endif
+
+// fastest clock tried by calibrate(), the chip's limit for fast read (0x0B)
+#ifndef SERIALFLASH_CLOCK_MAX
+#define SERIALFLASH_CLOCK_MAX  104000000
+#endif
+
+// worst case time for one page program, used by calibrate()
+#ifndef SERIALFLASH_PAGE_PROGRAM_US
+#define SERIALFLASH_PAGE_PROGRAM_US  3000
+#endif
+
+// time for the chip to wake from deep power down (tRES1)
+#ifndef SERIALFLASH_WAKEUP_US
+#define SERIALFLASH_WAKEUP_US  30
+#endif
+
+// within a session, the SPI transaction is already held, changing
+// only its settings.  A chip in deep power down is woken before it is used.
+#define SPIBEGIN()  SPIBEGIN_USING(spiprogram)
+#define SPIBEGIN_USING(settings)  do { \
+			if (!session) SPIPORT->beginTransaction(settings); \
+			else if (spisession != &(settings)) spi_settings(settings); \
+			if (powerflags) power_use(); } while (0)
+#define SPIEND()    do { if (!session) SPIPORT->endTransaction(); } while (0)
 
 uint16_t SerialFlashChip::dirindex = 0;
 uint8_t SerialFlashChip::flags = 0;
 uint8_t SerialFlashChip::busy = 0;
+uint8_t SerialFlashChip::session = 0;
+uint32_t SerialFlashChip::readlatency = 0;
+uint32_t SerialFlashChip::erasenext = 0;
+uint32_t SerialFlashChip::eraseend = 0;
+uint32_t SerialFlashChip::chipsize = 0;
+void (*SerialFlashChip::lockfunc)(void) = nullptr;
+void (*SerialFlashChip::unlockfunc)(void) = nullptr;
+void *(*SerialFlashChip::threadfunc)(void) = nullptr;
+void * volatile SerialFlashChip::lockowner = nullptr;
+uint8_t SerialFlashChip::lockdepth = 0;
+volatile uint8_t SerialFlashChip::readers = 0;
+volatile uint8_t SerialFlashChip::readsdone = 0;
 
 static volatile IO_REG_TYPE *cspin_basereg;
 static IO_REG_TYPE cspin_bitmask;
 
 static SPIClass *SPIPORT = &SPI;
 
-#define FLAG_32BIT_ADDR		0x01	// larger than 16 MByte address
-#define FLAG_STATUS_CMD70	0x02	// requires special busy flag check
-#define FLAG_DIFF_SUSPEND	0x04	// uses 2 different suspend commands
-#define FLAG_MULTI_DIE		0x08	// multiple die, don't read cross 32M barrier
-#define FLAG_256K_BLOCKS	0x10	// has 256K erase blocks
-#define FLAG_DIE_MASK		0xC0	// top 2 bits count during multi-die erase
+// SPI settings for reads, status polls and all other commands (programs,
+// erases...), which calibrate() or setClock() may change.  Above
+// SERIALFLASH_CLOCK, reads use the fast read command.
+static SPISettings spiread(SERIALFLASH_CLOCK, MSBFIRST, SPI_MODE0);
+static SPISettings spistatus(SERIALFLASH_CLOCK, MSBFIRST, SPI_MODE0);
+static SPISettings spiprogram(SERIALFLASH_CLOCK, MSBFIRST, SPI_MODE0);
+static uint32_t clockread = SERIALFLASH_CLOCK;
+static uint32_t clockstatus = SERIALFLASH_CLOCK;
+static uint32_t clockprogram = SERIALFLASH_CLOCK;
+static uint8_t readcmd = 0x03;
+static SPISettings spitest; // a clock being tried by calibrate()
+static const SPISettings *spisession; // settings of a session's transaction
+
+// Change the settings of the SPI transaction already begun.  Chip
+// select is not changed, so this may be done in the middle of a command.
+static void spi_settings(const SPISettings &settings)
+{
+	SPIPORT->endTransaction();
+	SPIPORT->beginTransaction(settings);
+	spisession = &settings;
+}
+
+// With SERIALFLASH_TRACE defined as a number of events, commands, waits,
+// suspends and resumes are recorded in a ring buffer, replacing the
+// oldest.  Each costs only a micros() and a few stores.
+#if defined(SERIALFLASH_TRACE)
+static SerialFlashTraceEvent trace_list[SERIALFLASH_TRACE];
+static uint32_t trace_count;	// events recorded since clearTrace()
+
+static void trace_add(uint8_t event, uint8_t cmd, uint32_t addr, uint32_t len, uint8_t b)
+{
+	SerialFlashTraceEvent &e = trace_list[trace_count++ % SERIALFLASH_TRACE];
+	e.micros = micros();
+	e.addr = addr;
+	e.len = (len < 0xFFFF) ? len : 0xFFFF;
+	e.cmd = cmd;
+	e.event = (event << 4) | b;
+}
+#define TRACE(event, cmd, addr, len)  trace_add(SERIALFLASH_TRACE_##event, cmd, addr, len, busy)
+
+static void trace_hex(Print &out, uint32_t n, uint8_t digits)
+{
+	while (digits > 0) {
+		uint8_t d = (n >> (--digits * 4)) & 15;
+		out.write((uint8_t)(d < 10 ? '0' + d : 'A' - 10 + d));
+	}
+}
+#else
+#define trace_add(event, cmd, addr, len, b)
+#define TRACE(event, cmd, addr, len)
+#endif
+
+// Stacked die chips (Winbond W25M, Micron MT29F4G01ADAGD) have several
+// dies behind one chip select, chosen by a die select command.  Each die
+// works on its own, so one die can be read while another is writing or
+// erasing, without suspending.  The busy state of the dies which are not
+// selected is kept in diebusy[].
+#define MAX_DIES	2
+
+static uint8_t dies = 1;
+static uint8_t curdie = 0;
+static uint8_t diebusy[MAX_DIES];
+static uint32_t eraseaddr[MAX_DIES]; // block being erased, when busy == 2
+static uint32_t programaddr[MAX_DIES]; // page being programmed, when busy == 1
+static uint32_t diesize;	// bytes of each die used by the file system
+static uint8_t diefeature;	// Micron selects the die by a feature register
+
+static void die_select(uint8_t die)
+{
+	CSASSERT();
+	if (diefeature) {
+		SPIPORT->transfer(0x1F); // set feature
+		SPIPORT->transfer(0xD0);
+		SPIPORT->transfer(die << 6);
+	} else {
+		SPIPORT->transfer(0xC2); // software die select
+		SPIPORT->transfer(die);
+	}
+	CSRELEASE();
+	curdie = die;
+}
+
+// Deep power down, begun by sleep().  The next SPIBEGIN() wakes the
+// chip and waits tRES1, so no command reaches a sleeping chip.  With
+// setAutoSleep(), the time of every use is kept, so ready() and poll()
+// can sleep after the chip has been idle long enough.
+#define POWER_ASLEEP	0x01
+#define POWER_AUTO	0x02
+
+static uint8_t powerflags;
+static uint32_t sleepafter;	// setAutoSleep() milliseconds
+static uint32_t idlesince;	// millis() at the last use
+static uint32_t sleepsince;	// millis() when sleep() began
+static uint32_t sleepms, wakeups, wakeupus;
+
+static void power_command(uint8_t cmd)
+{
+	uint8_t die = curdie;
+	trace_add(cmd == 0xB9 ? SERIALFLASH_TRACE_SLEEP : SERIALFLASH_TRACE_WAKEUP, cmd, 0, 0, 0);
+	for (uint8_t d=0; d < dies; d++) {
+		// each die of a stacked chip sleeps and wakes by itself
+		if (dies > 1) die_select(d);
+		CSASSERT();
+		SPIPORT->transfer(cmd);
+		CSRELEASE();
+	}
+	if (dies > 1) die_select(die);
+}
+
+static void power_use()
+{
+	if (powerflags & POWER_ASLEEP) {
+		uint32_t t = micros();
+		power_command(0xAB); // Wake up from deep power down command
+		delayMicroseconds(SERIALFLASH_WAKEUP_US);
+		wakeupus += micros() - t;
+		wakeups++;
+		sleepms += millis() - sleepsince;
+		powerflags &= ~POWER_ASLEEP;
+	}
+	if (powerflags & POWER_AUTO) idlesince = millis();
+}
+
+// SPI NAND Flash (Micron MT29F, Winbond W25N) is read by loading a
+// 2K page from the array into the chip's cache, then reading from the
+// cache.  Pages are programmed by loading the cache and executing the
+// program.  On-chip ECC corrects bit errors.  Blocks marked bad at the
+// factory are skipped, so the file system sees only good blocks.  A
+// block which fails to erase or program later is replaced by a spare
+// block, and marked so the next begin() replaces it too.
+//
+// A NAND page may be programmed only once between erases, so writes
+// are gathered in a RAM buffer and each page is programmed when writing
+// moves to another page, or by flush() or wait().  Changing a page
+// which is already programmed, as the directory requires, copies its
+// block to a spare block and back.  This is slow, but lets the same
+// file system work on NAND.
+
+#define NAND_PAGE_SIZE		2048
+#define NAND_BLOCK_PAGES	64
+#define NAND_BLOCK_SIZE		(NAND_PAGE_SIZE * NAND_BLOCK_PAGES)
+#define NAND_NONE		0xFFFFFFFF
+#define NAND_NOBLOCK		0xFFFF
+// a block which failed after begin() has the block replacing it, or 0
+// for none, in spare bytes 2 and 3 of its first page.  Unlike factory
+// bad blocks it is not skipped, so the blocks after it keep their place.
+#define NAND_MARK_COL		(NAND_PAGE_SIZE + 2)
+// nand_rewrite() commits a copy with the copied block's number and its
+// complement in spare bytes 4 to 7 of the copy's last page
+#define NAND_COMMIT_COL		(NAND_PAGE_SIZE + 4)
+
+static uint16_t nand_blocks;	// blocks in each die
+static uint16_t nand_maxbad;	// most bad blocks each die may have
+static uint8_t nand_planes;	// 2 planes, selected by column address bit 12
+static uint8_t nand_cacheread;	// has page cache read commands (0x30, 0x3F)
+static uint16_t *nand_bad;	// sorted lists of bad blocks, for each die
+static uint16_t nand_badcount[MAX_DIES];
+static uint16_t *nand_remap;	// failed blocks and their replacements, for each die
+static uint16_t nand_remapcount[MAX_DIES];
+static uint16_t nand_reserve[MAX_DIES];	// first block after the file system
+static uint16_t nand_spare[MAX_DIES][2]; // spare block for each plane
+static uint16_t nand_erasing[MAX_DIES];	// block erased by eraseBlock()
+static uint8_t *nand_buf;	// data waiting to be programmed
+static uint32_t nand_bufpage = NAND_NONE;
+static uint8_t nand_bufdie;
+static uint16_t nand_buflo, nand_bufhi;	// range written in nand_buf
+static uint32_t nand_corrected, nand_uncorrectable, nand_failed;
+
+// Number of dies, blocks per die and worst case bad blocks per die of
+// SPI NAND chips, given the 2 bytes after the dummy byte of the ID command
+static uint16_t nand_geometry(const uint8_t *id, uint16_t *maxbad, uint8_t *ndies)
+{
+	*ndies = 1;
+	if (id[0] == 0x2C && id[1] == 0x14) {
+		*maxbad = 20;	// Micron MT29F1G01ABAFD
+		return 1024;
+	}
+	if (id[0] == 0x2C && (id[1] == 0x24 || id[1] == 0x36)) {
+		*maxbad = 40;	// Micron MT29F2G01ABAGD
+		if (id[1] == 0x36) *ndies = 2; // MT29F4G01ADAGD
+		return 2048;
+	}
+	if (id[0] == 0xEF && (id[1] == 0xAA || id[1] == 0xAB)) {
+		*maxbad = 20;	// Winbond W25N01GV
+		if (id[1] == 0xAB) *ndies = 2; // W25M02GV
+		return 1024;
+	}
+	return 0;
+}
+
+// file system blocks in each die, leaving room for bad blocks and 2 spares
+static uint32_t nand_capacity(uint16_t blocks, uint16_t maxbad)
+{
+	return (uint32_t)(blocks - maxbad - 2) * NAND_BLOCK_SIZE;
+}
+
+// failed blocks and replacements fit in the blocks after the file system
+#define NAND_REMAP_MAX		((uint32_t)nand_maxbad + 2)
+
+static void nand_command(uint8_t cmd)
+{
+	CSASSERT();
+	SPIPORT->transfer(cmd);
+	CSRELEASE();
+}
+
+static void nand_rowcommand(uint8_t cmd, uint32_t row)
+{
+	CSASSERT();
+	SPIPORT->transfer(cmd);
+	SPIPORT->transfer(row >> 16);
+	SPIPORT->transfer16(row);
+	CSRELEASE();
+}
+
+static uint8_t nand_getfeature(uint8_t reg)
+{
+	CSASSERT();
+	SPIPORT->transfer(0x0F);
+	SPIPORT->transfer(reg);
+	uint8_t val = SPIPORT->transfer(0);
+	CSRELEASE();
+	return val;
+}
+
+static void nand_setfeature(uint8_t reg, uint8_t val)
+{
+	CSASSERT();
+	SPIPORT->transfer(0x1F);
+	SPIPORT->transfer(reg);
+	SPIPORT->transfer(val);
+	CSRELEASE();
+}
+
+// wait while the chip is busy, returns the status register
+static uint8_t nand_wait()
+{
+	uint8_t status;
+	CSASSERT();
+	SPIPORT->transfer16(0x0FC0);
+	do {
+		status = SPIPORT->transfer(0);
+	} while (status & 0x01);
+	CSRELEASE();
+	return status;
+}
+
+// count ECC results, false if the page had uncorrectable errors
+static bool nand_ecc(uint8_t status)
+{
+	switch (status & 0x30) {
+	case 0x10:
+	case 0x30:
+		nand_corrected++;
+		break;
+	case 0x20:
+		nand_uncorrectable++;
+		return false;
+	}
+	return true;
+}
+
+// read a page from the array into the chip's cache
+static bool nand_pageread(uint32_t row)
+{
+	nand_rowcommand(0x13, row);
+	return nand_ecc(nand_wait());
+}
+
+static uint16_t nand_column(uint32_t row, uint32_t col)
+{
+	// 2 plane chips have odd blocks in the second plane
+	if (nand_planes && (row & NAND_BLOCK_PAGES)) col |= 0x1000;
+	return col;
+}
+
+static void nand_readcache(uint32_t row, uint32_t col, void *buf, uint32_t len)
+{
+	CSASSERT();
+	SPIPORT->transfer(0x03);
+	SPIPORT->transfer16(nand_column(row, col));
+	SPIPORT->transfer(0); // dummy byte
+	SPIPORT->transfer(buf, len);
+	CSRELEASE();
+}
+
+// true if the page in the cache is blank, checking len bytes, which
+// may include the spare area
+static bool nand_cacheblank(uint32_t row, uint32_t len)
+{
+	uint8_t buf[64];
+	bool blank = true;
+	CSASSERT();
+	SPIPORT->transfer(0x03);
+	SPIPORT->transfer16(nand_column(row, 0));
+	SPIPORT->transfer(0);
+	for (uint32_t col=0; col < len && blank; col += sizeof(buf)) {
+		SPIPORT->transfer(buf, sizeof(buf));
+		for (uint32_t i=0; i < sizeof(buf); i++) {
+			if (buf[i] != 0xFF) blank = false;
+		}
+	}
+	CSRELEASE();
+	return blank;
+}
+
+// load data into the cache, 0x02 first sets the whole cache to 0xFF,
+// 0x84 keeps the rest of the cache unchanged
+static void nand_load(uint8_t cmd, uint32_t row, uint32_t col, const uint8_t *p, uint32_t len)
+{
+	CSASSERT();
+	SPIPORT->transfer(cmd);
+	SPIPORT->transfer16(nand_column(row, col));
+	while (len-- > 0) {
+		SPIPORT->transfer(*p++);
+	}
+	CSRELEASE();
+}
+
+// program the cache into a page, write enable must already be set
+static bool nand_program(uint32_t row)
+{
+	nand_rowcommand(0x10, row);
+	if (nand_wait() & 0x08) {
+		nand_failed++;
+		return false;
+	}
+	return true;
+}
+
+static bool nand_erase(uint32_t block)
+{
+	nand_command(0x06);
+	nand_rowcommand(0xD8, block * NAND_BLOCK_PAGES);
+	if (nand_wait() & 0x04) {
+		nand_failed++;
+		return false;
+	}
+	return true;
+}
+
+static bool nand_isbad(uint32_t block)
+{
+	const uint16_t *bad = nand_bad + curdie * nand_maxbad;
+	for (uint32_t i=0; i < nand_badcount[curdie]; i++) {
+		if (bad[i] == block) return true;
+	}
+	return false;
+}
+
+// physical block for a file system block, skipping bad blocks
+static uint32_t nand_block(uint32_t block)
+{
+	const uint16_t *bad = nand_bad + curdie * nand_maxbad;
+	for (uint32_t i=0; i < nand_badcount[curdie]; i++) {
+		if (bad[i] > block) break;
+		block++;
+	}
+	return block;
+}
+
+// true if a block failed after begin()
+static bool nand_failedblock(uint32_t block)
+{
+	const uint16_t *remap = nand_remap + curdie * NAND_REMAP_MAX * 2;
+	for (uint32_t i=0; i < nand_remapcount[curdie]; i++) {
+		if (remap[i*2] == block) return true;
+	}
+	return false;
+}
+
+// the block used in place of a physical block, which is itself unless
+// it failed after begin()
+static uint32_t nand_replaced(uint32_t block)
+{
+	const uint16_t *remap = nand_remap + curdie * NAND_REMAP_MAX * 2;
+	for (uint32_t i=0; i < nand_remapcount[curdie]; i++) {
+		if (remap[i*2] == block && remap[i*2+1]) return remap[i*2+1];
+	}
+	return block;
+}
+
+static uint32_t nand_row(uint32_t page)
+{
+	return nand_replaced(nand_block(page / NAND_BLOCK_PAGES)) * NAND_BLOCK_PAGES
+		+ page % NAND_BLOCK_PAGES;
+}
+
+// true if a block after the file system is good and not used
+static bool nand_unused(uint32_t block)
+{
+	const uint16_t *remap = nand_remap + curdie * NAND_REMAP_MAX * 2;
+	if (nand_isbad(block)) return false;
+	if (block == nand_spare[curdie][0] || block == nand_spare[curdie][1]) return false;
+	for (uint32_t i=0; i < nand_remapcount[curdie]; i++) {
+		if (remap[i*2] == block || remap[i*2+1] == block) return false;
+	}
+	return true;
+}
+
+// Stop using a block which failed, replaced by block to, or 0 for none.
+// The mark is programmed with ECC off, since the page may already be
+// programmed.  A block which failed may not take it, so it is not
+// counted as another failure.
+static void nand_markbad(uint32_t block, uint32_t to)
+{
+	uint16_t *remap = nand_remap + curdie * NAND_REMAP_MAX * 2;
+	uint32_t i, n = nand_remapcount[curdie];
+	uint8_t mark[2] = {(uint8_t)to, (uint8_t)(to >> 8)};
+
+	for (i=0; i < n; i++) {
+		// blocks replaced by this one are now replaced by to
+		if (remap[i*2+1] == block) remap[i*2+1] = to;
+	}
+	if (n < NAND_REMAP_MAX) {
+		remap[n*2] = block;
+		remap[n*2+1] = to;
+		nand_remapcount[curdie] = n + 1;
+	}
+	uint8_t config = nand_getfeature(0xB0);
+	nand_setfeature(0xB0, config & ~0x10);
+	nand_command(0x06);
+	nand_load(0x02, block * NAND_BLOCK_PAGES, NAND_MARK_COL, mark, 2);
+	nand_rowcommand(0x10, block * NAND_BLOCK_PAGES);
+	nand_wait();
+	nand_setfeature(0xB0, config);
+}
+
+// Choose and erase a new spare block for a plane, false if none is left
+static bool nand_newspare(uint32_t plane)
+{
+	nand_spare[curdie][plane] = NAND_NOBLOCK;
+	for (uint32_t block=nand_reserve[curdie]; block < nand_blocks; block++) {
+		if ((nand_planes ? (block & 1) : 0) != plane) continue;
+		if (!nand_unused(block)) continue;
+		if (nand_erase(block)) {
+			nand_spare[curdie][plane] = block;
+			return true;
+		}
+		nand_markbad(block, 0);
+	}
+	return false;
+}
+
+// Copy the pages in use of block src to block dst, through the chip's
+// cache, so both must be in the same plane.  When row is in src,
+// nand_buf is merged into that page, or replaces it if its program
+// failed.  Copies for a change are committed by a mark in dst's last
+// page, which copies back to src leave out.
+static bool nand_copy(uint32_t src, uint32_t dst, uint32_t row, bool failed)
+{
+	uint8_t buf[32];
+	uint32_t i, n;
+
+	for (i=0; i < NAND_BLOCK_PAGES; i++) {
+		uint32_t from = src * NAND_BLOCK_PAGES + i;
+		uint32_t to = dst * NAND_BLOCK_PAGES + i;
+		bool last = (i == NAND_BLOCK_PAGES - 1);
+		if (from == row && failed) {
+			nand_command(0x06);
+			nand_load(0x02, to, nand_buflo, nand_buf + nand_buflo, nand_bufhi - nand_buflo);
+		} else if (from == row) {
+			nand_pageread(from);
+			nand_command(0x06);
+			for (uint32_t col=nand_buflo; col < nand_bufhi; col += n) {
+				n = nand_bufhi - col;
+				if (n > sizeof(buf)) n = sizeof(buf);
+				nand_readcache(from, col, buf, n);
+				for (uint32_t j=0; j < n; j++) {
+					buf[j] &= nand_buf[col + j];
+				}
+				nand_load(0x84, from, col, buf, n);
+			}
+		} else {
+			nand_pageread(from);
+			// the last page of a committed copy is always programmed
+			if (nand_cacheblank(from, NAND_PAGE_SIZE) && !(last && row != NAND_NONE)) continue;
+			nand_command(0x06);
+		}
+		if (last) {
+			uint8_t mark[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+			if (row != NAND_NONE) {
+				mark[0] = src;
+				mark[1] = src >> 8;
+				mark[2] = ~src;
+				mark[3] = ~src >> 8;
+			}
+			nand_load(0x84, to, NAND_COMMIT_COL, mark, 4);
+		}
+		if (!nand_program(to)) return false;
+	}
+	return true;
+}
+
+// Copy a committed copy in spare back to block, and erase the spare.
+// If the block fails, the spare replaces it.
+static void nand_copyback(uint32_t block, uint32_t spare)
+{
+	uint32_t plane = nand_planes ? (block & 1) : 0;
+	if (nand_erase(block) && nand_copy(spare, block, NAND_NONE, false)) {
+		if (nand_erase(spare)) return;
+		nand_markbad(spare, 0);
+	} else {
+		nand_markbad(block, spare);
+	}
+	nand_newspare(plane);
+}
+
+// Change a page which is already programmed, or one which failed to
+// program.  Every page in use is copied to a spare block, merging
+// nand_buf into the changed page, and the copy is committed.  Then the
+// block is erased and the pages copied back, so power loss at any time
+// leaves either the old block or a committed copy, which begin()
+// finishes copying back.  A block which failed is replaced by the copy.
+static bool nand_rewrite(uint32_t row, bool failed)
+{
+	uint32_t block = row / NAND_BLOCK_PAGES;
+	uint32_t plane = nand_planes ? (block & 1) : 0;
+	uint32_t spare;
+
+	while (1) {
+		spare = nand_spare[curdie][plane];
+		if (spare == NAND_NOBLOCK) return false;
+		if (nand_copy(block, spare, row, failed)) break;
+		nand_markbad(spare, 0);
+		nand_newspare(plane);
+	}
+	if (!failed) {
+		nand_copyback(block, spare);
+	} else {
+		nand_markbad(block, spare);
+		nand_newspare(plane);
+	}
+	return true;
+}
+
+// An erase begun by eraseBlock() is finished, given the status.  If it
+// failed, the erased spare of the block's plane replaces the block.
+static void nand_erased(uint8_t status)
+{
+	uint32_t block = nand_erasing[curdie];
+	nand_erasing[curdie] = NAND_NOBLOCK;
+	if (!(status & 0x04)) return;
+	nand_failed++;
+	uint32_t plane = nand_planes ? (block & 1) : 0;
+	uint32_t spare = nand_spare[curdie][plane];
+	if (spare == NAND_NOBLOCK) return;
+	nand_markbad(block, spare);
+	nand_newspare(plane);
+}
+
+static bool nand_flushpage(uint32_t page)
+{
+	uint32_t row = nand_row(page);
+	nand_pageread(row);
+	// a page with only a commit mark is programmed too
+	if (!nand_cacheblank(row, NAND_PAGE_SIZE + 64)) return nand_rewrite(row, false);
+	nand_command(0x06);
+	nand_load(0x02, row, nand_buflo, nand_buf + nand_buflo, nand_bufhi - nand_buflo);
+	if (nand_program(row)) return true;
+	return nand_rewrite(row, true);
+}
+
+// program the page waiting in nand_buf
+static bool nand_flush()
+{
+	bool ok;
+	if (nand_bufpage == NAND_NONE) return true;
+	uint32_t page = nand_bufpage;
+	nand_bufpage = NAND_NONE;
+	if (nand_bufdie == curdie) return nand_flushpage(page);
+	// the page is on another die, which may still be busy
+	uint8_t die = curdie;
+	die_select(nand_bufdie);
+	uint8_t status = nand_wait();
+	if (nand_erasing[curdie] != NAND_NOBLOCK) nand_erased(status);
+	ok = nand_flushpage(page);
+	die_select(die);
+	return ok;
+}
+
+static bool nand_isbufpage(uint32_t page)
+{
+	return page == nand_bufpage && curdie == nand_bufdie;
+}
+
+static void nand_write(uint32_t addr, const uint8_t *p, uint32_t len)
+{
+	while (len > 0) {
+		uint32_t page = addr / NAND_PAGE_SIZE;
+		uint32_t col = addr % NAND_PAGE_SIZE;
+		uint32_t n = NAND_PAGE_SIZE - col;
+		if (n > len) n = len;
+		if (!nand_isbufpage(page)) {
+			nand_flush();
+			memset(nand_buf, 0xFF, NAND_PAGE_SIZE);
+			nand_bufpage = page;
+			nand_bufdie = curdie;
+			nand_buflo = NAND_PAGE_SIZE;
+			nand_bufhi = 0;
+		}
+		for (uint32_t i=0; i < n; i++) {
+			nand_buf[col + i] &= p[i];
+		}
+		if (col < nand_buflo) nand_buflo = col;
+		if (col + n > nand_bufhi) nand_bufhi = col + n;
+		addr += n;
+		p += n;
+		len -= n;
+	}
+}
+
+// Read pages, using the cache read commands when possible, so the chip
+// reads the next page from its array while the current page is read
+// from its cache.
+static void nand_read(uint32_t addr, uint8_t *p, uint32_t len)
+{
+	uint32_t page = addr / NAND_PAGE_SIZE;
+	uint32_t col = addr % NAND_PAGE_SIZE;
+	uint32_t row, nextrow=0;
+	bool pipelined = false, next = false;
+
+	if (nand_isbufpage(page)) nand_flush();
+	row = nand_row(page);
+	nand_pageread(row);
+	while (1) {
+		uint32_t n = NAND_PAGE_SIZE - col;
+		if (n > len) n = len;
+		bool more = (len > n);
+		if (more) {
+			nextrow = nand_row(page + 1);
+			// within a block, read the next page while this one
+			// is read from the cache
+			next = nand_cacheread && nextrow == row + 1
+				&& (nextrow % NAND_BLOCK_PAGES) != 0
+				&& !nand_isbufpage(page + 1);
+		} else {
+			next = false;
+		}
+		if (next) {
+			nand_rowcommand(0x30, nextrow);
+			nand_ecc(nand_wait());
+		} else if (pipelined) {
+			nand_command(0x3F);
+			nand_ecc(nand_wait());
+		}
+		nand_readcache(row, col, p, n);
+		p += n;
+		len -= n;
+		if (!more) break;
+		page++;
+		col = 0;
+		if (!next) {
+			if (nand_isbufpage(page)) nand_flush();
+			nand_pageread(nextrow);
+		}
+		pipelined = next;
+		row = nextrow;
+	}
+}
+
+// Set up a SPI NAND chip and find the bad blocks of each die
+static bool nand_begin(const uint8_t *id)
+{
+	uint16_t maxbad;
+	uint32_t block;
+
+	nand_blocks = nand_geometry(id, &maxbad, &dies);
+	nand_maxbad = maxbad;
+	nand_planes = (id[0] == 0x2C && id[1] != 0x14);
+	nand_cacheread = (id[0] == 0x2C);
+	diesize = nand_capacity(nand_blocks, nand_maxbad);
+	diefeature = (id[0] == 0x2C);
+	if (!nand_buf) {
+		// only allocated when a NAND chip is used
+		nand_buf = (uint8_t *)malloc(NAND_PAGE_SIZE + dies * maxbad * 2
+			+ dies * NAND_REMAP_MAX * 4);
+		if (!nand_buf) return false;
+	}
+	nand_bad = (uint16_t *)(nand_buf + NAND_PAGE_SIZE);
+	nand_remap = nand_bad + dies * maxbad;
+	nand_bufpage = NAND_NONE;
+	for (uint8_t die=0; die < dies; die++) {
+		uint16_t *bad = nand_bad + die * nand_maxbad;
+		if (dies > 1) die_select(die);
+		nand_command(0xFF); // reset
+		delayMicroseconds(1000);
+		nand_wait();
+		nand_setfeature(0xA0, 0x00); // unlock all blocks
+		// turn on ECC, and Winbond's buffer read mode
+		nand_setfeature(0xB0, nand_getfeature(0xB0) | (id[0] == 0xEF ? 0x18 : 0x10));
+		// bad blocks are marked in the first spare byte of their first
+		// page, blocks which failed later by nand_markbad()
+		uint16_t *remap = nand_remap + die * NAND_REMAP_MAX * 2;
+		uint32_t i, j, k, n = 0;
+		nand_badcount[die] = 0;
+		for (block=0; block < nand_blocks; block++) {
+			uint8_t mark[4];
+			nand_pageread(block * NAND_BLOCK_PAGES);
+			nand_readcache(block * NAND_BLOCK_PAGES, NAND_PAGE_SIZE, mark, 4);
+			if (mark[0] != 0xFF) {
+				if (nand_badcount[die] >= nand_maxbad) return false;
+				bad[nand_badcount[die]++] = block;
+			} else if ((mark[2] & mark[3]) != 0xFF && n < NAND_REMAP_MAX) {
+				remap[n*2] = block;
+				remap[n*2+1] = mark[2] | (mark[3] << 8);
+				n++;
+			}
+		}
+		for (i=0; i < n; i++) {
+			// follow replacements which failed too
+			for (k=0; k < n && remap[i*2+1]; k++) {
+				for (j=0; j < n && remap[j*2] != remap[i*2+1]; j++) ;
+				if (j == n) break;
+				remap[i*2+1] = remap[j*2+1];
+			}
+		}
+		nand_remapcount[die] = n;
+		nand_erasing[die] = NAND_NOBLOCK;
+		nand_reserve[die] = nand_block(diesize / NAND_BLOCK_SIZE);
+		// finish copying back committed copies, see nand_rewrite()
+		nand_spare[die][0] = nand_spare[die][1] = NAND_NOBLOCK;
+		for (block=nand_reserve[die]; block < nand_blocks; block++) {
+			uint32_t row = (block + 1) * NAND_BLOCK_PAGES - 1;
+			uint8_t mark[4];
+			if (nand_isbad(block) || nand_failedblock(block)) continue;
+			nand_pageread(row);
+			nand_readcache(row, NAND_COMMIT_COL, mark, 4);
+			uint32_t src = mark[0] | (mark[1] << 8);
+			if ((src ^ (mark[2] | (mark[3] << 8))) != 0xFFFF) continue;
+			// a copy replacing a failed block is in use
+			if (src >= nand_blocks || nand_isbad(src) || nand_failedblock(src)) continue;
+			nand_copyback(src, block);
+		}
+		// spare blocks for nand_rewrite() follow the file system
+		if (nand_spare[die][0] == NAND_NOBLOCK && !nand_newspare(0)) return false;
+		if (nand_planes && nand_spare[die][1] == NAND_NOBLOCK && !nand_newspare(1)) return false;
+	}
+	if (dies > 1) die_select(0);
+	return true;
+}
+
+// Poll the status register until the selected die is not busy
+static void status_wait(uint8_t f)
+{
+	uint8_t status;
+
+	CSASSERT();
+	if (f & FLAG_STATUS_CMD70) {
+		SPIPORT->transfer(0x70);
+		do {
+			status = SPIPORT->transfer(0);
+		} while (!(status & 0x80));
+	} else {
+		SPIPORT->transfer(0x05);
+		do {
+			status = SPIPORT->transfer(0);
+		} while ((status & 0x01));
+	}
+	CSRELEASE();
+}
+
+// Regions given to recycle() are erased one block at a time whenever
+// ready() finds the chip idle.  Blocks before next are known to be
+// erased (or erasing) until written.  The background erase is not
+// counted as busy by ready(), since reads and writes suspend it.
+#ifndef SERIALFLASH_RECYCLE_SLOTS
+#define SERIALFLASH_RECYCLE_SLOTS 4
+#endif
+#define NO_DIE 0xFF
+
+struct recycle_region {
+	uint32_t addr;
+	uint32_t next;	// next block to erase
+	uint32_t end;	// 0 = unused
+};
+static recycle_region recycle_list[SERIALFLASH_RECYCLE_SLOTS];
+static uint8_t recycle_count;	// regions in use
+static uint8_t recycle_die = NO_DIE;	// die erasing recycle_addr, if any
+static uint32_t recycle_addr;
+
+// Forget regions overlapping addr to addr+len, which is being written
+static void recycle_forget(uint32_t addr, uint32_t len)
+{
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		recycle_region &r = recycle_list[i];
+		if (r.end && addr < r.end && addr + len > r.addr) {
+			if (recycle_die != NO_DIE && recycle_addr >= r.addr
+			  && recycle_addr < r.end) {
+				// its erase in progress is no longer in the background
+				recycle_die = NO_DIE;
+			}
+			r.end = 0;
+			recycle_count--;
+		}
+	}
+}
 
 void SerialFlashChip::wait(void)
+{
+	for (uint8_t die=0; die < dies; die++) {
+		// wait for every die of a stacked chip
+		if (dies > 1) {
+			SerialFlashLock lock;
+			SPIBEGIN();
+			selectDie(die * diesize);
+			SPIEND();
+		}
+		waitDie();
+	}
+	if (CHIPFLAGS & FLAG_NAND) flush();
+}
+
+// Wait for the selected die.  Unless next is false, a block by block
+// chip erase is waited for until finished.
+void SerialFlashChip::waitDie(bool next)
 {
 	uint32_t status;
 	//Serial.print("wait-");
+	TRACE(WAIT, 0, curdie * diesize, 0);
 	while (1) {
-		SPIPORT->beginTransaction(SPICONFIG);
+		SerialFlashLock lock;
+		SPIBEGIN_USING(spistatus);
+		if (busy == 5) {
+			// continue an erase suspended by write()
+			resume(2);
+			busy = 2;
+		}
 		CSASSERT();
-		if (flags & FLAG_STATUS_CMD70) {
+		if (CHIPFLAGS & FLAG_STATUS_CMD70) {
 			// some Micron chips require this different
 			// command to detect program and erase completion
 			SPIPORT->transfer(0x70);
 			status = SPIPORT->transfer(0);
 			CSRELEASE();
-			SPIPORT->endTransaction();
+			SPIEND();
 			//Serial.printf("b=%02x.", status & 0xFF);
-			if ((status & 0x80)) break;
+			if (!(status & 0x80)) continue;
 		} else {
 			// all others work by simply reading the status reg
-			SPIPORT->transfer(0x05);
+			if (CHIPFLAGS & FLAG_NAND) {
+				SPIPORT->transfer16(0x0FC0);
+			} else {
+				SPIPORT->transfer(0x05);
+			}
 			status = SPIPORT->transfer(0);
 			CSRELEASE();
-			SPIPORT->endTransaction();
+			SPIEND();
 			//Serial.printf("b=%02x.", status & 0xFF);
-			if (!(status & 1)) break;
+			if ((status & 1)) continue;
+		}
+		busy = 0;
+		if ((CHIPFLAGS & FLAG_NAND) && nand_erasing[curdie] != NAND_NOBLOCK) {
+			SPIBEGIN();
+			nand_erased(status);
+			SPIEND();
 		}
+		if (recycle_die == curdie) recycle_die = NO_DIE;
+		// a block by block chip erase continues until finished
+		if (!next || !eraseNext()) break;
 	}
-	busy = 0;
+	TRACE(WAITED, 0, curdie * diesize, 0);
 	//Serial.println();
 }
 
+// Begin erasing the next block of a block by block eraseAll().  On
+// stacked die chips, the same block of every die erases at once.
+bool SerialFlashChip::eraseNext()
+{
+	static bool starting = false;
+	// eraseBlock() waiting for another die must not start more blocks
+	if (starting) return false;
+	bool started = false;
+	starting = true;
+	while (!started && erasenext < eraseend) {
+		uint32_t addr = erasenext;
+		erasenext += blockSize();
+		 //Serial.printf("erase next %08X\n", addr);
+		for (uint8_t die=0; die < dies; die++) {
+			// erase counts kept by beginWear() are not erased
+			if (wearlen && die * diesize + addr - wearaddr < wearlen) continue;
+			eraseBlock(die * diesize + addr);
+			started = true;
+		}
+	}
+	starting = false;
+	return started;
+}
+
+// Select the die holding addr, returns the address within that die
+uint32_t SerialFlashChip::selectDie(uint32_t addr)
+{
+	if (dies < 2) return addr;
+	uint8_t die = addr / diesize;
+	if (die != curdie) {
+		diebusy[curdie] = busy;
+		busy = diebusy[die];
+		die_select(die);
+	}
+	return addr % diesize;
+}
+
+// Begin a SPI transaction with the die holding addr selected and not
+// busy, returns the address within that die.  With next false, only
+// the block erasing is waited for, not the rest of a block by block
+// chip erase.
+uint32_t SerialFlashChip::beginDie(uint32_t addr, bool next)
+{
+	while (1) {
+		SPIBEGIN();
+		uint32_t dieaddr = selectDie(addr);
+		if (!busy) return dieaddr;
+		SPIEND();
+		waitDie(next);
+	}
+}
+
+uint32_t SerialFlashChip::dieSize()
+{
+	return (dies > 1) ? diesize : 0;
+}
+
+void SerialFlashChip::setReadLatency(uint32_t microseconds)
+{
+	readlatency = microseconds;
+}
+
+void SerialFlashChip::setClock(uint32_t read, uint32_t program, uint32_t status)
+{
+	SerialFlashLock lock;
+	spiread = SPISettings(read, MSBFIRST, SPI_MODE0);
+	spiprogram = SPISettings(program, MSBFIRST, SPI_MODE0);
+	spistatus = SPISettings(status, MSBFIRST, SPI_MODE0);
+	clockread = read;
+	clockprogram = program;
+	clockstatus = status;
+	readcmd = (read > SERIALFLASH_CLOCK) ? 0x0B : 0x03;
+	if (session) spi_settings(*spisession);
+}
+
+void SerialFlashChip::getClock(uint32_t &read, uint32_t &program, uint32_t &status)
+{
+	read = clockread;
+	program = clockprogram;
+	status = clockstatus;
+}
+
+// Clocks tried by calibrate(), slowest first.  The SPI port uses the
+// nearest it can make without going over, so some may be the same.
+static const uint32_t calibrate_clocks[] = {
+	4000000, 8000000, 12000000, 16000000, 20000000, 24000000, 30000000,
+	36000000, 40000000, 50000000, 60000000, 66000000, 80000000,
+	100000000, 104000000, 120000000, 133000000
+};
+#define CALIBRATE_STEPS  (sizeof(calibrate_clocks) / sizeof(uint32_t))
+#define CALIBRATE_SIZE   256	// bytes of test pattern in each page
+#define CALIBRATE_READS  8	// times the pattern is read at each clock
+
+// Test pattern with every kind of edge: long runs of 0 and 1,
+// alternating bits, and pseudo-random data
+static uint8_t calibrate_byte(uint32_t i)
+{
+	switch ((i >> 5) & 3) {
+	case 0: return (i & 1) ? 0x55 : 0xAA;
+	case 1: return (i & 8) ? 0x00 : 0xFF;
+	default: return ((i + 1) * 2654435761u) >> 24;
+	}
+}
+
+static bool calibrate_verify(uint32_t addr)
+{
+	uint8_t buf[64];
+
+	for (uint32_t i=0; i < CALIBRATE_SIZE; i += sizeof(buf)) {
+		SerialFlash.read(addr + i, buf, sizeof(buf));
+		for (uint32_t j=0; j < sizeof(buf); j++) {
+			if (buf[j] != calibrate_byte(i + j)) return false;
+		}
+	}
+	return true;
+}
+
+// Program the test pattern with only its data sent using the test
+// settings, so a clock too fast can't turn a command into an erase
+void SerialFlashChip::calibrateProgram(uint32_t addr, const SPISettings &test)
+{
+	SerialFlashLock lock;
+	uint32_t dieaddr = beginDie(addr);
+	CSASSERT();
+	SPIPORT->transfer(0x06); // write enable
+	CSRELEASE();
+	delayMicroseconds(1);
+	CSASSERT();
+	if (CHIPFLAGS & FLAG_32BIT_ADDR) {
+		SPIPORT->transfer(0x02); // program page command
+		SPIPORT->transfer16(dieaddr >> 16);
+		SPIPORT->transfer16(dieaddr);
+	} else {
+		SPIPORT->transfer16(0x0200 | ((dieaddr >> 16) & 255));
+		SPIPORT->transfer16(dieaddr);
+	}
+	// spisession keeps the address, so test is copied rather than used
+	spitest = test;
+	spi_settings(spitest);
+	for (uint32_t i=0; i < CALIBRATE_SIZE; i++) {
+		SPIPORT->transfer(calibrate_byte(i));
+	}
+	spi_settings(spiprogram);
+	CSRELEASE();
+	busy = 4;
+	SPIEND();
+}
+
+// Find the fastest clocks for programs, reads and status polls, by
+// stepping up each until the test pattern fails.  Programs are tested
+// first, since every command is sent at the clock of its kind, and
+// programs are read back at the slowest clock.  Status polls are tested
+// while a page programs, where a wrong status gives a failed read.
+// The region must be whole erase blocks.  Only pages within it are
+// written, and every block written is left erasing.
+bool SerialFlashChip::calibrate(uint32_t addr, uint32_t len)
+{
+	const uint32_t slow = calibrate_clocks[0];
+	uint32_t pagesize = pageSize(), blocksize = blockSize();
+	uint32_t read = slow, program = slow, status = slow;
+	uint32_t page, end = addr + len, i, n;
+	bool ok;
+
+	if (CHIPFLAGS & FLAG_NAND) return false;
+	if (addr % blocksize || len < blocksize) return false;
+	SerialFlashLock lock;
+	getClock(read, program, status);
+	setClock(slow, slow, slow);
+	eraseBlock(addr);
+	wait();
+	// the pattern, written and read back at the slowest clock
+	calibrateProgram(addr, spiprogram);
+	wait();
+	if (!calibrate_verify(addr)) {
+		setClock(read, program, status);
+		eraseBlock(addr);
+		return false;
+	}
+	page = addr + pagesize;
+	read = program = status = slow;
+	for (i=1; i < CALIBRATE_STEPS && calibrate_clocks[i] <= SERIALFLASH_CLOCK_MAX
+	  && page + pagesize <= end; i++) {
+		SPISettings test(calibrate_clocks[i], MSBFIRST, SPI_MODE0);
+		calibrateProgram(page, test);
+		wait();
+		ok = calibrate_verify(page);
+		page += pagesize;
+		if (!ok) break;
+		program = calibrate_clocks[i];
+	}
+	// read and status commands are sent at their own clock too,
+	// so neither may be faster than programs
+	for (i=1; i < CALIBRATE_STEPS && calibrate_clocks[i] <= program; i++) {
+		setClock(calibrate_clocks[i], program, slow);
+		ok = true;
+		for (n=0; n < CALIBRATE_READS && ok; n++) {
+			ok = calibrate_verify(addr);
+		}
+		if (!ok) break;
+		read = calibrate_clocks[i];
+	}
+	for (i=1; i < CALIBRATE_STEPS && calibrate_clocks[i] <= program
+	  && page + pagesize <= end; i++) {
+		setClock(read, program, calibrate_clocks[i]);
+		calibrateProgram(page, spiprogram);
+		ok = false;
+		uint32_t start = micros();
+		while (micros() - start < SERIALFLASH_PAGE_PROGRAM_US * 4) {
+			if (ready()) {
+				ok = true;
+				break;
+			}
+		}
+		// reading too early, after a wrong status, gives wrong data
+		if (ok) ok = calibrate_verify(page);
+		setClock(read, program, status);
+		busy = 4;
+		wait();
+		page += pagesize;
+		if (!ok) break;
+		status = calibrate_clocks[i];
+	}
+	setClock(read, program, status);
+	for (n=addr; n < page; n += blocksize) {
+		eraseBlock(n);
+	}
+	return true;
+}
+
+uint32_t SerialFlashChip::readTrace(SerialFlashTraceEvent *list, uint32_t count)
+{
+#if defined(SERIALFLASH_TRACE)
+	SerialFlashLock lock;
+	uint32_t n = (trace_count < SERIALFLASH_TRACE) ? trace_count : SERIALFLASH_TRACE;
+	if (count > n) count = n;
+	for (uint32_t i=0; i < count; i++) {
+		list[i] = trace_list[(trace_count - count + i) % SERIALFLASH_TRACE];
+	}
+	return count;
+#else
+	(void)list;
+	(void)count;
+	return 0;
+#endif
+}
+
+// Each event is printed as "T micros addr len cmd event" in hex
+void SerialFlashChip::dumpTrace(Print &out)
+{
+#if defined(SERIALFLASH_TRACE)
+	SerialFlashLock lock;
+	uint32_t n = (trace_count < SERIALFLASH_TRACE) ? trace_count : SERIALFLASH_TRACE;
+	out.print("# SerialFlash trace, lost ");
+	out.print((unsigned long)(trace_count - n));
+	out.println();
+	for (uint32_t i=trace_count - n; i != trace_count; i++) {
+		const SerialFlashTraceEvent &e = trace_list[i % SERIALFLASH_TRACE];
+		out.print("T ");
+		trace_hex(out, e.micros, 8);
+		out.write(' ');
+		trace_hex(out, e.addr, 8);
+		out.write(' ');
+		trace_hex(out, e.len, 4);
+		out.write(' ');
+		trace_hex(out, e.cmd, 2);
+		out.write(' ');
+		trace_hex(out, e.event, 2);
+		out.println();
+	}
+#endif
+	out.println("# end");
+}
+
+void SerialFlashChip::clearTrace()
+{
+#if defined(SERIALFLASH_TRACE)
+	SerialFlashLock lock;
+	trace_count = 0;
+#endif
+}
+
+bool SerialFlashChip::recycle(uint32_t addr, uint32_t len)
+{
+	uint32_t blocksize = blockSize();
+	if (addr & (blocksize - 1)) return false; // must begin on a block boundary
+	if (len == 0 || (len & (blocksize - 1))) return false;
+	SerialFlashLock lock;
+	recycle_forget(addr, len);
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		recycle_region &r = recycle_list[i];
+		if (r.end == 0) {
+			r.addr = addr;
+			r.next = addr;
+			r.end = addr + len;
+			recycle_count++;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Continue erasing recycle() regions, returns true until all are erased
+bool SerialFlashChip::poll()
+{
+	ready();
+	SerialFlashLock lock;
+	if (recycle_die != NO_DIE) return true;
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		if (recycle_list[i].next < recycle_list[i].end) return true;
+	}
+	return false;
+}
+
+uint32_t SerialFlashChip::recycled(uint32_t addr, uint32_t len)
+{
+	uint32_t n = 0;
+	SerialFlashLock lock;
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		recycle_region &r = recycle_list[i];
+		if (r.end && addr >= r.addr && addr < r.next) {
+			n = r.next - addr;
+			if (n > len) n = len;
+		}
+	}
+	recycle_forget(addr, len);
+	return n;
+}
+
+// Begin erasing the next block of a recycle() region, if none is erasing
+void SerialFlashChip::recycleNext()
+{
+	SerialFlashLock lock;
+	if (recycle_die != NO_DIE) return;
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		recycle_region &r = recycle_list[i];
+		if (r.next < r.end) {
+			recycle_addr = r.next;
+			r.next += blockSize();
+			eraseBlock(recycle_addr);
+			recycle_die = curdie;
+			return;
+		}
+	}
+}
+
+void SerialFlashChip::setLock(void (*lockfunction)(void), void (*unlockfunction)(void),
+	void *(*threadfunction)(void))
+{
+	threadfunc = threadfunction;
+	unlockfunc = unlockfunction;
+	lockfunc = lockfunction;
+}
+
+// With a lock, wait for the chip without holding the lock, so other
+// threads can still read (suspending an erase), and let every thread
+// already waiting to read go first.  Readers which arrive later wait,
+// so a steady stream of reads can't hold off writes forever.
+void SerialFlashChip::waitUnlocked()
+{
+	// not possible if this thread already holds the lock
+	if (!lockfunc || holdsLock()) return;
+	while (!allReady()) {
+		yield();
+	}
+	uint8_t waiting = readers, start = readsdone;
+	while (readers && (uint8_t)(readsdone - start) < waiting) {
+		yield();
+	}
+}
+
+// readers is changed by threads which don't hold the lock
+static void count_reader(volatile uint8_t &n, int8_t add)
+{
+#if defined(__GNUC__) && !defined(__AVR__)
+	__atomic_add_fetch(&n, add, __ATOMIC_SEQ_CST);
+#else
+	n += add;
+#endif
+}
+
+void SerialFlashChip::beginSession()
+{
+	lock();
+	if (session++ == 0) {
+		SPIPORT->beginTransaction(spiprogram);
+		spisession = &spiprogram;
+	}
+}
+
+void SerialFlashChip::endSession()
+{
+	if (session == 0) return;
+	if (--session == 0) SPIPORT->endTransaction();
+	unlock();
+}
+
+void SerialFlashChip::flush()
+{
+	if (!(CHIPFLAGS & FLAG_NAND)) return;
+	SerialFlashLock lock;
+	if (nand_bufpage == NAND_NONE) return;
+	beginDie(nand_bufdie * diesize);
+	nand_flush();
+	SPIEND();
+}
+
+void SerialFlashChip::nandStats(uint32_t &corrected, uint32_t &uncorrectable,
+	uint32_t &failed, uint32_t &badblocks)
+{
+	corrected = nand_corrected;
+	uncorrectable = nand_uncorrectable;
+	failed = nand_failed;
+	badblocks = 0;
+	for (uint8_t die=0; die < dies; die++) {
+		badblocks += nand_badcount[die] + nand_remapcount[die];
+	}
+}
+
 void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len)
 {
 	uint8_t *p = (uint8_t *)buf;
-	uint8_t b, f, status, cmd;
+	uint8_t b, f;
 
+	if (dies > 1 && addr % diesize + len > diesize) {
+		// split reads which cross from one die to the next
+		uint32_t n = diesize - addr % diesize;
+		read(addr, p, n);
+		read(addr + n, p + n, len - n);
+		return;
+	}
 	memset(p, 0, len);
-	f = flags;
-	SPIPORT->beginTransaction(SPICONFIG);
+	f = CHIPFLAGS;
+	bool waiting = lockfunc && !holdsLock();
+	if (waiting) count_reader(readers, 1);
+	SerialFlashLock lock;
+	if (waiting) {
+		count_reader(readers, -1);
+		readsdone++; // only changed holding the lock
+	}
+	if (f & FLAG_NAND) {
+		// NAND erase can't suspend, so reads wait for their die,
+		// but only for one block of eraseAll(), which ready()
+		// and wait() continue
+		uint32_t dieaddr = beginDie(addr, false);
+		TRACE(READ, 0x03, addr, len);
+		nand_read(dieaddr, p, len);
+		SPIEND();
+		return;
+	}
+	SPIBEGIN_USING(spiread);
+	uint32_t dieaddr = selectDie(addr);
 	b = busy;
-	if (b) {
-		// read status register ... chip may no longer be busy
-		CSASSERT();
-		if (flags & FLAG_STATUS_CMD70) {
-			SPIPORT->transfer(0x70);
-			status = SPIPORT->transfer(0);
-			if ((status & 0x80)) b = 0;
-		} else {
-			SPIPORT->transfer(0x05);
-			status = SPIPORT->transfer(0);
-			if (!(status & 1)) b = 0;
-		}
-		CSRELEASE();
-		if (b == 0) {
-			// chip is no longer busy :-)
-			busy = 0;
-		} else if (b < 3) {
-			// TODO: this may not work on Spansion chips
-			// which apparently have 2 different suspend
-			// commands, for program vs erase
-			CSASSERT();
-			SPIPORT->transfer(0x06); // write enable (Micron req'd)
-			CSRELEASE();
-			delayMicroseconds(1);
-			cmd = 0x75; //Suspend program/erase for almost all chips
-			// but Spansion just has to be different for program suspend!
-			if ((f & FLAG_DIFF_SUSPEND) && (b == 1)) cmd = 0x85;
-			CSASSERT();
-			SPIPORT->transfer(cmd); // Suspend command
-			CSRELEASE();
-			if (f & FLAG_STATUS_CMD70) {
-				// Micron chips don't actually suspend until flags read
-				CSASSERT();
-				SPIPORT->transfer(0x70);
-				do {
-					status = SPIPORT->transfer(0);
-				} while (!(status & 0x80));
-				CSRELEASE();
-			} else {
-				CSASSERT();
-				SPIPORT->transfer(0x05);
-				do {
-					status = SPIPORT->transfer(0);
-				} while ((status & 0x01));
-				CSRELEASE();
-			}
-		} else {
+	if (b == 1 && dieaddr < programaddr[curdie] + 256 && dieaddr + len > programaddr[curdie]) {
+		// a page is not readable while its program is suspended,
+		// so reads of the page being written wait for it
+		status_wait(f);
+		busy = b = 0;
+	}
+	if (b == 5) {
+		// erase already suspended by write()
+		b = 0;
+	} else if (b) {
+		b = suspend();
+		if (b >= 3) {
 			// chip is busy with an operation that can not suspend
-			SPIPORT->endTransaction();	// is this a good idea?
+			SPIEND();	// is this a good idea?
 			wait();			// should we wait without ending
 			b = 0;			// the transaction??
-			SPIPORT->beginTransaction(SPICONFIG);
+			SPIBEGIN_USING(spiread);
 		}
 	}
+	addr = selectDie(addr);
 	do {
 		uint32_t rdlen = len;
 		if (f & FLAG_MULTI_DIE) {
@@ -148,45 +1433,145 @@ void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len)
 				rdlen = 0x2000000 - (addr & 0x1FFFFFF);
 			}
 		}
+		TRACE(READ, readcmd, curdie * diesize + addr, rdlen);
 		CSASSERT();
 		// TODO: FIFO optimize....
 		if (f & FLAG_32BIT_ADDR) {
-			SPIPORT->transfer(0x03);
+			SPIPORT->transfer(readcmd);
 			SPIPORT->transfer16(addr >> 16);
 			SPIPORT->transfer16(addr);
 		} else {
-			SPIPORT->transfer16(0x0300 | ((addr >> 16) & 255));
+			SPIPORT->transfer16((readcmd << 8) | ((addr >> 16) & 255));
 			SPIPORT->transfer16(addr);
 		}
+		if (readcmd == 0x0B) SPIPORT->transfer(0); // dummy byte
 		SPIPORT->transfer(p, rdlen);
 		CSRELEASE();
 		p += rdlen;
 		addr += rdlen;
 		len -= rdlen;
 	} while (len > 0);
-	if (b) {
+	if (b) resume(b);
+	SPIEND();
+}
+
+// Suspend the program or erase in progress on the selected die.  Returns
+// the busy state to give to resume(), 0 if the die is no longer busy, or
+// 3 and up if the operation can not be suspended.
+uint8_t SerialFlashChip::suspend()
+{
+	uint8_t b = busy, f = CHIPFLAGS, status, cmd;
+
+	// read status register ... chip may no longer be busy
+	CSASSERT();
+	if (f & FLAG_STATUS_CMD70) {
+		SPIPORT->transfer(0x70);
+		status = SPIPORT->transfer(0);
+		if ((status & 0x80)) b = 0;
+	} else {
+		SPIPORT->transfer(0x05);
+		status = SPIPORT->transfer(0);
+		if (!(status & 1)) b = 0;
+	}
+	CSRELEASE();
+	if (b == 0) {
+		// chip is no longer busy :-)
+		busy = 0;
+	} else if (b < 3) {
+		// TODO: this may not work on Spansion chips
+		// which apparently have 2 different suspend
+		// commands, for program vs erase
 		CSASSERT();
 		SPIPORT->transfer(0x06); // write enable (Micron req'd)
 		CSRELEASE();
 		delayMicroseconds(1);
-		cmd = 0x7A;
-		if ((f & FLAG_DIFF_SUSPEND) && (b == 1)) cmd = 0x8A;
+		cmd = 0x75; //Suspend program/erase for almost all chips
+		// but Spansion just has to be different for program suspend!
+		if ((f & FLAG_DIFF_SUSPEND) && (b == 1)) cmd = 0x85;
+		TRACE(SUSPEND, cmd, (b == 2) ? curdie * diesize + eraseaddr[curdie] : 0, 0);
 		CSASSERT();
-		SPIPORT->transfer(cmd); // Resume program/erase
+		SPIPORT->transfer(cmd); // Suspend command
 		CSRELEASE();
+		// Micron chips don't actually suspend until flags read
+		status_wait(f);
 	}
-	SPIPORT->endTransaction();
+	return b;
+}
+
+void SerialFlashChip::resume(uint8_t b)
+{
+	uint8_t cmd;
+
+	CSASSERT();
+	SPIPORT->transfer(0x06); // write enable (Micron req'd)
+	CSRELEASE();
+	delayMicroseconds(1);
+	cmd = 0x7A;
+	if ((CHIPFLAGS & FLAG_DIFF_SUSPEND) && (b == 1)) cmd = 0x8A;
+	trace_add(SERIALFLASH_TRACE_RESUME, cmd,
+		(b == 2) ? curdie * diesize + eraseaddr[curdie] : 0, 0, b);
+	CSASSERT();
+	SPIPORT->transfer(cmd); // Resume program/erase
+	CSRELEASE();
 }
 
 void SerialFlashChip::write(uint32_t addr, const void *buf, uint32_t len)
 {
 	const uint8_t *p = (const uint8_t *)buf;
-	uint32_t max, pagelen;
+	uint32_t max, pagelen, pages=0;
+	bool suspended = false;
 
 	 //Serial.printf("WR: addr %08X, len %d\n", addr, len);
+	if (recycle_count) {
+		SerialFlashLock lock;
+		recycle_forget(addr, len);
+	}
+	if (dies > 1 && addr % diesize + len > diesize) {
+		// split writes which cross from one die to the next
+		uint32_t n = diesize - addr % diesize;
+		write(addr, p, n);
+		write(addr + n, p + n, len - n);
+		return;
+	}
+	if (CHIPFLAGS & FLAG_NAND) {
+		// pages are programmed later, when complete
+		SerialFlashLock lock;
+		uint32_t dieaddr = beginDie(addr);
+		TRACE(PROGRAM, 0x02, addr, len);
+		nand_write(dieaddr, p, len);
+		SPIEND();
+		return;
+	}
+	uint32_t since = 0, last = 0, pagetime = 0;
+	if (readlatency) since = last = micros();
 	do {
-		if (busy) wait();
-		SPIPORT->beginTransaction(SPICONFIG);
+		if (readlatency) {
+			// with a read latency limit, give other code a
+			// chance to read before the next page, if it takes
+			// as long as the last one, would pass the limit
+			uint32_t now = micros();
+			if (pages++) pagetime = now - last;
+			if (now - since + pagetime > readlatency) {
+				yield();
+				now = since = micros();
+			}
+			last = now;
+		}
+		// pages are programmed one at a time, so reads
+		// from other threads may go between them
+		if (busy != 2 && busy != 5) waitUnlocked();
+		SerialFlashLock lock;
+		SPIBEGIN();
+		uint32_t dieaddr = selectDie(addr);
+		if ((busy == 2 || busy == 5)
+		  && (dieaddr & ~(blockSize() - 1)) != eraseaddr[curdie]) {
+			// program while the erase of another block is suspended
+			if (busy == 2 && suspend() == 2) busy = 5;
+			if (busy == 5) suspended = true;
+		} else if (busy) {
+			SPIEND();
+			dieaddr = beginDie(addr);
+		}
 		CSASSERT();
 		// write enable command
 		SPIPORT->transfer(0x06);
@@ -195,14 +1580,15 @@ void SerialFlashChip::write(uint32_t addr, const void *buf, uint32_t len)
 		pagelen = (len <= max) ? len : max;
 		 //Serial.printf("WR: addr %08X, pagelen %d\n", addr, pagelen);
 		delayMicroseconds(1); // TODO: reduce this, but prefer safety first
+		TRACE(PROGRAM, 0x02, addr, pagelen);
 		CSASSERT();
-		if (flags & FLAG_32BIT_ADDR) {
+		if (CHIPFLAGS & FLAG_32BIT_ADDR) {
 			SPIPORT->transfer(0x02); // program page command
-			SPIPORT->transfer16(addr >> 16);
-			SPIPORT->transfer16(addr);
+			SPIPORT->transfer16(dieaddr >> 16);
+			SPIPORT->transfer16(dieaddr);
 		} else {
-			SPIPORT->transfer16(0x0200 | ((addr >> 16) & 255));
-			SPIPORT->transfer16(addr);
+			SPIPORT->transfer16(0x0200 | ((dieaddr >> 16) & 255));
+			SPIPORT->transfer16(dieaddr);
 		}
 		addr += pagelen;
 		len -= pagelen;
@@ -210,17 +1596,56 @@ void SerialFlashChip::write(uint32_t addr, const void *buf, uint32_t len)
 			SPIPORT->transfer(*p++);
 		} while (--pagelen > 0);
 		CSRELEASE();
-		busy = 4;
-		SPIPORT->endTransaction();
+		if (busy == 5) {
+			// the page must finish before the erase resumes
+			status_wait(CHIPFLAGS);
+		} else {
+			// with a read latency limit, reads must suspend page
+			// programs rather than waiting for them to finish
+			busy = readlatency ? 1 : 4;
+			programaddr[curdie] = dieaddr & ~255;
+		}
+		SPIEND();
 	} while (len > 0);
+	if (suspended) {
+		// let the erase continue
+		SerialFlashLock lock;
+		SPIBEGIN();
+		selectDie(addr - 1);
+		if (busy == 5) {
+			resume(2);
+			busy = 2;
+		}
+		SPIEND();
+	}
 }
 
 void SerialFlashChip::eraseAll()
 {
-	if (busy) wait();
+	waitUnlocked();
+	SerialFlashLock lock;
+	if (busy || dies > 1) wait();
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		recycle_region &r = recycle_list[i];
+		// except the erase counts, which are kept
+		if (wearlen && r.addr < wearaddr + wearlen && r.end > wearaddr) continue;
+		r.next = r.end;
+	}
 	uint8_t id[5];
 	readID(id);
 	//Serial.printf("ID: %02X %02X %02X\n", id[0], id[1], id[2]);
+	if (readlatency || wearlen || (CHIPFLAGS & FLAG_NAND)) {
+		// a bulk or die erase can not be suspended and could
+		// delay reads for minutes, so erase one block at a time,
+		// continued by ready() and wait() until all are done.
+		// SPI NAND has no chip erase command.  Erase counts
+		// must be kept, and each block counted.
+		nand_bufpage = NAND_NONE;
+		erasenext = 0;
+		eraseend = (dies > 1) ? diesize : capacity(id);
+		eraseNext();
+		return;
+	}
 	if (id[0] == 0x20 && id[2] >= 0x20 && id[2] <= 0x22) {
 		// Micron's multi-die chips require special die erase commands
 		//  N25Q512A	20 BA 20  2 dies  32 Mbyte/die   65 nm transitors
@@ -234,45 +1659,74 @@ void SerialFlashChip::eraseAll()
 		if (die_index >= die_count) return; // all dies erased :-)
 		uint8_t die_size = 2;  // in 16 Mbyte units
 		if (id[2] == 0x22) die_size = 8;
-		SPIPORT->beginTransaction(SPICONFIG);
+		SPIBEGIN();
 		CSASSERT();
 		SPIPORT->transfer(0x06); // write enable command
 		CSRELEASE();
 		 delayMicroseconds(1);
+		TRACE(ERASE, 0xC4, die_index * die_size * 16777216ul, 0);
 		CSASSERT();
 		// die erase command
 		SPIPORT->transfer(0xC4);
 		SPIPORT->transfer16((die_index * die_size) << 8);
 		SPIPORT->transfer16(0x0000);
 		CSRELEASE();
+		SPIEND();
 		 //Serial.printf("Micron erase begin\n");
 		flags |= (die_index + 1) << 6;
 	} else {
 		// All other chips support the bulk erase command
-		SPIPORT->beginTransaction(SPICONFIG);
-		CSASSERT();
-		// write enable command
-		SPIPORT->transfer(0x06);
-		CSRELEASE();
-		 delayMicroseconds(1);
-		CSASSERT();
-		// bulk erase command
-		SPIPORT->transfer(0xC7);
-		CSRELEASE();
-		SPIPORT->endTransaction();
+		SPIBEGIN();
+		for (uint8_t die=0; die < dies; die++) {
+			// all dies of stacked chips erase at once
+			selectDie(die * diesize);
+			CSASSERT();
+			// write enable command
+			SPIPORT->transfer(0x06);
+			CSRELEASE();
+			 delayMicroseconds(1);
+			TRACE(ERASE, 0xC7, die * diesize, 0);
+			CSASSERT();
+			// bulk erase command
+			SPIPORT->transfer(0xC7);
+			CSRELEASE();
+			busy = 3;
+		}
+		SPIEND();
 	}
 	busy = 3;
 }
 
 void SerialFlashChip::eraseBlock(uint32_t addr)
 {
-	uint8_t f = flags;
-	if (busy) wait();
-	SPIPORT->beginTransaction(SPICONFIG);
+	uint8_t f = CHIPFLAGS;
+	waitUnlocked();
+	SerialFlashLock lock;
+	if (wearlen) wearNote(addr);
+	addr = beginDie(addr);
+	if (f & FLAG_NAND) {
+		uint32_t block = addr / NAND_BLOCK_SIZE;
+		if (block < diesize / NAND_BLOCK_SIZE) {
+			// a page waiting to be written is lost if its block is erased
+			if (nand_bufdie == curdie && nand_bufpage / NAND_BLOCK_PAGES == block) {
+				nand_bufpage = NAND_NONE;
+			}
+			nand_flush();
+			TRACE(ERASE, 0xD8, curdie * diesize + addr, NAND_BLOCK_SIZE);
+			nand_command(0x06);
+			block = nand_replaced(nand_block(block));
+			nand_rowcommand(0xD8, block * NAND_BLOCK_PAGES);
+			nand_erasing[curdie] = block;
+			busy = 3;
+		}
+		SPIEND();
+		return;
+	}
 	CSASSERT();
 	SPIPORT->transfer(0x06); // write enable command
 	CSRELEASE();
 	 delayMicroseconds(1);
+	TRACE(ERASE, 0xD8, curdie * diesize + addr, blockSize());
 	CSASSERT();
 	if (f & FLAG_32BIT_ADDR) {
 		SPIPORT->transfer(0xD8);
@@ -283,37 +1737,88 @@ void SerialFlashChip::eraseBlock(uint32_t addr)
 		SPIPORT->transfer16(addr);
 	}
 	CSRELEASE();
-	SPIPORT->endTransaction();
+	SPIEND();
 	busy = 2;
+	eraseaddr[curdie] = addr & ~(blockSize() - 1);
 }
 
 
 bool SerialFlashChip::ready()
+{
+	if (!allReady()) return false;
+	// use idle time to erase blocks given to recycle()
+	if (recycle_count) recycleNext();
+	if (powerflags == POWER_AUTO && recycle_die == NO_DIE
+	  && !(CHIPFLAGS & FLAG_NAND) && millis() - idlesince >= sleepafter) {
+		sleep();
+	}
+	return true;
+}
+
+bool SerialFlashChip::allReady()
+{
+	bool r = true;
+	for (uint8_t die=0; die < dies; die++) {
+		// check every busy die of a stacked chip
+		if (dies > 1) {
+			if ((die == curdie ? busy : diebusy[die]) == 0) continue;
+			SerialFlashLock lock;
+			SPIBEGIN();
+			selectDie(die * diesize);
+			SPIEND();
+		}
+		if (!dieReady()) r = false;
+	}
+	return r;
+}
+
+// Check if the selected die is ready
+bool SerialFlashChip::dieReady()
 {
 	uint32_t status;
 	if (!busy) return true;
-	SPIPORT->beginTransaction(SPICONFIG);
+	SerialFlashLock lock;
+	SPIBEGIN_USING(spistatus);
+	if (busy == 5) {
+		// continue an erase suspended by write()
+		resume(2);
+		busy = 2;
+	}
 	CSASSERT();
-	if (flags & FLAG_STATUS_CMD70) {
+	if (CHIPFLAGS & FLAG_STATUS_CMD70) {
 		// some Micron chips require this different
 		// command to detect program and erase completion
 		SPIPORT->transfer(0x70);
 		status = SPIPORT->transfer(0);
 		CSRELEASE();
-		SPIPORT->endTransaction();
+		SPIEND();
 		//Serial.printf("ready=%02x\n", status & 0xFF);
-		if ((status & 0x80) == 0) return false;
+		if ((status & 0x80) == 0) return recycle_die == curdie;
 	} else {
 		// all others work by simply reading the status reg
-		SPIPORT->transfer(0x05);
+		if (CHIPFLAGS & FLAG_NAND) {
+			SPIPORT->transfer16(0x0FC0);
+		} else {
+			SPIPORT->transfer(0x05);
+		}
 		status = SPIPORT->transfer(0);
 		CSRELEASE();
-		SPIPORT->endTransaction();
+		SPIEND();
 		//Serial.printf("ready=%02x\n", status & 0xFF);
-		if ((status & 1)) return false;
+		if ((status & 1)) return recycle_die == curdie;
 	}
 	busy = 0;
-	if (flags & 0xC0) {
+	if ((CHIPFLAGS & FLAG_NAND) && nand_erasing[curdie] != NAND_NOBLOCK) {
+		SPIBEGIN();
+		nand_erased(status);
+		SPIEND();
+	}
+	if (recycle_die == curdie) recycle_die = NO_DIE;
+	if (eraseNext()) {
+		// continue a block by block erase
+		return false;
+	}
+	if (flags & FLAG_DIE_MASK) {
 		// continue a multi-die erase
 		eraseAll();
 		return false;
@@ -351,32 +1856,68 @@ bool SerialFlashChip::begin(uint8_t pin)
 	SPIPORT->begin();
 	pinMode(pin, OUTPUT);
 	CSRELEASE();
+	flags = 0;
+	busy = 0;
+	dies = 1;
+	curdie = 0;
+	memset(diebusy, 0, sizeof(diebusy));
+	memset(recycle_list, 0, sizeof(recycle_list));
+	recycle_count = 0;
+	recycle_die = NO_DIE;
+	wearlen = 0;
+	chipsize = 0;
 	readID(id);
 	if ((id[0]==0 && id[1]==0 && id[2]==0) || (id[0]==255 && id[1]==255 && id[2]==255)) {
 		return false;
 	}
+	uint16_t maxbad;
+	uint8_t ndies;
+	if (nand_geometry(id + 1, &maxbad, &ndies)) {
+#if defined(SERIALFLASH_CHIP)
+		// built for another chip, whose commands would be wrong
+		if (CHIPFLAGS != FLAG_NAND) return false;
+#endif
+		// SPI NAND sends a dummy byte before its ID
+		flags = FLAG_NAND;
+		readID(id);
+		SPIBEGIN();
+		bool ok = nand_begin(id);
+		SPIEND();
+		if (ok) chipsize = capacity(id);
+		return ok;
+	}
 	f = 0;
 	size = capacity(id);
+	if (id[0] == ID0_WINBOND && id[1] == 0x71) {
+		// W25M512JV, 2 stacked W25Q256JV dies
+		dies = 2;
+		diesize = size / 2;
+		diefeature = 0;
+	}
 	if (size > 16777216) {
 		// more than 16 Mbyte requires 32 bit addresses
 		f |= FLAG_32BIT_ADDR;
-		SPIPORT->beginTransaction(SPICONFIG);
-		if (id[0] == ID0_SPANSION) {
-			// spansion uses MSB of bank register
-			CSASSERT();
-			SPIPORT->transfer16(0x1780); // bank register write
-			CSRELEASE();
-		} else {
-			// micron & winbond & macronix use command
-			CSASSERT();
-			SPIPORT->transfer(0x06); // write enable
-			CSRELEASE();
-			delayMicroseconds(1);
-			CSASSERT();
-			SPIPORT->transfer(0xB7); // enter 4 byte addr mode
-			CSRELEASE();
+		SPIBEGIN();
+		for (uint8_t die=0; die < dies; die++) {
+			if (dies > 1) die_select(die);
+			if (id[0] == ID0_SPANSION) {
+				// spansion uses MSB of bank register
+				CSASSERT();
+				SPIPORT->transfer16(0x1780); // bank register write
+				CSRELEASE();
+			} else {
+				// micron & winbond & macronix use command
+				CSASSERT();
+				SPIPORT->transfer(0x06); // write enable
+				CSRELEASE();
+				delayMicroseconds(1);
+				CSASSERT();
+				SPIPORT->transfer(0xB7); // enter 4 byte addr mode
+				CSRELEASE();
+			}
 		}
-		SPIPORT->endTransaction();
+		if (dies > 1) die_select(0);
+		SPIEND();
 		if (id[0] == ID0_MICRON) f |= FLAG_MULTI_DIE;
 	}
 	if (id[0] == ID0_SPANSION) {
@@ -391,8 +1932,13 @@ bool SerialFlashChip::begin(uint8_t pin)
 		// Micron requires busy checks with a different command
 		f |= FLAG_STATUS_CMD70; // TODO: all or just multi-die chips?
 	}
+#if defined(SERIALFLASH_CHIP)
+	// built for another chip, whose commands would be wrong
+	if (f != CHIPFLAGS) return false;
+#endif
 	flags = f;
 	readID(id);
+	chipsize = size;
 	return true;
 }
 
@@ -400,27 +1946,59 @@ bool SerialFlashChip::begin(uint8_t pin)
 //
 void SerialFlashChip::sleep()
 {
-	if (busy) wait();
-	SPIPORT->beginTransaction(SPICONFIG);
-	CSASSERT();
-	SPIPORT->transfer(0xB9); // Deep power down command
-	CSRELEASE();
+	SerialFlashLock lock;
+	if (powerflags & POWER_ASLEEP) return;
+	if (busy || dies > 1) wait();
+	if (CHIPFLAGS & FLAG_NAND) return; // no deep power down on SPI NAND
+	SPIBEGIN();
+	power_command(0xB9); // Deep power down command
+	SPIEND();
+	powerflags |= POWER_ASLEEP;
+	sleepsince = millis();
 }
 
 void SerialFlashChip::wakeup()
 {
-	SPIPORT->beginTransaction(SPICONFIG);
+	SerialFlashLock lock;
+	if (CHIPFLAGS & FLAG_NAND) return;
+	SPIBEGIN(); // wakes the chip from sleep()
 	CSASSERT();
-	SPIPORT->transfer(0xAB); // Wake up from deep power down command
+	// also wake from a deep power down not begun by sleep()
+	SPIPORT->transfer(0xAB);
 	CSRELEASE();
+	SPIEND();
+}
+
+void SerialFlashChip::setAutoSleep(uint32_t milliseconds)
+{
+	SerialFlashLock lock;
+	sleepafter = milliseconds;
+	if (milliseconds) {
+		idlesince = millis();
+		powerflags |= POWER_AUTO;
+	} else {
+		powerflags &= ~POWER_AUTO;
+	}
+}
+
+void SerialFlashChip::sleepStats(uint32_t &asleepms, uint32_t &wakeupcount,
+	uint32_t &wakeupmicros)
+{
+	SerialFlashLock lock;
+	asleepms = sleepms;
+	if (powerflags & POWER_ASLEEP) asleepms += millis() - sleepsince;
+	wakeupcount = wakeups;
+	wakeupmicros = wakeupus;
 }
 
 void SerialFlashChip::readID(uint8_t *buf)
 {
+	SerialFlashLock lock;
 	if (busy) wait();
-	SPIPORT->beginTransaction(SPICONFIG);
+	SPIBEGIN();
 	CSASSERT();
 	SPIPORT->transfer(0x9F);
+	if (CHIPFLAGS & FLAG_NAND) SPIPORT->transfer(0); // dummy byte
 	buf[0] = SPIPORT->transfer(0); // manufacturer ID
 	buf[1] = SPIPORT->transfer(0); // memory type
 	buf[2] = SPIPORT->transfer(0); // capacity
@@ -429,14 +2007,15 @@ void SerialFlashChip::readID(uint8_t *buf)
 		buf[4] = SPIPORT->transfer(0); // sector size
 	}
 	CSRELEASE();
-	SPIPORT->endTransaction();
+	SPIEND();
 	//Serial.printf("ID: %02X %02X %02X\n", buf[0], buf[1], buf[2]);
 }
 
 void SerialFlashChip::readSerialNumber(uint8_t *buf) //needs room for 8 bytes
 {
+	SerialFlashLock lock;
 	if (busy) wait();
-	SPIPORT->beginTransaction(SPICONFIG);
+	SPIBEGIN();
 	CSASSERT();
 	SPIPORT->transfer(0x4B);			
 	SPIPORT->transfer16(0);	
@@ -445,14 +2024,19 @@ void SerialFlashChip::readSerialNumber(uint8_t *buf) //needs room for 8 bytes
 		buf[i] = SPIPORT->transfer(0);
 	}
 	CSRELEASE();
-	SPIPORT->endTransaction();
+	SPIEND();
 //	Serial.printf("Serial Number: %02X %02X %02X %02X %02X %02X %02X %02X\n", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]);
 }
 
 uint32_t SerialFlashChip::capacity(const uint8_t *id)
 {
 	uint32_t n = 1048576; // unknown chips, default to 1 MByte
+	uint16_t blocks, maxbad;
+	uint8_t ndies;
 
+	if ((blocks = nand_geometry(id, &maxbad, &ndies)) > 0) {
+		n = nand_capacity(blocks, maxbad) * ndies;
+	} else
 	if (id[0] == ID0_ADESTO && id[1] == 0x89) {
 		n = 1048576*16; //16MB
 	} else
@@ -466,6 +2050,9 @@ uint32_t SerialFlashChip::capacity(const uint8_t *id)
 		(id[0]==255 && id[1]==255 && id[2]==255)) {
 		n = 0;
 	}
+	if (id[0] == ID0_WINBOND && id[1] == 0x71) {
+		n *= 2; // W25M512JV has 2 dies
+	}
 	//Serial.printf("capacity %lu\n", n);
 	return n;
 }
@@ -473,11 +2060,19 @@ uint32_t SerialFlashChip::capacity(const uint8_t *id)
 uint32_t SerialFlashChip::blockSize()
 {
 	// Spansion chips >= 512 mbit use 256K sectors
-	if (flags & FLAG_256K_BLOCKS) return 262144;
+	if (CHIPFLAGS & FLAG_256K_BLOCKS) return 262144;
+	// SPI NAND uses 128K blocks
+	if (CHIPFLAGS & FLAG_NAND) return NAND_BLOCK_SIZE;
 	// everything else seems to have 64K sectors
 	return 65536;
 }
 
+uint32_t SerialFlashChip::pageSize()
+{
+	if (CHIPFLAGS & FLAG_NAND) return NAND_PAGE_SIZE;
+	return 256;
+}
+
 
 
 
@@ -526,5 +2121,13 @@ AT25SF128A              32      64
 // SST26VF064		8	?	BF 26 43
 // LE25U40CMC		1/2	64	62 06 13
 // Adesto AT25SF128A    16              1F 89 01
+// Micron MT29F1G01ABAFD 128	128	2C 14		0F C0			SPI NAND
+// Micron MT29F2G01ABAGD 256	128	2C 24		0F C0			SPI NAND, 2 planes
+// Winbond W25N01GV	128	128	EF AA 21	0F C0			SPI NAND
+// Winbond W25M02GV	256	128	EF AB 21	0F C0			SPI NAND, 2 dies, C2
+// Micron MT29F4G01ADAGD 512	128	2C 36		0F C0			SPI NAND, 2 dies, D0
+// Winbond W25M512JV	64	64	EF 71 19	05			2 dies, C2
 
 SerialFlashChip SerialFlash;
+
+#endif // SERIALFLASH_HOST
@@ -0,0 +1,216 @@
+/* SerialFlash Library - for filesystem-like access to SPI Serial Flash memory
+ * https://github.com/PaulStoffregen/SerialFlash
+ * Copyright (C) 2015, Paul Stoffregen, paul@pjrc.com
+ *
+ * Development of this library was funded by PJRC.COM, LLC by sales of Teensy.
+ * Please support PJRC's efforts to develop open source software by purchasing
+ * Teensy or other genuine PJRC products.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SerialFlash.h"
+
+/* Compressed files, created by createCompressed():
+
+  uint32_t length      // uncompressed bytes, 0xFFFFFFFF = not yet written
+  uint8_t  chunkbits   // chunks of 1 << chunkbits bytes
+  uint8_t  reserved[3]
+  uint32_t end[chunks] // end of each chunk, from the start of the file
+  chunk data
+
+The data is divided into chunks, each compressed separately in the LZ4
+block format, so any part of the file can be read by decoding only the
+chunks it touches.  The first chunk begins after the end[] table.  A
+chunk whose stored size equals its uncompressed size is not compressed.
+extras/compress.py creates these files.
+
+Until the header is written, open() gives an ordinary file of the
+compressed length, so the compressed data can be written like any other
+file.  Afterward, open() gives a read-only file of the uncompressed
+length, and read() decompresses.  Reads of whole chunks decode directly
+into the caller's buffer.  Other reads decode through a RAM buffer of
+SERIALFLASH_MAX_CHUNK bytes, allocated when first needed, which keeps
+the most recent chunk.
+*/
+
+#ifndef SERIALFLASH_MAX_CHUNK
+#define SERIALFLASH_MAX_CHUNK  4096
+#endif
+
+static uint8_t *chunkbuf;
+static uint32_t chunkaddr;	// file and chunk in chunkbuf, 0 = none
+static uint32_t chunknum;
+
+// Compressed data is read from the Flash in small pieces
+class ChunkInput
+{
+public:
+	ChunkInput(uint32_t addr, uint32_t stop) : next(addr), end(stop) { }
+	bool get(uint8_t &b) {
+		if (pos >= count && !fill()) return false;
+		b = buf[pos++];
+		return true;
+	}
+	bool copy(uint8_t *p, uint32_t len) {
+		uint32_t n = count - pos;
+		if (n > len) n = len;
+		memcpy(p, buf + pos, n);
+		pos += n;
+		len -= n;
+		if (len == 0) return true;
+		// long runs of literals are read directly
+		if (len > end - next) return false;
+		SerialFlash.read(next, p + n, len);
+		next += len;
+		return true;
+	}
+	bool done() { return pos >= count && next >= end; }
+private:
+	bool fill() {
+		if (next >= end) return false;
+		count = end - next;
+		if (count > sizeof(buf)) count = sizeof(buf);
+		SerialFlash.read(next, buf, count);
+		next += count;
+		pos = 0;
+		return true;
+	}
+	uint32_t next;
+	uint32_t end;
+	uint32_t pos = 0;
+	uint32_t count = 0;
+	uint8_t buf[64];
+};
+
+// LZ4 lengths of 15 continue in following bytes
+static bool lz4_length(ChunkInput &in, uint32_t &len)
+{
+	uint8_t b;
+	if (len < 15) return true;
+	do {
+		if (!in.get(b)) return false;
+		len += b;
+	} while (b == 255);
+	return true;
+}
+
+// Decode one LZ4 block of exactly size bytes
+static bool lz4_decode(ChunkInput &in, uint8_t *out, uint32_t size)
+{
+	uint8_t *p = out, *end = out + size;
+	uint8_t token, lo, hi;
+
+	while (1) {
+		if (!in.get(token)) return false;
+		uint32_t len = token >> 4;
+		if (!lz4_length(in, len)) return false;
+		if (len > (uint32_t)(end - p)) return false;
+		if (!in.copy(p, len)) return false;
+		p += len;
+		if (in.done()) break; // the last sequence has only literals
+		if (!in.get(lo) || !in.get(hi)) return false;
+		uint32_t offset = lo | (hi << 8);
+		if (offset == 0 || offset > (uint32_t)(p - out)) return false;
+		len = token & 15;
+		if (!lz4_length(in, len)) return false;
+		len += 4;
+		if (len > (uint32_t)(end - p)) return false;
+		// matches may overlap the bytes they produce
+		const uint8_t *m = p - offset;
+		while (len--) *p++ = *m++;
+	}
+	return p == end;
+}
+
+// Read the header of a compressed file.  An unwritten header gives an
+// ordinary file, so the compressed data can be written.
+bool SerialFlashFile::openCompressed()
+{
+	uint32_t head[2];
+
+	SerialFlash.read(address, head, 8);
+	if (head[0] == 0xFFFFFFFF) return true;
+	uint8_t bits = head[1];
+	if (bits < 8 || (1ul << bits) > SERIALFLASH_MAX_CHUNK) return false;
+	uint32_t chunks = (head[0] + (1ul << bits) - 1) >> bits;
+	if (8 + chunks * 4 > length) return false;
+	length = head[0];
+	chunkbits = bits;
+	SerialFlashLock lock;
+	if (chunkaddr == address) chunkaddr = 0; // may be an older file
+	return true;
+}
+
+// Decompress chunk n of this file, size bytes
+static bool chunk_decode(uint32_t address, uint32_t length, uint8_t bits,
+	uint32_t n, uint8_t *out, uint32_t size)
+{
+	uint32_t range[2];
+
+	uint32_t chunks = (length + (1ul << bits) - 1) >> bits;
+	if (n > 0) {
+		SerialFlash.read(address + 4 + n * 4, range, 8);
+	} else {
+		range[0] = 8 + chunks * 4;
+		SerialFlash.read(address + 8, range + 1, 4);
+	}
+	if (range[1] < range[0]) return false;
+	if (range[1] - range[0] == size) {
+		// stored without compression
+		SerialFlash.read(address + range[0], out, size);
+		return true;
+	}
+	ChunkInput in(address + range[0], address + range[1]);
+	return lz4_decode(in, out, size);
+}
+
+uint32_t SerialFlashFile::readCompressed(void *buf, uint32_t rdlen)
+{
+	uint8_t *p = (uint8_t *)buf;
+	uint32_t chunksize = 1ul << chunkbits;
+	uint32_t pos = offset, n = 0;
+	SerialFlashSession session;
+
+	while (n < rdlen) {
+		uint32_t chunk = pos >> chunkbits;
+		uint32_t start = pos & (chunksize - 1);
+		uint32_t size = length - (chunk << chunkbits);
+		if (size > chunksize) size = chunksize;
+		uint32_t count = size - start;
+		if (count > rdlen - n) count = rdlen - n;
+		if (count == size && !(chunkaddr == address && chunknum == chunk)) {
+			// whole chunks decode directly into the caller's buffer
+			if (!chunk_decode(address, length, chunkbits, chunk, p + n, size)) break;
+		} else {
+			if (!(chunkaddr == address && chunknum == chunk)) {
+				if (!chunkbuf) chunkbuf = (uint8_t *)malloc(SERIALFLASH_MAX_CHUNK);
+				if (!chunkbuf) break;
+				chunkaddr = 0;
+				if (!chunk_decode(address, length, chunkbits, chunk, chunkbuf, size)) break;
+				chunkaddr = address;
+				chunknum = chunk;
+			}
+			memcpy(p + n, chunkbuf + start, count);
+		}
+		n += count;
+		pos += count;
+	}
+	return n;
+}
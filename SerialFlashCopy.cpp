@@ -0,0 +1,122 @@
+/* SerialFlash Library - for filesystem-like access to SPI Serial Flash memory
+ * https://github.com/PaulStoffregen/SerialFlash
+ * Copyright (C) 2015, Paul Stoffregen, paul@pjrc.com
+ *
+ * Development of this library was funded by PJRC.COM, LLC by sales of Teensy.
+ * Please support PJRC's efforts to develop open source software by purchasing
+ * Teensy or other genuine PJRC products.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SerialFlash.h"
+
+// Data moves through the ring buffer from the source to the Flash:
+//   done     bytes written (and verified), so their space is free
+//   written  bytes given to the file's write()
+//   head     bytes read from the source
+// Pages are written only whole (except the last), so a page never
+// wraps around the end of the buffer.  Pages are the chip's, 2048 bytes
+// on NAND, and written through the file, so checked files get their
+// checksums and compressed files are refused.
+
+#ifndef SERIALFLASH_COPY_READ
+#define SERIALFLASH_COPY_READ  512	// most read from the source at once
+#endif
+
+// compare Flash at addr with the buffer
+static bool copy_verify(uint32_t addr, const uint8_t *p, uint32_t len)
+{
+	uint8_t check[64];
+
+	while (len > 0) {
+		uint32_t n = (len < sizeof(check)) ? len : sizeof(check);
+		SerialFlash.read(addr, check, n);
+		if (memcmp(check, p, n) != 0) return false;
+		addr += n;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool SerialFlashCopy::copy(const char *filename, uint32_t length,
+	SerialFlashSource source, void *context)
+{
+	if (bufsize < 2 * SerialFlash.pageSize()) return false;
+	if (!SerialFlash.create(filename, length)) return false;
+	SerialFlashFile file = SerialFlash.open(filename);
+	if (!file) return false;
+	return copy(file, length, source, context);
+}
+
+bool SerialFlashCopy::copy(SerialFlashFile &file, uint32_t length,
+	SerialFlashSource source, void *context)
+{
+	uint32_t head = 0, written = 0, done = 0, n, usec;
+	uint32_t addr = file.getFlashAddress() + file.position();
+	uint32_t pagesize = SerialFlash.pageSize();
+	uint32_t size = bufsize - bufsize % pagesize;
+
+	crcvalue = 0;
+	sourcetime = 0;
+	flashtime = 0;
+	if (!file || size < 2 * pagesize) return false;
+	if (length > file.size() - file.position()) return false;
+	while (done < length) {
+		uint32_t page = head - written;
+		if (page > pagesize) page = pagesize;
+		bool full = page > 0 && (page == pagesize || head == length);
+		if ((full || written == length) && SerialFlash.ready()) {
+			// the page written last has finished, so check it
+			if (verifypages && done < written
+			  && !copy_verify(addr + done, buf + done % size, written - done)) {
+				return false;
+			}
+			done = written;
+			if (full) {
+				// keep the Flash busy with the next page
+				if (file.write(buf + written % size, page) != page) return false;
+				written += page;
+				if (written == length) file.flush();
+				if (!verifypages) done = written;
+			}
+			continue;
+		}
+		// read the source while the page programs, only in large
+		// pieces, since each read of the source has overhead
+		n = size - head % size;
+		if (n > length - head) n = length - head;
+		if (n > SERIALFLASH_COPY_READ) n = SERIALFLASH_COPY_READ;
+		if (n > 0 && n <= size - (head - done)) {
+			usec = micros();
+			n = source(buf + head % size, n, context);
+			sourcetime += micros() - usec;
+			if (n == 0) return false; // the source ended too soon
+			crcvalue = SerialFlashCRC32(crcvalue, buf + head % size, n);
+			head += n;
+			continue;
+		}
+		// nothing to do until the Flash is ready
+		usec = micros();
+		while (!SerialFlash.ready()) ;
+		flashtime += micros() - usec;
+	}
+	return true;
+}
@@ -42,8 +42,9 @@
 
 A 32 bit signature is stored at the beginning of the flash memory.
 If 0xFFFFFFFF is seen, the entire chip should be assumed blank.
-If any value other than 0xFA96554C is found, a different data format
-is stored.  This could should refuse to access the flash.
+If any value other than 0xFA96554C or 0xFA96554D is found, a
+different data format is stored.  This could should refuse to
+access the flash.
 
 The next 4 bytes store number of files and size of the strings
 section, which allow the position of every other item to be found.
@@ -59,31 +60,170 @@ and length of the file's actual data, and the offset of its filename
 in the strings section.
 
 Strings are null terminated.  The remainder of the chip is file data.
+
+
+Version 2 format, signature 0xFA96554D:
+
+  uint32_t signature = 0xFA96554D;
+  uint16_t maxfiles
+  uint16_t stringssize  // div by 4
+  uint32_t hashes[maxfiles]
+  struct {
+    uint32_t file_begin
+    uint32_t file_length
+    uint16_t string_index  // div4
+    uint8_t  string_length
+    uint8_t  flags         // 0xFF = ordinary file
+  } fileinfo[maxfiles]
+  char strings[stringssize]
+
+The hashes are the full 32 bit FNV-1a, so false matches are rare.
+0xFFFFFFFF indicates no file allocated and 0 is a deleted file.
+Storing the filename length lets open() skip most false matches
+without reading the strings section, and compare the name with
+a single read of exactly the right size.  Filenames are still
+null terminated and are limited to 255 characters.
+
+Each flags bit which is zero changes how the file's data is stored:
+  bit 0: compressed, see SerialFlashCompress.cpp
+  bit 1: checksums, see SerialFlashChecksum.cpp
+
+Chips formatted with the original format remain fully usable.
+Blank chips are formatted with SERIALFLASH_FORMAT, which is 1
+unless defined otherwise, so older versions can still read them.
+
+
+Partition table, signature 0xFA965550, written by createPartitions():
+
+  uint32_t signature = 0xFA965550;
+  uint32_t count
+  struct {
+    uint32_t start         // multiple of the erase block size
+    uint32_t length
+    uint32_t type          // 1 = filesystem, 2 = raw
+    char     name[12]      // null terminated
+  } partition[count]
+
+The table fills the first erase block, and partitions follow.  Each
+filesystem partition holds the directory structures above at its
+start, formatted when first used.  useFilesystem() chooses which one
+open(), create() and the directory functions use, otherwise the first.
+Raw partitions have no structure, see openPartition().
 */
 
 #define DEFAULT_MAXFILES      600
 #define DEFAULT_STRINGS_SIZE  25560
+#define DEFAULT_STRINGS_SIZE_V2  23160  // same 32K total as version 1
+
+#define SIGNATURE_V1  0xFA96554C
+#define SIGNATURE_V2  0xFA96554D
+#define SIGNATURE_PARTITIONS  0xFA965550
+
+#ifndef SERIALFLASH_FORMAT
+#define SERIALFLASH_FORMAT  1
+#endif
 
+#define FILEFLAG_COMPRESSED  0x01
+#define FILEFLAG_CHECKSUM    0x02
+#define CHECKSUM_BITS        12	// createChecked() chunks of 4096 bytes
 
-static uint32_t check_signature(void)
+// Location of the directory structures, from check_signature()
+struct dirlayout {
+	uint32_t base;      // start of the filesystem partition, or 0
+	uint32_t end;       // end of the filesystem partition, 0 = chip capacity
+	uint32_t maxfiles;
+	uint32_t stringsize;
+	uint32_t hashsize;  // 2 or 4 bytes
+	uint32_t infosize;  // 10 or 12 bytes
+	uint32_t hash(uint32_t index) const {
+		return base + 8 + index * hashsize;
+	}
+	uint32_t info(uint32_t index) const {
+		return base + 8 + maxfiles * hashsize + index * infosize;
+	}
+	uint32_t strings() const {
+		return base + 8 + maxfiles * (hashsize + infosize);
+	}
+};
+
+struct partition {
+	uint32_t start;
+	uint32_t length;
+	uint32_t type;
+	char name[12];
+};
+
+static char fsname[12]; // useFilesystem(), or "" for the first
+
+// Find a partition by name, or the first of this type if name is ""
+static bool find_partition(const char *name, uint32_t type, partition &part)
+{
+	uint32_t head[2];
+
+	SerialFlash.read(0, head, 8);
+	if (head[0] != SIGNATURE_PARTITIONS) return false;
+	for (uint32_t i=0; i < head[1] && i < SERIALFLASH_PARTITIONS; i++) {
+		SerialFlash.read(8 + i * sizeof(partition), &part, sizeof(partition));
+		if (part.type != type) continue;
+		part.name[11] = 0;
+		if (name[0] == 0 || strcmp(name, part.name) == 0) return true;
+	}
+	return false;
+}
+
+static bool check_signature(dirlayout &dir)
 {
 	uint32_t sig[2];
+	partition part;
 
+	dir.base = 0;
+	dir.end = 0;
 	SerialFlash.read(0, sig, 8);
+	if (sig[0] == SIGNATURE_PARTITIONS) {
+		if (!find_partition(fsname, SERIALFLASH_FILESYSTEM, part)) return false;
+		dir.base = part.start;
+		dir.end = part.start + part.length;
+		SerialFlash.read(dir.base, sig, 8);
+	}
 	 //Serial.printf("sig: %08X %08X\n", sig[0], sig[1]);
-	if (sig[0] == 0xFA96554C) return sig[1];
 	if (sig[0] == 0xFFFFFFFF) {
-		sig[0] = 0xFA96554C;
+#if SERIALFLASH_FORMAT == 1
+		sig[0] = SIGNATURE_V1;
 		sig[1] = ((uint32_t)(DEFAULT_STRINGS_SIZE/4) << 16) | DEFAULT_MAXFILES;
-		SerialFlash.write(0, sig, 8);
+#else
+		sig[0] = SIGNATURE_V2;
+		sig[1] = ((uint32_t)(DEFAULT_STRINGS_SIZE_V2/4) << 16) | DEFAULT_MAXFILES;
+#endif
+		SerialFlash.write(dir.base, sig, 8);
 		while (!SerialFlash.ready()) ; // TODO: timeout
-		SerialFlash.read(0, sig, 8);
-		if (sig[0] == 0xFA96554C) return sig[1];
+		SerialFlash.read(dir.base, sig, 8);
+	}
+	if (sig[0] == SIGNATURE_V1) {
+		dir.hashsize = 2;
+		dir.infosize = 10;
+	} else if (sig[0] == SIGNATURE_V2) {
+		dir.hashsize = 4;
+		dir.infosize = 12;
+	} else {
+		return false;
 	}
-	return 0;
+	dir.maxfiles = sig[1] & 0xFFFF;
+	dir.stringsize = (sig[1] & 0xFFFF0000) >> 14;
+	return dir.maxfiles > 0;
 }
 
-static uint16_t filename_hash(const char *filename)
+// limit a hash to the values the directory can store
+static uint32_t hash_range(uint32_t hash, uint32_t hashsize)
+{
+	if (hashsize == 2) {
+		hash = (hash % (uint32_t)0xFFFE) + 1; // all values except 0000 & FFFF
+	} else {
+		hash = (hash % (uint32_t)0xFFFFFFFE) + 1; // except 0 & FFFFFFFF
+	}
+	return hash;
+}
+
+static uint32_t filename_hash(const char *filename, uint32_t hashsize)
 {
 	// http://isthe.com/chongo/tech/comp/fnv/
 	uint32_t hash = 2166136261;
@@ -93,8 +233,20 @@ static uint16_t filename_hash(const char *filename)
 		hash ^= *p;
 		hash *= 16777619;
 	}
-	hash = (hash % (uint32_t)0xFFFE) + 1; // all values except 0000 & FFFF
-	return hash;
+	return hash_range(hash, hashsize);
+}
+
+// read n hashes, with unused 16 bit hashes expanded to 0xFFFFFFFF
+static void read_hashes(const dirlayout &dir, uint32_t index, uint32_t *hashes, uint32_t n)
+{
+	SerialFlash.read(dir.hash(index), hashes, n * dir.hashsize);
+	if (dir.hashsize == 2) {
+		const uint16_t *h16 = (const uint16_t *)hashes;
+		while (n > 0) {
+			n--;
+			hashes[n] = (h16[n] == 0xFFFF) ? 0xFFFFFFFF : h16[n];
+		}
+	}
 }
 
 static bool filename_compare(const char *filename, uint32_t straddr)
@@ -114,6 +266,24 @@ static bool filename_compare(const char *filename, uint32_t straddr)
 	}
 }
 
+// compare a filename already known to have the correct length
+static bool filename_compare(const char *filename, uint32_t len, uint32_t straddr)
+{
+	uint32_t n;
+	char buf[32];
+
+	while (len > 0) {
+		n = len;
+		if (n > sizeof(buf)) n = sizeof(buf);
+		SerialFlash.read(straddr, buf, n);
+		if (memcmp(filename, buf, n) != 0) return false;
+		filename += n;
+		straddr += n;
+		len -= n;
+	}
+	return true;
+}
+
 #if 0
 void pbuf(const void *buf, uint32_t len)
 {
@@ -127,46 +297,56 @@ void pbuf(const void *buf, uint32_t len)
 
 SerialFlashFile SerialFlashChip::open(const char *filename)
 {
-	uint32_t maxfiles, straddr;
-	uint16_t hash, hashtable[8];
+	uint32_t straddr, len;
+	uint32_t hash, hashtable[8];
 	uint32_t i, n, index=0;
 	uint32_t buf[3];
+	dirlayout dir;
 	SerialFlashFile file;
+	SerialFlashSession session;
 
-	maxfiles = check_signature();
-	 //Serial.printf("sig: %08X\n", maxfiles);
-	if (!maxfiles) return file;
-	maxfiles &= 0xFFFF;
-	hash = filename_hash(filename);
-	 //Serial.printf("hash %04X for \"%s\"\n", hash, filename);
-	while (index < maxfiles) {
+	if (!check_signature(dir)) return file;
+	 //Serial.printf("maxfiles: %u\n", dir.maxfiles);
+	hash = filename_hash(filename, dir.hashsize);
+	len = strlen(filename);
+	 //Serial.printf("hash %08X for \"%s\"\n", hash, filename);
+	while (index < dir.maxfiles) {
 		n = 8;
-		if (n > maxfiles - index) n = maxfiles - index;
-		SerialFlash.read(8 + index * 2, hashtable, n * 2);
-		 //Serial.printf(" read %u: ", 8 + index * 2);
-		 //pbuf(hashtable, n * 2);
+		if (n > dir.maxfiles - index) n = dir.maxfiles - index;
+		read_hashes(dir, index, hashtable, n);
+		 //Serial.printf(" read %u: ", dir.hash(index));
+		 //pbuf(hashtable, n * 4);
 		for (i=0; i < n; i++) {
 			if (hashtable[i] == hash) {
 				 //Serial.printf("  hash match at index %u\n", index+i);
 				buf[2] = 0;
-				SerialFlash.read(8 + maxfiles * 2 + (index+i) * 10, buf, 10);
+				SerialFlash.read(dir.info(index+i), buf, dir.infosize);
 
-				 //Serial.printf("  maxf=%d, index=%d, i=%d\n", maxfiles, index, i);
-				 //Serial.printf("  read %u: ", 8 + maxfiles * 2 + (index+i) * 10);
-				 //pbuf(buf, 10);
-				straddr = 8 + maxfiles * 12 + buf[2] * 4;
+				 //Serial.printf("  index=%d, i=%d\n", index, i);
+				 //Serial.printf("  read %u: ", dir.info(index+i));
+				 //pbuf(buf, dir.infosize);
+				straddr = dir.strings() + (buf[2] & 0xFFFF) * 4;
 				 //Serial.printf("  straddr = %u\n", straddr);
-				if (filename_compare(filename, straddr)) {
-					 //Serial.printf("  match!\n");
-					 //Serial.printf("  addr = %u\n", buf[0]);
-					 //Serial.printf("  len =  %u\n", buf[1]);
-					file.address = buf[0];
-					file.length = buf[1];
-					file.offset = 0;
-					file.dirindex = index + i;
-					return file;
+				if (dir.hashsize == 2) {
+					if (!filename_compare(filename, straddr)) continue;
+				} else {
+					if (((buf[2] >> 16) & 255) != len) continue;
+					if (!filename_compare(filename, len, straddr)) continue;
+				}
+				 //Serial.printf("  match!\n");
+				 //Serial.printf("  addr = %u\n", buf[0]);
+				 //Serial.printf("  len =  %u\n", buf[1]);
+				file.address = buf[0];
+				file.length = buf[1];
+				file.offset = 0;
+				file.dirindex = index + i;
+				if (dir.hashsize == 4 && !(buf[2] & (FILEFLAG_COMPRESSED << 24))) {
+					if (!file.openCompressed()) return SerialFlashFile();
+				} else if (dir.hashsize == 4 && !(buf[2] & (FILEFLAG_CHECKSUM << 24))) {
+					if (!file.openChecked()) return SerialFlashFile();
 				}
-			} else if (hashtable[i] == 0xFFFF) {
+				return file;
+			} else if (hashtable[i] == 0xFFFFFFFF) {
 				return file;
 			}
 		}
@@ -187,42 +367,52 @@ bool SerialFlashChip::remove(const char *filename)
 	return remove(file);
 }
 
-bool SerialFlashChip::remove(SerialFlashFile &file)
+// To "remove" a file, we simply zero its hash in the lookup
+// table, so it can't be found by open().  The space on the
+// flash memory is not freed.
+static bool remove_index(const dirlayout &dir, uint32_t index)
 {
-	// To "remove" a file, we simply zero its hash in the lookup
-	// table, so it can't be found by open().  The space on the
-	// flash memory is not freed.
-	if (!file) return false;
-	uint16_t hash;
-	SerialFlash.read(8 + file.dirindex * 2, &hash, 2);
-	 //Serial.printf("remove hash %04X at %d index\n", hash, file.dirindex);
-	hash ^= 0xFFFF;  // write zeros to all ones
-	SerialFlash.write(8 + file.dirindex * 2, &hash, 2);
+	uint32_t hash = 0;
+	SerialFlashLock lock;
+
+	 //Serial.printf("remove index %d\n", index);
+	SerialFlash.write(dir.hash(index), &hash, dir.hashsize);
 	while (!SerialFlash.ready()) ; // wait...  TODO: timeout
-	SerialFlash.read(8 + file.dirindex * 2, &hash, 2);
+	SerialFlash.read(dir.hash(index), &hash, dir.hashsize);
 	if (hash != 0)  {
-		 //Serial.printf("remove failed, hash %04X\n", hash);
+		 //Serial.printf("remove failed, hash %08X\n", hash);
 		return false;
 	}
+	return true;
+}
+
+bool SerialFlashChip::remove(SerialFlashFile &file)
+{
+	dirlayout dir;
+
+	if (!file) return false;
+	if (!check_signature(dir)) return false;
+	if (file.dirindex >= dir.maxfiles) return false; // not in the directory
+	if (!remove_index(dir, file.dirindex)) return false;
 	file.address = 0;
 	file.length = 0;
 	return true;
 }
 
-static uint32_t find_first_unallocated_file_index(uint32_t maxfiles)
+static uint32_t find_first_unallocated_file_index(const dirlayout &dir)
 {
-	uint16_t hashtable[8];
+	uint32_t hashtable[8];
 	uint32_t i, n, index=0;
 
 	do {
 		n = 8;
-		if (index + n > maxfiles) n = maxfiles - index;
-		SerialFlash.read(8 + index * 2, hashtable, n * 2);
+		if (index + n > dir.maxfiles) n = dir.maxfiles - index;
+		read_hashes(dir, index, hashtable, n);
 		for (i=0; i < n; i++) {
-			if (hashtable[i] == 0xFFFF) return index + i;
+			if (hashtable[i] == 0xFFFFFFFF) return index + i;
 		}
 		index += n;
-	} while (index < maxfiles);
+	} while (index < dir.maxfiles);
 	return 0xFFFFFFFF;
 }
 
@@ -242,48 +432,75 @@ static uint32_t string_length(uint32_t addr)
 	}
 }
 
-//  uint32_t signature = 0xFA96554C;
-//  uint16_t maxfiles          
-//  uint16_t stringssize  // div by 4
-//  uint16_t hashes[maxfiles]
-//  struct {
-//    uint32_t file_begin
-//    uint32_t file_length
-//    uint16_t string_index  // div 4
-//  } fileinfo[maxfiles]
-//  char strings[stringssize]
-
 bool SerialFlashChip::create(const char *filename, uint32_t length, uint32_t align)
 {
-	uint32_t maxfiles, stringsize;
+	return createFile(filename, length, align, 0xFF);
+}
+
+bool SerialFlashChip::createCompressed(const char *filename, uint32_t length)
+{
+	return createFile(filename, length, 0, 0xFF & ~FILEFLAG_COMPRESSED);
+}
+
+bool SerialFlashChip::createChecked(const char *filename, uint32_t length)
+{
+	uint32_t head[2];
+	uint32_t chunks = (length + (1ul << CHECKSUM_BITS) - 1) >> CHECKSUM_BITS;
+
+	if (length > 0xFFFFFFFF - 8 - chunks * 4) return false;
+	if (!createFile(filename, 8 + chunks * 4 + length, 0,
+	  0xFF & ~FILEFLAG_CHECKSUM)) return false;
+	// until its header is written, it opens as an ordinary file
+	SerialFlashFile file = open(filename);
+	if (!file) return false;
+	head[0] = length;
+	head[1] = CHECKSUM_BITS | 0xFFFFFF00;
+	SerialFlash.write(file.getFlashAddress(), head, 8);
+	return true;
+}
+
+bool SerialFlashChip::createFile(const char *filename, uint32_t length,
+	uint32_t align, uint8_t fileflags)
+{
 	uint32_t index, buf[3];
 	uint32_t address, straddr, len;
+	dirlayout dir;
 	SerialFlashFile file;
+	SerialFlashLock lock; // other threads must not create at the same time
 
-	// check if the file already exists
-	if (exists(filename)) return false;
+	len = strlen(filename);
+	{
+		SerialFlashSession session;
 
-	// first, get the filesystem parameters
-	maxfiles = check_signature();
-	if (!maxfiles) return false;
-	stringsize = (maxfiles & 0xFFFF0000) >> 14;
-	maxfiles &= 0xFFFF;
+		// check if the file already exists
+		if (exists(filename)) return false;
 
-	// find the first unused slot for this file
-	index = find_first_unallocated_file_index(maxfiles);
-	if (index >= maxfiles) return false;
-	 //Serial.printf("index = %u\n", index);
-	// compute where to store the filename and actual data
-	straddr = 8 + maxfiles * 12;
-	if (index == 0) {
-		address = straddr + stringsize;
-	} else {
-		buf[2] = 0;
-		SerialFlash.read(8 + maxfiles * 2 + (index-1) * 10, buf, 10);
-		address = buf[0] + buf[1];
-		straddr += buf[2] * 4;
-		straddr += string_length(straddr);
-		straddr = (straddr + 3) & 0x0003FFFC;
+		// first, get the filesystem parameters
+		if (!check_signature(dir)) return false;
+		if (dir.hashsize == 4 && len > 255) return false;
+		// the original format has no file flags
+		if (dir.hashsize == 2 && fileflags != 0xFF) return false;
+
+		// find the first unused slot for this file
+		index = find_first_unallocated_file_index(dir);
+		if (index >= dir.maxfiles) return false;
+		 //Serial.printf("index = %u\n", index);
+		// compute where to store the filename and actual data
+		straddr = dir.strings();
+		if (index == 0) {
+			address = straddr + dir.stringsize;
+		} else {
+			buf[2] = 0;
+			SerialFlash.read(dir.info(index-1), buf, dir.infosize);
+			address = buf[0] + buf[1];
+			straddr += (buf[2] & 0xFFFF) * 4;
+			if (dir.hashsize == 2) {
+				straddr += string_length(straddr);
+			} else {
+				straddr += ((buf[2] >> 16) & 255) + 1;
+			}
+			straddr = dir.base + ((straddr - dir.base + 3) & 0x0003FFFC);
+		}
 	}
 	 //Serial.printf("straddr = %u\n", straddr);
 	 //Serial.printf("address = %u\n", address);
@@ -304,80 +521,625 @@ bool SerialFlashChip::create(const char *filename, uint32_t length, uint32_t ali
 		// write suspend for reading another file can't
 		// conflict on the same page (2 files never share
 		// a write page).
-		address = (address + 255) & 0xFFFFFF00;
+		uint32_t pagesize = SerialFlash.pageSize();
+		address = (address + pagesize - 1) & ~(pagesize - 1);
+	}
+	// on stacked die chips, a file which fits in one die never
+	// crosses into the next, so reading it never waits for writes
+	// or erases to files on other dies
+	uint32_t diesize = SerialFlash.dieSize();
+	if (diesize && length <= diesize && length > 0
+	  && address / diesize != (address + length - 1) / diesize) {
+		address = (address / diesize + 1) * diesize;
 	}
 	 //Serial.printf("address = %u\n", address);
 	// last check, if enough space exists...
-	len = strlen(filename);
-	// TODO: check for enough string space for filename
-	uint8_t id[5];
-	SerialFlash.readID(id);
-	if (address + length > SerialFlash.capacity(id)) return false;
+	if (straddr + len + 1 > dir.strings() + dir.stringsize) return false;
+	uint32_t end = dir.end;
+	// chipsize, since reading the ID would wait for an erase in progress
+	if (!end) end = chipsize;
+	if (address + length > end) return false;
 
 	SerialFlash.write(straddr, filename, len+1);
 	buf[0] = address;
 	buf[1] = length;
-	buf[2] = (straddr - (8 + maxfiles * 12)) / 4;
-	SerialFlash.write(8 + maxfiles * 2 + index * 10, buf, 10);
-	 //Serial.printf("  write %u: ", 8 + maxfiles * 2 + index * 10);
-	 //pbuf(buf, 10);
+	buf[2] = (straddr - dir.strings()) / 4;
+	if (dir.hashsize == 4) buf[2] |= ((uint32_t)fileflags << 24) | (len << 16);
+	SerialFlash.write(dir.info(index), buf, dir.infosize);
+	 //Serial.printf("  write %u: ", dir.info(index));
+	 //pbuf(buf, dir.infosize);
 	while (!SerialFlash.ready()) ;  // TODO: timeout
 	 
-	buf[0] = filename_hash(filename);
-	 //Serial.printf("hash = %04X\n", buf[0]);
-	SerialFlash.write(8 + index * 2, buf, 2);
+	buf[0] = filename_hash(filename, dir.hashsize);
+	 //Serial.printf("hash = %08X\n", buf[0]);
+	SerialFlash.write(dir.hash(index), buf, dir.hashsize);
 	while (!SerialFlash.ready()) ;  // TODO: timeout
 	return true;
 }
 
+bool SerialFlashChip::createPartitions(const SerialFlashPartition *list, uint32_t count)
+{
+	uint32_t table[2 + SERIALFLASH_PARTITIONS * sizeof(partition) / 4];
+	partition *part = (partition *)(table + 2);
+	uint32_t start, length;
+	SerialFlashLock lock;
+	SerialFlashSession session;
+
+	if (count == 0 || count > SERIALFLASH_PARTITIONS) return false;
+	if (8 + count * sizeof(partition) > SerialFlash.pageSize()) return false;
+	// only a blank chip, since a filesystem may already be at address 0
+	SerialFlash.read(0, table, 8);
+	if (table[0] != 0xFFFFFFFF) return false;
+	uint32_t blocksize = SerialFlash.blockSize();
+	uint32_t capacity = chipsize;
+	// partitions follow the table's erase block
+	start = blocksize;
+	for (uint32_t i=0; i < count; i++) {
+		if (strlen(list[i].name) > 11) return false;
+		if (list[i].type != SERIALFLASH_FILESYSTEM && list[i].type != SERIALFLASH_RAW) return false;
+		length = list[i].length ? list[i].length : capacity - start;
+		length = (length + blocksize - 1) & ~(blocksize - 1);
+		if (length == 0 || start + length > capacity) return false;
+		memset(part + i, 0, sizeof(partition));
+		part[i].start = start;
+		part[i].length = length;
+		part[i].type = list[i].type;
+		strcpy(part[i].name, list[i].name);
+		start += length;
+	}
+	// the whole table is written within one page
+	table[0] = SIGNATURE_PARTITIONS;
+	table[1] = count;
+	SerialFlash.write(0, table, 8 + count * sizeof(partition));
+	while (!SerialFlash.ready()) ;  // TODO: timeout
+	return true;
+}
+
+bool SerialFlashChip::useFilesystem(const char *name)
+{
+	partition part;
+	SerialFlashLock lock;
+	SerialFlashSession session;
+
+	if (strlen(name) > 11) return false;
+	if (!find_partition(name, SERIALFLASH_FILESYSTEM, part)) return false;
+	strcpy(fsname, name);
+	dirindex = 0; // restart readdir()
+	return true;
+}
+
+SerialFlashFile SerialFlashChip::openPartition(const char *name)
+{
+	partition part;
+	SerialFlashFile file;
+	SerialFlashSession session;
+
+	if (!find_partition(name, SERIALFLASH_RAW, part)) return file;
+	file.address = part.start;
+	file.length = part.length;
+	file.offset = 0;
+	file.dirindex = 0xFFFF; // not in any directory
+	return file;
+}
+
+// Sequential reader for the string region, which create() fills in
+// order, so checking every name takes only a few large reads.
+struct stringreader {
+	uint32_t start, end;	// flash held in buf
+	uint32_t limit;		// end of the string region
+	uint8_t buf[256];
+	int get(uint32_t addr) {
+		if (addr >= limit) return -1;
+		if (addr < start || addr >= end) {
+			start = addr;
+			end = addr + sizeof(buf);
+			if (end > limit) end = limit;
+			SerialFlash.read(start, buf, end - start);
+		}
+		return buf[addr - start];
+	}
+};
+
+// Hash the name at addr, which must end with a zero after len
+// characters, or anywhere if len is -1 (the original format).
+// Returns the length, or -1 if the name is unterminated.
+static int32_t check_name(stringreader &str, uint32_t addr, int32_t len, uint32_t &hash)
+{
+	uint32_t h = 2166136261;
+
+	for (int32_t i=0; ; i++) {
+		int c = str.get(addr + i);
+		if (c < 0 || (c == 0 && len >= 0 && i != len)) return -1;
+		if (c == 0) {
+			hash = h;
+			return i;
+		}
+		if (i == len) return -1;
+		h ^= (char)c;
+		h *= 16777619;
+	}
+}
+
+// Check a directory entry lies where create() would have put it,
+// after the previous file and name, and advance past it.
+static bool check_entry(const dirlayout &dir, stringreader &str, const uint8_t *entry,
+	bool deleted, uint32_t end, uint32_t &nextaddr, uint32_t &nextstr, uint32_t &hash)
+{
+	uint32_t info[3] = {0, 0, 0};
+	int32_t len = -1;
+	bool ok;
+
+	memcpy(info, entry, dir.infosize);
+	uint32_t straddr = dir.strings() + (info[2] & 0xFFFF) * 4;
+	if (dir.hashsize == 4) len = (info[2] >> 16) & 255;
+	ok = straddr == nextstr && info[0] >= nextaddr
+		&& info[0] <= end && info[1] <= end - info[0];
+	// the name of a removed file only reserves its space
+	if (!deleted || len < 0) {
+		int32_t n = check_name(str, straddr, len, hash);
+		if (n < 0) ok = false;
+		else len = n;
+	}
+	if (len >= 0) {
+		nextstr = straddr + len + 1;
+		nextstr = dir.base + ((nextstr - dir.base + 3) & ~3u);
+	}
+	if (ok) nextaddr = info[0] + info[1];
+	return ok;
+}
+
+static bool blank(const uint8_t *p, uint32_t len)
+{
+	while (len > 0) {
+		if (*p++ != 0xFF) return false;
+		len--;
+	}
+	return true;
+}
+
+// A removed, empty file holding a name left by an interrupted create(),
+// so the next create() writes its name after it.  Only the newer format
+// stores the name's length, so the original format can't be repaired.
+static bool reserve_name(const dirlayout &dir, uint32_t index,
+	uint32_t address, uint32_t straddr, uint32_t len)
+{
+	uint32_t info[3];
+
+	if (dir.hashsize != 4 || len > 255) return false;
+	info[0] = address;
+	info[1] = 0;
+	info[2] = ((straddr - dir.strings()) / 4) | (len << 16) | 0xFF000000;
+	SerialFlash.write(dir.info(index), info, dir.infosize);
+	while (!SerialFlash.ready()) ; // TODO: timeout
+	return remove_index(dir, index);
+}
+
+// Check the whole directory in one pass, reading the hashes, file info
+// and names in large sequential pieces.  Every entry must follow the one
+// before, in capacity, with a terminated name matching its hash.  Power
+// lost during create() leaves a name or file info without its hash,
+// which would corrupt the next create(), so with repair these (and
+// entries whose hash is damaged) become removed files.
+bool SerialFlashChip::check(SerialFlashCheck &result, bool repair)
+{
+	uint32_t hashes[SERIALFLASH_DIR_CHUNK];
+	uint8_t fileinfo[SERIALFLASH_DIR_CHUNK * 12];
+	uint32_t index, i, n, hash, end, nextaddr, nextstr;
+	bool inuse = true;
+	stringreader str;
+	dirlayout dir;
+	SerialFlashLock lock;
+	SerialFlashSession session;
+
+	memset(&result, 0, sizeof(result));
+	if (!check_signature(dir)) {
+		result.damaged = 1;
+		return false;
+	}
+	end = dir.end;
+	if (!end) end = chipsize;
+	str.start = str.end = 0;
+	str.limit = dir.strings() + dir.stringsize;
+	nextstr = dir.strings();
+	nextaddr = str.limit;
+	for (index=0; index < dir.maxfiles; index += n) {
+		n = dir.maxfiles - index;
+		if (n > SERIALFLASH_DIR_CHUNK) n = SERIALFLASH_DIR_CHUNK;
+		read_hashes(dir, index, hashes, n);
+		SerialFlash.read(dir.info(index), fileinfo, n * dir.infosize);
+		for (i=0; i < n; i++) {
+			const uint8_t *entry = fileinfo + i * dir.infosize;
+			if (!inuse) {
+				// nothing is written after the first unused entry
+				if (hashes[i] != 0xFFFFFFFF || !blank(entry, dir.infosize)) {
+					result.damaged++;
+				}
+				continue;
+			}
+			if (hashes[i] == 0xFFFFFFFF) {
+				inuse = false;
+				if (!blank(entry, dir.infosize)) {
+					// create() wrote the file info, but not its hash
+					result.unfinished++;
+					if (check_entry(dir, str, entry, true, end, nextaddr, nextstr, hash)
+					  && repair && remove_index(dir, index + i)) {
+						result.repaired++;
+						result.deleted++;
+					}
+					continue;
+				}
+				// or only the name
+				uint32_t len = 0;
+				for (uint32_t j=0; j < 256; j++) {
+					int c = str.get(nextstr + j);
+					if (c < 0) break;
+					if (c != 0xFF) len = j + 1;
+				}
+				if (len > 0) {
+					result.unfinished++;
+					if (repair && reserve_name(dir, index + i, nextaddr, nextstr, len)) {
+						result.repaired++;
+						result.deleted++;
+					}
+				}
+				continue;
+			}
+			bool deleted = (hashes[i] == 0);
+			if (!check_entry(dir, str, entry, deleted, end, nextaddr, nextstr, hash)) {
+				result.damaged++;
+			} else if (deleted) {
+				result.deleted++;
+			} else if (hashes[i] != hash_range(hash, dir.hashsize)) {
+				// probably power lost while writing the hash
+				result.damaged++;
+				if (repair && remove_index(dir, index + i)) {
+					result.repaired++;
+					result.deleted++;
+				}
+			} else {
+				result.files++;
+			}
+		}
+	}
+	result.free = (end > nextaddr) ? end - nextaddr : 0;
+	return result.damaged + result.unfinished == result.repaired;
+}
+
+// Verify createChecked() files a piece at a time, continuing where the
+// last call stopped, until about microseconds have passed.  Each chunk
+// is read once, so a slice takes at most the time to check one chunk
+// beyond the limit.
+bool SerialFlashChip::scrub(SerialFlashScrub &state, uint32_t microseconds)
+{
+	uint32_t start = micros();
+	uint32_t hash, info[3];
+	dirlayout dir;
+	SerialFlashLock lock;
+
+	if (!check_signature(dir) || dir.hashsize != 4) return false;
+	while (state.index < dir.maxfiles) {
+		read_hashes(dir, state.index, &hash, 1);
+		if (hash == 0xFFFFFFFF) break; // no more files
+		SerialFlash.read(dir.info(state.index), info, 12);
+		SerialFlashFile file;
+		file.address = info[0];
+		file.length = info[1];
+		if (hash == 0 || (info[2] & (FILEFLAG_CHECKSUM << 24))) {
+			// removed, or without checksums
+		} else if (!file.openChecked()) {
+			state.damaged++;
+		} else if (!file.checkbits) {
+			// power lost before the header was written
+			state.unfinished++;
+		} else {
+			uint32_t chunks = (file.length + (1ul << file.checkbits) - 1) >> file.checkbits;
+			while (state.chunk < chunks) {
+				uint8_t r = file.checkChunk(state.chunk, nullptr);
+				if (r == 0) {
+					state.chunks++;
+				} else if (r == 1) {
+					state.unfinished++;
+				} else {
+					state.damaged++;
+					if (state.found) {
+						static char name[256]; // held by the lock, not the stack
+						uint32_t len = (info[2] >> 16) & 255;
+						SerialFlash.read(dir.strings() + (info[2] & 0xFFFF) * 4, name, len);
+						name[len] = 0;
+						state.found(name, state.chunk << file.checkbits);
+					}
+				}
+				state.chunk++;
+				if (state.chunk < chunks && micros() - start > microseconds) return true;
+			}
+			state.files++;
+		}
+		state.index++;
+		state.chunk = 0;
+		if (micros() - start > microseconds) return true;
+	}
+	state.index = dir.maxfiles;
+	return false;
+}
+
 bool SerialFlashChip::readdir(char *filename, uint32_t strsize, uint32_t &filesize)
 {
-	uint32_t maxfiles, index, straddr;
+	static SerialFlashDir dir;
+	uint32_t address;
+	uint16_t index;
+	SerialFlashLock lock;
+
+	if (dirindex == 0) dir.rewind(); // opendir() was called
+	if (!dir.read(filename, strsize, filesize, address, index)) return false;
+	dirindex = index + 1;
+	return true;
+}
+
+bool SerialFlashDir::fill()
+{
 	uint32_t i, n;
-	uint32_t buf[2];
-	uint16_t hash;
-	char str[16], *p=filename;
-
-	filename[0] = 0;
-	maxfiles = check_signature();
-	if (!maxfiles) return false;
-	maxfiles &= 0xFFFF; 
-	index = dirindex;
+	dirlayout dir;
+
+	if (!maxfiles) {
+		if (!check_signature(dir)) return false;
+		base = dir.base;
+		maxfiles = dir.maxfiles;
+		hashsize = dir.hashsize;
+		infosize = dir.infosize;
+	} else {
+		dir.base = base;
+		dir.maxfiles = maxfiles;
+		dir.hashsize = hashsize;
+		dir.infosize = infosize;
+	}
+	if (index >= maxfiles) return false;
+	n = maxfiles - index;
+	if (n > SERIALFLASH_DIR_CHUNK) n = SERIALFLASH_DIR_CHUNK;
+	read_hashes(dir, index, hashes, n);
+	// file info is only needed up to the first unused entry
+	for (i=0; i < n; i++) {
+		if (hashes[i] == 0xFFFFFFFF) break;
+	}
+	if (i > 0) SerialFlash.read(dir.info(index), fileinfo, i * infosize);
+	 //Serial.printf("dir fill, index=%u, n=%u, info=%u\n", index, n, i);
+	first = index;
+	count = n;
+	return true;
+}
+
+bool SerialFlashDir::readname(uint32_t addr, char *filename, uint32_t strsize)
+{
+	uint32_t n=0;
+	char c;
+
 	while (1) {
-		if (index >= maxfiles) return false;
-		 //Serial.printf("readdir, index = %u\n", index);
-		SerialFlash.read(8 + index * 2, &hash, 2);
-		if (hash != 0) break;
-		index++;  // skip deleted entries
+		if (addr < straddr || addr >= straddr + strcount) {
+			// filenames are stored in directory order, so one
+			// read usually brings in the next several names
+			SerialFlash.read(addr, strings, sizeof(strings));
+			straddr = addr;
+			strcount = sizeof(strings);
+		}
+		c = strings[addr++ - straddr];
+		if (c == 0) break;
+		if (n + 1 >= strsize) break; // filename truncated
+		filename[n++] = c;
 	}
-	dirindex = index + 1;
-	buf[1] = 0;
-	SerialFlash.read(8 + 4 + maxfiles * 2 + index * 10, buf, 6);
-	if (buf[0] == 0xFFFFFFFF) return false;
-	filesize = buf[0];
-	straddr = 8 + maxfiles * 12 + buf[1] * 4;
-	 //Serial.printf("  length = %u\n", buf[0]);
-	 //Serial.printf("  straddr = %u\n", straddr);
+	if (strsize > 0) filename[n] = 0;
+	return true;
+}
+
+bool SerialFlashDir::read(char *filename, uint32_t strsize, uint32_t &filesize,
+	uint32_t &address, uint16_t &dirindex)
+{
+	uint32_t i, buf[3];
+
+	if (strsize > 0) filename[0] = 0;
+	while (1) {
+		if (!maxfiles || index - first >= count) {
+			if (!fill()) return false;
+		}
+		i = index - first;
+		if (hashes[i] == 0xFFFFFFFF) return false; // no more files
+		index++;
+		if (hashes[i] != 0) break; // skip deleted entries
+	}
+	buf[2] = 0;
+	memcpy(buf, fileinfo + i * infosize, infosize);
+	if (buf[1] == 0xFFFFFFFF) return false;
+	address = buf[0];
+	filesize = buf[1];
+	dirindex = first + i;
+	 //Serial.printf("  index = %u, addr = %u, len = %u\n", dirindex, address, filesize);
+	return readname(base + 8 + maxfiles * (hashsize + infosize) + (buf[2] & 0xFFFF) * 4,
+		filename, strsize);
+}
+
+
+static uint32_t path_hash(const char *path, uint32_t len)
+{
+	uint32_t hash = 2166136261;
+
+	while (len > 0) {
+		hash ^= *path++;
+		hash *= 16777619;
+		len--;
+	}
+	return hash;
+}
+
+// length of a path, ignoring any trailing '/'
+static uint32_t path_length(const char *path)
+{
+	uint32_t len = strlen(path);
+	while (len > 0 && path[len-1] == '/') len--;
+	return len;
+}
+
+// check if the filename at straddr begins with path and '/'
+static bool path_compare(const char *path, uint32_t len, uint32_t straddr)
+{
+	uint32_t i, n;
+	char buf[32];
+
+	len++;
+	while (len > 0) {
+		n = len;
+		if (n > sizeof(buf)) n = sizeof(buf);
+		SerialFlash.read(straddr, buf, n);
+		for (i=0; i < n; i++) {
+			if (len - i == 1) return buf[i] == '/';
+			if (*path++ != buf[i]) return false;
+		}
+		straddr += n;
+		len -= n;
+	}
+	return false;
+}
+
+static int path_entry_compare(const void *a, const void *b)
+{
+	const SerialFlashPathEntry *e1 = (const SerialFlashPathEntry *)a;
+	const SerialFlashPathEntry *e2 = (const SerialFlashPathEntry *)b;
+
+	if (e1->hash < e2->hash) return -1;
+	if (e1->hash > e2->hash) return 1;
+	return (int)e1->dirindex - (int)e2->dirindex;
+}
+
+bool SerialFlashPathIndex::build()
+{
+	SerialFlashDir dir;
+	dirlayout layout;
+	static char name[256]; // held by the lock, not the stack
+	uint32_t filesize, address, i;
+	uint16_t dirindex;
+	SerialFlashLock lock;
+
+	used = 0;
+	valid = false;
+	if (!check_signature(layout)) return false;
+	base = layout.base;
+	maxfiles = layout.maxfiles;
+	hashsize = layout.hashsize;
+	infosize = layout.infosize;
+	while (dir.read(name, sizeof(name), filesize, address, dirindex)) {
+		// one entry for every directory this file is within
+		for (i=0; name[i]; i++) {
+			if (name[i] != '/' || i == 0) continue;
+			if (used >= size) return false;
+			list[used].hash = path_hash(name, i);
+			list[used].dirindex = dirindex;
+			used++;
+		}
+	}
+	qsort(list, used, sizeof(SerialFlashPathEntry), path_entry_compare);
+	 //Serial.printf("path index: %u entries\n", used);
+	valid = true;
+	return true;
+}
+
+bool SerialFlashPathIndex::opendir(const char *path)
+{
+	uint32_t hash, lo, hi, mid;
+
+	pos = end = 0;
+	if (!valid) return false;
+	pathname = path;
+	pathlen = path_length(path);
+	if (pathlen == 0) return false;
+	hash = path_hash(path, pathlen);
+	// binary search for the first entry with this hash
+	lo = 0;
+	hi = used;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (list[mid].hash < hash) lo = mid + 1;
+		else hi = mid;
+	}
+	pos = end = lo;
+	while (end < used && list[end].hash == hash) end++;
+	 //Serial.printf("opendir %s: %u entries\n", path, end - pos);
+	return true;
+}
+
+// find the next indexed file which really is under the opendir() path
+bool SerialFlashPathIndex::next(uint32_t &dirindex, uint32_t *fileinfo)
+{
+	dirlayout dir;
+	uint32_t hash, straddr;
+	SerialFlashSession session;
+
+	dir.base = base;
+	dir.maxfiles = maxfiles;
+	dir.hashsize = hashsize;
+	dir.infosize = infosize;
+	while (pos < end) {
+		dirindex = list[pos++].dirindex;
+		hash = 0;
+		SerialFlash.read(dir.hash(dirindex), &hash, dir.hashsize);
+		if (hash == 0) continue; // removed since build()
+		fileinfo[2] = 0;
+		SerialFlash.read(dir.info(dirindex), fileinfo, dir.infosize);
+		straddr = dir.strings() + (fileinfo[2] & 0xFFFF) * 4;
+		// guard against a different path with the same hash
+		if (path_compare(pathname, pathlen, straddr)) return true;
+	}
+	return false;
+}
+
+bool SerialFlashPathIndex::readdir(char *filename, uint32_t strsize, uint32_t &filesize)
+{
+	uint32_t dirindex, fileinfo[3], straddr, n, i;
+	char *p = filename;
+	char str[16];
 
+	SerialFlashSession session;
+
+	if (strsize > 0) filename[0] = 0;
+	if (!next(dirindex, fileinfo)) return false;
+	filesize = fileinfo[1];
+	straddr = base + 8 + maxfiles * (hashsize + infosize) + (fileinfo[2] & 0xFFFF) * 4;
 	while (strsize) {
 		n = strsize;
 		if (n > sizeof(str)) n = sizeof(str);
 		SerialFlash.read(straddr, str, n);
 		for (i=0; i < n; i++) {
 			*p++ = str[i];
-			if (str[i] == 0) {
-				 //Serial.printf("  name = %s\n", filename);
-				return true;
-			}
+			if (str[i] == 0) return true;
 		}
 		strsize -= n;
 		straddr += n;
 	}
-	*(p - 1) = 0;
-	 //Serial.printf("  name(overflow) = %s\n", filename);
+	if (p > filename) *(p - 1) = 0;
 	return true;
 }
 
+uint32_t SerialFlashPathIndex::count(const char *path)
+{
+	uint32_t dirindex, fileinfo[3], n=0;
+
+	if (!opendir(path)) return 0;
+	while (next(dirindex, fileinfo)) n++;
+	return n;
+}
+
+uint32_t SerialFlashPathIndex::remove(const char *path)
+{
+	uint32_t dirindex, fileinfo[3], n=0;
+	dirlayout dir;
+
+	if (!opendir(path)) return 0;
+	dir.base = base;
+	dir.maxfiles = maxfiles;
+	dir.hashsize = hashsize;
+	dir.infosize = infosize;
+	while (next(dirindex, fileinfo)) {
+		if (remove_index(dir, dirindex)) n++;
+	}
+	return n;
+}
+
 
 void SerialFlashFile::erase()
 {
@@ -386,7 +1148,9 @@ void SerialFlashFile::erase()
 	blocksize = SerialFlash.blockSize();
 	if (address & (blocksize - 1)) return; // must begin on a block boundary
 	if (length & (blocksize - 1)) return;  // must be exact number of blocks
-	for (i=0; i < length; i += blocksize) {
+	if (chunkbits) return; // compressed files are read-only
+	// blocks already erased by recycle() are not erased again
+	for (i=SerialFlash.recycled(address, length); i < length; i += blocksize) {
 		SerialFlash.eraseBlock(address + i);
 	}
 }
@@ -0,0 +1,376 @@
+/* SerialFlash Library - for filesystem-like access to SPI Serial Flash memory
+ * https://github.com/PaulStoffregen/SerialFlash
+ * Copyright (C) 2015, Paul Stoffregen, paul@pjrc.com
+ *
+ * Development of this library was funded by PJRC.COM, LLC by sales of Teensy.
+ * Please support PJRC's efforts to develop open source software by purchasing
+ * Teensy or other genuine PJRC products.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "SerialFlash.h"
+
+#if defined(SERIALFLASH_HOST)
+// SerialFlashChip for Linux, using a memory mapped image file in place
+// of a chip.  Compile every SerialFlash .cpp file with SERIALFLASH_HOST
+// defined.  The directory, files and everything else work unchanged on
+// the image, which may be copied to or from a real chip.  Like NOR Flash,
+// writing only changes 1 bits to 0, and only erasing sets them to 1.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+uint16_t SerialFlashChip::dirindex = 0;
+uint8_t SerialFlashChip::flags = 0;
+uint8_t SerialFlashChip::busy = 0;
+uint8_t SerialFlashChip::session = 0;
+uint32_t SerialFlashChip::readlatency = 0;
+uint32_t SerialFlashChip::erasenext = 0;
+uint32_t SerialFlashChip::eraseend = 0;
+uint32_t SerialFlashChip::chipsize = 0;
+void (*SerialFlashChip::lockfunc)(void) = nullptr;
+void (*SerialFlashChip::unlockfunc)(void) = nullptr;
+void *(*SerialFlashChip::threadfunc)(void) = nullptr;
+void * volatile SerialFlashChip::lockowner = nullptr;
+uint8_t SerialFlashChip::lockdepth = 0;
+volatile uint8_t SerialFlashChip::readers = 0;
+volatile uint8_t SerialFlashChip::readsdone = 0;
+
+static uint8_t *image;		// the mapped image file, NULL = none
+static uint32_t imagesize;
+static uint32_t imageblock;	// erase block size
+static int imagefd = -1;
+static bool imagewritable;
+static uint32_t clockread, clockprogram, clockstatus; // only remembered
+
+uint32_t micros()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// Regions given to recycle() are erased immediately, and remembered
+// until used, so recycled() reports them erased like a chip would
+#ifndef SERIALFLASH_RECYCLE_SLOTS
+#define SERIALFLASH_RECYCLE_SLOTS 4
+#endif
+struct recycle_region {
+	uint32_t addr;
+	uint32_t end;	// 0 = unused
+};
+static recycle_region recycle_list[SERIALFLASH_RECYCLE_SLOTS];
+
+// Forget regions overlapping addr to addr+len, which is being written
+static void recycle_forget(uint32_t addr, uint32_t len)
+{
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		recycle_region &r = recycle_list[i];
+		if (r.end && addr < r.end && addr + len > r.addr) r.end = 0;
+	}
+}
+
+bool SerialFlashChip::begin(const char *imagefile, uint32_t size, uint32_t blocksize)
+{
+	struct stat st;
+	bool blank = false;
+
+	end();
+	if (blocksize < 256 || (blocksize & (blocksize - 1))) return false;
+	imagewritable = true;
+	imagefd = ::open(imagefile, O_RDWR | (size ? O_CREAT : 0), 0666);
+	if (imagefd < 0 && !size) {
+		// inspect images we can't write
+		imagewritable = false;
+		imagefd = ::open(imagefile, O_RDONLY);
+	}
+	if (imagefd < 0) return false;
+	if (fstat(imagefd, &st) < 0) goto fail;
+	if (size) {
+		if (st.st_size == 0) {
+			// a new image, blank like an erased chip
+			if (ftruncate(imagefd, size) < 0) goto fail;
+			blank = true;
+		} else if ((uint64_t)st.st_size != size) {
+			goto fail;
+		}
+	} else {
+		if (st.st_size <= 0 || st.st_size > 0xFFFFFFFF) goto fail;
+		size = st.st_size;
+	}
+	if (size % blocksize) goto fail;
+	image = (uint8_t *)mmap(NULL, size, PROT_READ | (imagewritable ? PROT_WRITE : 0),
+		MAP_SHARED, imagefd, 0);
+	if (image == MAP_FAILED) {
+		image = NULL;
+		goto fail;
+	}
+	if (blank) memset(image, 0xFF, size);
+	imagesize = size;
+	imageblock = blocksize;
+	chipsize = size;
+	flags = 0;
+	busy = 0;
+	dirindex = 0;
+	memset(recycle_list, 0, sizeof(recycle_list));
+	wearlen = 0;
+	return true;
+fail:
+	::close(imagefd);
+	imagefd = -1;
+	return false;
+}
+
+void SerialFlashChip::end()
+{
+	if (image) {
+		if (imagewritable) msync(image, imagesize, MS_SYNC);
+		munmap(image, imagesize);
+		image = NULL;
+		imagesize = 0;
+	}
+	if (imagefd >= 0) {
+		::close(imagefd);
+		imagefd = -1;
+	}
+}
+
+const uint8_t * SerialFlashChip::map(uint32_t addr, uint32_t len)
+{
+	if (!image || addr > imagesize || len > imagesize - addr) return NULL;
+	return image + addr;
+}
+
+uint32_t SerialFlashChip::dieSize()
+{
+	return 0;
+}
+
+void SerialFlashChip::setReadLatency(uint32_t microseconds)
+{
+	readlatency = microseconds;
+}
+
+void SerialFlashChip::setClock(uint32_t read, uint32_t program, uint32_t status)
+{
+	clockread = read;
+	clockprogram = program;
+	clockstatus = status;
+}
+
+void SerialFlashChip::getClock(uint32_t &read, uint32_t &program, uint32_t &status)
+{
+	read = clockread;
+	program = clockprogram;
+	status = clockstatus;
+}
+
+bool SerialFlashChip::calibrate(uint32_t, uint32_t)
+{
+	return false; // no SPI bus to calibrate
+}
+
+bool SerialFlashChip::recycle(uint32_t addr, uint32_t len)
+{
+	if (addr & (imageblock - 1)) return false; // must begin on a block boundary
+	if (len == 0 || (len & (imageblock - 1))) return false;
+	if (addr > imagesize || len > imagesize - addr) return false;
+	SerialFlashLock lock;
+	recycle_forget(addr, len);
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		recycle_region &r = recycle_list[i];
+		if (r.end == 0) {
+			for (uint32_t n=0; n < len; n += imageblock) {
+				eraseBlock(addr + n);
+			}
+			r.addr = addr;
+			r.end = addr + len;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool SerialFlashChip::poll()
+{
+	return false;
+}
+
+uint32_t SerialFlashChip::recycled(uint32_t addr, uint32_t len)
+{
+	uint32_t n = 0;
+	SerialFlashLock lock;
+	for (uint8_t i=0; i < SERIALFLASH_RECYCLE_SLOTS; i++) {
+		recycle_region &r = recycle_list[i];
+		if (r.end && addr >= r.addr && addr < r.end) {
+			n = r.end - addr;
+			if (n > len) n = len;
+		}
+	}
+	recycle_forget(addr, len);
+	return n;
+}
+
+void SerialFlashChip::setLock(void (*lockfunction)(void), void (*unlockfunction)(void),
+	void *(*threadfunction)(void))
+{
+	threadfunc = threadfunction;
+	unlockfunc = unlockfunction;
+	lockfunc = lockfunction;
+}
+
+void SerialFlashChip::beginSession()
+{
+	lock();
+	session++;
+}
+
+void SerialFlashChip::endSession()
+{
+	if (session == 0) return;
+	session--;
+	unlock();
+}
+
+void SerialFlashChip::flush()
+{
+}
+
+void SerialFlashChip::nandStats(uint32_t &corrected, uint32_t &uncorrectable,
+	uint32_t &failed, uint32_t &badblocks)
+{
+	corrected = uncorrectable = failed = badblocks = 0;
+}
+
+void SerialFlashChip::read(uint32_t addr, void *buf, uint32_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	uint32_t n = 0;
+
+	if (addr < imagesize) {
+		n = imagesize - addr;
+		if (n > len) n = len;
+		memcpy(p, image + addr, n);
+	}
+	// beyond the end of the image reads as erased
+	if (n < len) memset(p + n, 0xFF, len - n);
+}
+
+void SerialFlashChip::write(uint32_t addr, const void *buf, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+
+	if (!imagewritable || addr >= imagesize) return;
+	if (len > imagesize - addr) len = imagesize - addr;
+	SerialFlashLock lock;
+	recycle_forget(addr, len);
+	uint8_t *q = image + addr;
+	// like programming a NOR Flash page, 1 bits may only become 0
+	while (len--) *q++ &= *p++;
+}
+
+void SerialFlashChip::eraseAll()
+{
+	if (!imagewritable) return;
+	SerialFlashLock lock;
+	if (wearlen) {
+		// erase counts must be kept, and each block counted
+		for (uint32_t addr=0; addr < imagesize; addr += imageblock) {
+			if (addr >= wearaddr && addr < wearaddr + wearlen) continue;
+			eraseBlock(addr);
+		}
+		return;
+	}
+	memset(image, 0xFF, imagesize);
+}
+
+void SerialFlashChip::eraseBlock(uint32_t addr)
+{
+	if (!imagewritable || addr >= imagesize) return;
+	SerialFlashLock lock;
+	if (wearlen) wearNote(addr);
+	memset(image + (addr & ~(imageblock - 1)), 0xFF, imageblock);
+}
+
+bool SerialFlashChip::ready()
+{
+	return true;
+}
+
+void SerialFlashChip::wait()
+{
+}
+
+void SerialFlashChip::sleep()
+{
+}
+
+void SerialFlashChip::wakeup()
+{
+}
+
+void SerialFlashChip::setAutoSleep(uint32_t)
+{
+}
+
+void SerialFlashChip::sleepStats(uint32_t &asleepms, uint32_t &wakeupcount,
+	uint32_t &wakeupmicros)
+{
+	asleepms = wakeupcount = wakeupmicros = 0;
+}
+
+// A Winbond ID, with the capacity byte rounded up to a power of 2
+void SerialFlashChip::readID(uint8_t *buf)
+{
+	uint8_t bits = 16;
+	while (bits < 31 && (1ul << bits) < imagesize) bits++;
+	buf[0] = 0xEF;
+	buf[1] = 0x40;
+	buf[2] = bits;
+}
+
+void SerialFlashChip::readSerialNumber(uint8_t *buf)
+{
+	memset(buf, 0, 8);
+}
+
+// The image file's size, for any ID
+uint32_t SerialFlashChip::capacity(const uint8_t *)
+{
+	return imagesize;
+}
+
+uint32_t SerialFlashChip::blockSize()
+{
+	return imageblock;
+}
+
+uint32_t SerialFlashChip::pageSize()
+{
+	return 256;
+}
+
+SerialFlashChip SerialFlash;
+
+#endif // SERIALFLASH_HOST
@@ -0,0 +1,379 @@
+/* SerialFlash Library - for filesystem-like access to SPI Serial Flash memory
+ * https://github.com/PaulStoffregen/SerialFlash
+ * Copyright (C) 2015, Paul Stoffregen, paul@pjrc.com
+ *
+ * Development of this library was funded by PJRC.COM, LLC by sales of Teensy.
+ * Please support PJRC's efforts to develop open source software by purchasing
+ * Teensy or other genuine PJRC products.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SerialFlash.h"
+
+/* SerialFlashKV storage, within one erasable file:
+
+  region 0, region 1:
+    uint32_t magic = 0x564B4653;
+    uint32_t generation   // the region with the higher number is active
+    records
+  record:
+    uint8_t  keylen       // 0xFF = no more records in this page
+    uint8_t  type         // 1 = value, 0 = key removed
+    uint16_t vallen
+    uint16_t crc          // CRC-16 of keylen, type, vallen, key and value
+    char     key[keylen]  // not null terminated
+    uint8_t  value[vallen]
+
+Records are appended, so the latest record of each key is its current
+value.  Records never cross a page boundary.  When the rest of a page
+is too small, the next record begins on the next page.  A record
+interrupted by power loss fails its CRC check, and anything else in its
+page is ignored.  Later records begin on the next page.
+
+compact() erases the other region and copies the latest value of
+every key.  The region header is written last, so the copy becomes
+active only when complete.  The old region is then given to
+SerialFlash.recycle(), so it can be erased in the background before
+it is needed again.
+*/
+
+#define KV_MAGIC	0x564B4653
+#define KV_HEADER	8
+#define KV_RECORD	6
+#define KV_VALUE	1
+#define KV_REMOVED	0
+
+static uint32_t kv_hash(const char *key, uint32_t len)
+{
+	// http://isthe.com/chongo/tech/comp/fnv/
+	uint32_t hash = 2166136261;
+
+	for (uint32_t i=0; i < len; i++) {
+		hash ^= (uint8_t)key[i];
+		hash *= 16777619;
+	}
+	return hash ? hash : 1; // 0 = unused entry
+}
+
+static uint16_t kv_crc(const uint8_t *rec, uint32_t len)
+{
+	uint16_t crc = 0xFFFF;
+
+	for (uint32_t i=0; i < len; i++) {
+		if (i == 4) i = KV_RECORD; // skip the crc itself
+		if (i >= len) break;
+		crc ^= rec[i] << 8;
+		for (uint8_t bit=0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static bool kv_blank(const uint8_t *p, uint32_t len)
+{
+	for (uint32_t i=0; i < len; i++) {
+		if (p[i] != 0xFF) return false;
+	}
+	return true;
+}
+
+// Erase a region, skipping blocks already erased by recycle()
+static void kv_erase(uint32_t addr, uint32_t len)
+{
+	uint32_t blocksize = SerialFlash.blockSize();
+
+	for (uint32_t i=SerialFlash.recycled(addr, len); i < len; i += blocksize) {
+		SerialFlash.eraseBlock(addr + i);
+	}
+}
+
+bool SerialFlashKV::begin(const char *filename, uint32_t regionsize)
+{
+	uint32_t head[4];
+	SerialFlashLock lock;
+
+	base = 0;
+	uint32_t blocksize = SerialFlash.blockSize();
+	SerialFlashFile file = SerialFlash.open(filename);
+	if (!file) {
+		regionsize = (regionsize + blocksize - 1) & ~(blocksize - 1);
+		if (!SerialFlash.createErasable(filename, regionsize * 2)) return false;
+		file = SerialFlash.open(filename);
+		if (!file) return false;
+	}
+	this->regionsize = (file.size() / 2) & ~(blocksize - 1);
+	if (this->regionsize == 0) return false;
+	uint32_t region0 = file.getFlashAddress();
+	uint32_t region1 = region0 + this->regionsize;
+	SerialFlash.read(region0, head, KV_HEADER);
+	SerialFlash.read(region1, head + 2, KV_HEADER);
+	bool valid0 = (head[0] == KV_MAGIC), valid1 = (head[2] == KV_MAGIC);
+	if (valid1 && (!valid0 || (int32_t)(head[3] - head[1]) > 0)) {
+		base = region1;
+		other = region0;
+		generation = head[3];
+	} else {
+		base = region0;
+		other = region1;
+		generation = head[1];
+		if (!valid0) {
+			// new or unrecognized data, begin with an empty region 0
+			kv_erase(region0, this->regionsize);
+			generation = 1;
+			head[0] = KV_MAGIC;
+			head[1] = generation;
+			SerialFlash.write(region0, head, KV_HEADER);
+			SerialFlash.flush();
+		}
+	}
+	if (!scan()) {
+		base = 0;
+		return false;
+	}
+	return true;
+}
+
+// Build the index from the records in the active region
+bool SerialFlashKV::scan()
+{
+	uint8_t rec[SERIALFLASH_KV_MAX];
+	uint32_t pagesize = SerialFlash.pageSize();
+	uint32_t end = base + regionsize;
+	uint32_t pos = base + KV_HEADER;
+	SerialFlashSession session;
+
+	memset(list, 0, size * sizeof(SerialFlashKVEntry));
+	used = 0;
+	slots = 0;
+	while (pos + KV_RECORD <= end) {
+		// records never cross pages, so read no further than this page
+		uint32_t pageend = (pos / pagesize + 1) * pagesize;
+		uint32_t n = pageend - pos;
+		if (n > SERIALFLASH_KV_MAX) n = SERIALFLASH_KV_MAX;
+		if (n < KV_RECORD) {
+			pos = pageend;
+			continue;
+		}
+		SerialFlash.read(pos, rec, n);
+		uint32_t keylen = rec[0];
+		if (keylen == 0xFF) {
+			if (pos % pagesize == 0 && kv_blank(rec, n)) break; // end of the log
+			pos = pageend;
+			continue;
+		}
+		uint32_t len = KV_RECORD + keylen + (rec[2] | (rec[3] << 8));
+		if (keylen == 0 || len > n || rec[1] > KV_VALUE
+		  || kv_crc(rec, len) != (rec[4] | (rec[5] << 8))) {
+			// interrupted by power loss, the rest of this page is unused
+			pos = pageend;
+			continue;
+		}
+		const char *key = (const char *)rec + KV_RECORD;
+		uint8_t old[SERIALFLASH_KV_MAX];
+		bool found;
+		uint32_t i = lookup(key, keylen, kv_hash(key, keylen), old,
+			KV_RECORD + keylen, found);
+		if (found) {
+			if (old[1] == KV_VALUE) used--;
+		} else {
+			// always leave an unused entry, to end lookup()
+			if (slots + 1 >= size) return false;
+			list[i].hash = kv_hash(key, keylen);
+			slots++;
+		}
+		if (rec[1] == KV_VALUE) used++;
+		list[i].addr = pos;
+		pos += len;
+	}
+	tail = pos;
+	return true;
+}
+
+// Find the entry of key, with its latest record read into rec, or the
+// unused entry where it would be added
+uint32_t SerialFlashKV::lookup(const char *key, uint32_t keylen, uint32_t hash,
+	uint8_t *rec, uint32_t reclen, bool &found)
+{
+	uint32_t i = hash % size;
+
+	found = false;
+	while (list[i].hash != 0) {
+		if (list[i].hash == hash) {
+			SerialFlash.read(list[i].addr, rec, reclen);
+			if (rec[0] == keylen && memcmp(rec + KV_RECORD, key, keylen) == 0) {
+				found = true;
+				return i;
+			}
+		}
+		if (++i >= size) i = 0;
+	}
+	return i;
+}
+
+// Write a record, returns its address or 0 if the region is full
+uint32_t SerialFlashKV::append(const uint8_t *rec, uint32_t len)
+{
+	uint32_t pagesize = SerialFlash.pageSize();
+	uint32_t pos = tail;
+
+	if (pos % pagesize + len > pagesize) {
+		pos = (pos / pagesize + 1) * pagesize;
+	}
+	if (pos + len > base + regionsize) return 0;
+	SerialFlash.write(pos, rec, len);
+	SerialFlash.flush();
+	tail = pos + len;
+	return pos;
+}
+
+bool SerialFlashKV::get(const char *key, void *value, uint32_t valsize, uint32_t &length)
+{
+	uint8_t rec[SERIALFLASH_KV_MAX];
+	bool found;
+
+	uint32_t keylen = strlen(key);
+	if (!base || keylen == 0 || keylen > SERIALFLASH_KV_MAX - KV_RECORD) return false;
+	uint32_t n = KV_RECORD + keylen + valsize;
+	if (n > SERIALFLASH_KV_MAX) n = SERIALFLASH_KV_MAX;
+	SerialFlashLock lock;
+	lookup(key, keylen, kv_hash(key, keylen), rec, n, found);
+	if (!found || rec[1] != KV_VALUE) return false;
+	length = rec[2] | (rec[3] << 8);
+	memcpy(value, rec + KV_RECORD + keylen, (length < valsize) ? length : valsize);
+	return true;
+}
+
+bool SerialFlashKV::set(const char *key, const void *value, uint32_t length)
+{
+	uint8_t rec[SERIALFLASH_KV_MAX], old[SERIALFLASH_KV_MAX];
+	bool found;
+
+	uint32_t keylen = strlen(key);
+	uint32_t len = KV_RECORD + keylen + length;
+	if (!base || keylen == 0 || keylen == 0xFF || len > SERIALFLASH_KV_MAX) return false;
+	SerialFlashLock lock;
+	uint32_t hash = kv_hash(key, keylen);
+	uint32_t i = lookup(key, keylen, hash, old, len, found);
+	if (found && old[1] == KV_VALUE && (uint32_t)(old[2] | (old[3] << 8)) == length
+	  && memcmp(old + KV_RECORD + keylen, value, length) == 0) {
+		return true; // unchanged, nothing to write
+	}
+	if (!found && slots + 2 > size) {
+		// the index is full, unless removed keys are dropped
+		if (!compact()) return false;
+		i = lookup(key, keylen, hash, old, len, found);
+		if (!found && slots + 2 > size) return false;
+	}
+	rec[0] = keylen;
+	rec[1] = KV_VALUE;
+	rec[2] = length;
+	rec[3] = length >> 8;
+	memcpy(rec + KV_RECORD, key, keylen);
+	memcpy(rec + KV_RECORD + keylen, value, length);
+	uint16_t crc = kv_crc(rec, len);
+	rec[4] = crc;
+	rec[5] = crc >> 8;
+	uint32_t addr = append(rec, len);
+	if (!addr) {
+		if (!compact()) return false;
+		i = lookup(key, keylen, hash, old, KV_RECORD + keylen, found);
+		if (!found && slots + 2 > size) return false;
+		addr = append(rec, len);
+		if (!addr) return false;
+	}
+	if (!found) {
+		list[i].hash = hash;
+		slots++;
+	}
+	if (!found || old[1] != KV_VALUE) used++;
+	list[i].addr = addr;
+	return true;
+}
+
+bool SerialFlashKV::remove(const char *key)
+{
+	uint8_t rec[SERIALFLASH_KV_MAX];
+	bool found;
+
+	uint32_t keylen = strlen(key);
+	uint32_t len = KV_RECORD + keylen;
+	if (!base || keylen == 0 || len > SERIALFLASH_KV_MAX) return false;
+	SerialFlashLock lock;
+	uint32_t hash = kv_hash(key, keylen);
+	uint32_t i = lookup(key, keylen, hash, rec, len, found);
+	if (!found || rec[1] != KV_VALUE) return false;
+	rec[1] = KV_REMOVED;
+	rec[2] = 0;
+	rec[3] = 0;
+	uint16_t crc = kv_crc(rec, len);
+	rec[4] = crc;
+	rec[5] = crc >> 8;
+	uint32_t addr = append(rec, len);
+	if (!addr) {
+		// a removed key needs no record in the compacted region
+		list[i].addr = 0;
+		return compact();
+	}
+	list[i].addr = addr;
+	used--;
+	return true;
+}
+
+// Copy the latest value of every key to the other region
+bool SerialFlashKV::compact()
+{
+	uint8_t rec[SERIALFLASH_KV_MAX];
+	uint32_t head[2];
+
+	if (!base) return false;
+	SerialFlashLock lock;
+	uint32_t oldbase = base, oldtail = tail;
+	kv_erase(other, regionsize);
+	base = other;
+	tail = base + KV_HEADER;
+	for (uint32_t i=0; i < size; i++) {
+		if (list[i].hash == 0 || list[i].addr == 0) continue;
+		SerialFlash.read(list[i].addr, rec, SERIALFLASH_KV_MAX);
+		if (rec[1] != KV_VALUE) continue;
+		uint32_t len = KV_RECORD + rec[0] + (rec[2] | (rec[3] << 8));
+		if (!append(rec, len)) {
+			// too full to compact, keep using the old region
+			other = base;
+			base = oldbase;
+			tail = oldtail;
+			return false;
+		}
+	}
+	// the new region becomes active when its header is written
+	head[0] = KV_MAGIC;
+	head[1] = generation + 1;
+	SerialFlash.write(base, head, KV_HEADER);
+	SerialFlash.flush();
+	generation++;
+	// clear the old magic number, so a partly erased old header can
+	// never appear to be newer
+	head[0] = 0;
+	SerialFlash.write(oldbase, head, 4);
+	SerialFlash.flush();
+	other = oldbase;
+	SerialFlash.recycle(other, regionsize);
+	return scan();
+}
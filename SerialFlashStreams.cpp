@@ -0,0 +1,149 @@
+/* SerialFlash Library - for filesystem-like access to SPI Serial Flash memory
+ * https://github.com/PaulStoffregen/SerialFlash
+ * Copyright (C) 2015, Paul Stoffregen, paul@pjrc.com
+ *
+ * Development of this library was funded by PJRC.COM, LLC by sales of Teensy.
+ * Please support PJRC's efforts to develop open source software by purchasing
+ * Teensy or other genuine PJRC products.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SerialFlash.h"
+
+// Each ring buffer keeps one byte unused, so head == tail means empty.
+// Only update() changes head and only read() changes tail.
+
+int SerialFlashStreams::open(SerialFlashFile &file, void *buffer, uint32_t size)
+{
+	if (!file || size < 2) return -1;
+	for (int i=0; i < SERIALFLASH_STREAMS; i++) {
+		stream &s = list[i];
+		if (s.address) continue;
+		s.length = file.size();
+		s.pos = file.position();
+		s.buf = (uint8_t *)buffer;
+		s.size = size;
+		s.head = 0;
+		s.tail = 0;
+		s.underruns = 0;
+		s.lowest = size;
+		s.address = file.getFlashAddress();
+		return i;
+	}
+	return -1;
+}
+
+void SerialFlashStreams::close(int stream)
+{
+	if (stream < 0 || stream >= SERIALFLASH_STREAMS) return;
+	list[stream].address = 0;
+}
+
+void SerialFlashStreams::update()
+{
+	bool session = false;
+
+	while (1) {
+		// refill the emptiest stream which can take a large read
+		stream *s = nullptr;
+		uint32_t least = 0xFFFFFFFF;
+		for (int i=0; i < SERIALFLASH_STREAMS; i++) {
+			stream &t = list[i];
+			if (!t.address || t.pos >= t.length) continue;
+			uint32_t n = level(t);
+			if (t.size - 1 - n < t.size / 2) continue;
+			if (n < least) {
+				least = n;
+				s = &t;
+			}
+		}
+		if (!s) break;
+		// read as much as fits before the end of the buffer
+		uint32_t head = s->head, tail = s->tail, n;
+		if (head >= tail) {
+			n = s->size - head;
+			if (tail == 0) n--;
+		} else {
+			n = tail - head - 1;
+		}
+		if (n > s->length - s->pos) n = s->length - s->pos;
+		if (n == 0) break;
+		if (!session) {
+			// one SPI transaction for all refills
+			SerialFlash.beginSession();
+			session = true;
+		}
+		SerialFlash.read(s->address + s->pos, s->buf + head, n);
+		s->pos += n;
+		head += n;
+		if (head >= s->size) head = 0;
+		s->head = head;
+	}
+	if (session) SerialFlash.endSession();
+}
+
+uint32_t SerialFlashStreams::read(int stream, void *buf, uint32_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+	if (stream < 0 || stream >= SERIALFLASH_STREAMS) return 0;
+	struct stream &s = list[stream];
+	if (!s.address) return 0;
+	uint32_t n = level(s);
+	if (n < s.lowest) s.lowest = n;
+	if (len > n) {
+		if (s.pos < s.length) s.underruns++;
+		len = n;
+	}
+	uint32_t tail = s.tail;
+	uint32_t count = s.size - tail;
+	if (count > len) count = len;
+	memcpy(p, s.buf + tail, count);
+	memcpy(p + count, s.buf, len - count);
+	tail += len;
+	if (tail >= s.size) tail -= s.size;
+	s.tail = tail;
+	return len;
+}
+
+uint32_t SerialFlashStreams::available(int stream)
+{
+	if (stream < 0 || stream >= SERIALFLASH_STREAMS) return 0;
+	if (!list[stream].address) return 0;
+	return level(list[stream]);
+}
+
+bool SerialFlashStreams::eof(int stream)
+{
+	if (stream < 0 || stream >= SERIALFLASH_STREAMS) return true;
+	struct stream &s = list[stream];
+	return !s.address || (s.pos >= s.length && level(s) == 0);
+}
+
+void SerialFlashStreams::stats(int stream, uint32_t &underruns, uint32_t &lowest)
+{
+	underruns = 0;
+	lowest = 0;
+	if (stream < 0 || stream >= SERIALFLASH_STREAMS) return;
+	struct stream &s = list[stream];
+	underruns = s.underruns;
+	lowest = s.lowest;
+	s.lowest = s.size;
+}
@@ -0,0 +1,120 @@
+/* SerialFlash Library - for filesystem-like access to SPI Serial Flash memory
+ * https://github.com/PaulStoffregen/SerialFlash
+ * Copyright (C) 2015, Paul Stoffregen, paul@pjrc.com
+ *
+ * Development of this library was funded by PJRC.COM, LLC by sales of Teensy.
+ * Please support PJRC's efforts to develop open source software by purchasing
+ * Teensy or other genuine PJRC products.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SerialFlash.h"
+
+// Records are numbered from the beginning of the file.  Unwritten
+// records have time 0xFFFFFFFF, which append() does not allow.
+
+bool SerialFlashTimeLog::begin(SerialFlashFile &file, uint32_t recordsize)
+{
+	address = 0;
+	if (!file || recordsize < 4) return false;
+	pagesize = SerialFlash.pageSize();
+	recsize = recordsize;
+	perpage = pagesize / recsize;
+	if (perpage == 0) return false;
+	// files begin on a page, but an unaligned address would put the
+	// page headers in the wrong place
+	if (file.getFlashAddress() % pagesize) return false;
+	address = file.getFlashAddress();
+	pages = file.size() / pagesize;
+	readpos = 0;
+	// find the end of the log, first the page and then the record
+	SerialFlashSession session;
+	uint32_t page = search(0, pages, perpage, 0xFFFFFFFF);
+	tail = 0;
+	lasttime = 0;
+	if (page > 0) {
+		tail = search((page - 1) * perpage, page * perpage, 1, 0xFFFFFFFF);
+		lasttime = timeof(tail - 1);
+	}
+	return true;
+}
+
+// Time of record n, or 0xFFFFFFFF if not yet written
+uint32_t SerialFlashTimeLog::timeof(uint32_t n)
+{
+	uint32_t time;
+	SerialFlash.read(addr(n), &time, 4);
+	return time;
+}
+
+// Binary search from first to last for the first with a time at or
+// after time.  With step = perpage, these are pages and only the page
+// headers are read, otherwise they are records.
+uint32_t SerialFlashTimeLog::search(uint32_t first, uint32_t last, uint32_t step, uint32_t time)
+{
+	while (first < last) {
+		uint32_t mid = first + (last - first) / 2;
+		if (timeof(mid * step) < time) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+	return first;
+}
+
+bool SerialFlashTimeLog::append(const void *record)
+{
+	uint32_t time;
+
+	if (!address || tail >= pages * perpage) return false;
+	memcpy(&time, record, 4);
+	if (time == 0xFFFFFFFF || time < lasttime) return false;
+	SerialFlash.write(addr(tail), record, recsize);
+	tail++;
+	lasttime = time;
+	return true;
+}
+
+bool SerialFlashTimeLog::seek(uint32_t time)
+{
+	if (!address) return false;
+	SerialFlashSession session;
+	// first page whose first record is at or after time
+	uint32_t page = search(0, (tail + perpage - 1) / perpage, perpage, time);
+	if (page == 0) {
+		readpos = 0;
+	} else {
+		// the previous page may hold the first records at or after time
+		uint32_t first = (page - 1) * perpage;
+		uint32_t last = first + perpage;
+		if (last > tail) last = tail;
+		readpos = search(first, last, 1, time);
+	}
+	return readpos < tail;
+}
+
+bool SerialFlashTimeLog::read(void *record)
+{
+	if (!address || readpos >= tail) return false;
+	SerialFlash.read(addr(readpos), record, recsize);
+	readpos++;
+	return true;
+}
@@ -0,0 +1,268 @@
+/* SerialFlash Library - for filesystem-like access to SPI Serial Flash memory
+ * https://github.com/PaulStoffregen/SerialFlash
+ * Copyright (C) 2015, Paul Stoffregen, paul@pjrc.com
+ *
+ * Development of this library was funded by PJRC.COM, LLC by sales of Teensy.
+ * Please support PJRC's efforts to develop open source software by purchasing
+ * Teensy or other genuine PJRC products.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "SerialFlash.h"
+#include "util/SerialFlash_chiptraits.h"
+
+/* Erase counts, kept in the region given to beginWear():
+
+   The region is divided into two halves, one in use.  Each half begins
+   with a header, then a snapshot of every block's erase count, then a
+   log of the block numbers erased since the snapshot.  Erases are noted
+   in RAM and added to the log in batches, so most erases write nothing.
+   When the log is full, the totals become a new snapshot in the other
+   half, which recycle() erases in the background beforehand.
+
+     header      magic, generation, blocks, block size    (one page)
+     snapshot    uint32_t count for each block, 0xFFFFFFFF = 0
+     log         batches of uint16_t block numbers, 0xFFFF = unused
+*/
+
+#define WEAR_MAGIC	0x52414557	// "WEAR"
+#define WEAR_NONE	0xFFFF
+#define WEAR_HEADER	256
+
+#ifndef SERIALFLASH_WEAR_BATCH
+#define SERIALFLASH_WEAR_BATCH	32	// erases noted in RAM before writing
+#endif
+#ifndef SERIALFLASH_WEAR_GROUP
+#define SERIALFLASH_WEAR_GROUP	128	// blocks counted at once by queries
+#endif
+#ifndef SERIALFLASH_ENDURANCE
+#define SERIALFLASH_ENDURANCE	100000	// erase cycles each block can take
+#endif
+
+struct wearheader {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t blocks;
+	uint32_t blocksize;
+};
+
+uint32_t SerialFlashChip::wearaddr = 0;
+uint32_t SerialFlashChip::wearlen = 0;
+static uint32_t wearhalf;	// bytes in each half
+static uint32_t wearcur;	// the half in use
+static uint32_t weargen;
+static uint32_t wearlog;	// next batch of the log
+static uint32_t wearblocks, wearblocksize;
+static uint16_t wearbatch[SERIALFLASH_WEAR_BATCH];
+static uint8_t wearcount;	// erases in wearbatch
+static bool wearsaving;
+
+static uint32_t wear_logstart(uint32_t half)
+{
+	return half + WEAR_HEADER + ((wearblocks * 4 + 255) & ~255);
+}
+
+// Count the erases of blocks first to first+n-1: the snapshot, plus
+// the log, plus erases not yet written to the log
+static void wear_group(uint32_t first, uint32_t n, uint32_t *count,
+	const uint16_t *pending, uint32_t npending)
+{
+	uint16_t entries[64];
+	uint32_t i, addr, len;
+
+	SerialFlash.read(wearcur + WEAR_HEADER + first * 4, count, n * 4);
+	for (i=0; i < n; i++) {
+		if (count[i] == 0xFFFFFFFF) count[i] = 0;
+	}
+	for (addr = wear_logstart(wearcur); addr < wearlog; addr += len) {
+		len = wearlog - addr;
+		if (len > sizeof(entries)) len = sizeof(entries);
+		SerialFlash.read(addr, entries, len);
+		for (i=0; i < len / 2; i++) {
+			// unused entries are beyond every group
+			if ((uint32_t)(entries[i] - first) < n) count[entries[i] - first]++;
+		}
+	}
+	for (i=0; i < npending; i++) {
+		if ((uint32_t)(pending[i] - first) < n) count[pending[i] - first]++;
+	}
+}
+
+// Write the totals as a new snapshot in the other half
+static void wear_compact(uint32_t region, const uint16_t *pending, uint32_t npending)
+{
+	uint32_t count[SERIALFLASH_WEAR_GROUP];
+	uint32_t next = (wearcur == region) ? region + wearhalf : region;
+	uint32_t first, n, zero = 0;
+	wearheader h;
+
+	// normally already erased by recycle()
+	for (uint32_t i = SerialFlash.recycled(next, wearhalf); i < wearhalf; i += wearblocksize) {
+		SerialFlash.eraseBlock(next + i);
+	}
+	SerialFlash.wait();
+	for (first=0; first < wearblocks; first += n) {
+		n = wearblocks - first;
+		if (n > SERIALFLASH_WEAR_GROUP) n = SERIALFLASH_WEAR_GROUP;
+		wear_group(first, n, count, pending, npending);
+		SerialFlash.write(next + WEAR_HEADER + first * 4, count, n * 4);
+	}
+	SerialFlash.wait();
+	// the new half is used once its header is written
+	h.magic = WEAR_MAGIC;
+	h.generation = ++weargen;
+	h.blocks = wearblocks;
+	h.blocksize = wearblocksize;
+	SerialFlash.write(next, &h, sizeof(h));
+	SerialFlash.wait();
+	SerialFlash.write(wearcur, &zero, 4);
+	SerialFlash.recycle(wearcur, wearhalf);
+	wearcur = next;
+	wearlog = wear_logstart(next);
+}
+
+bool SerialFlashChip::beginWear(uint32_t addr, uint32_t len)
+{
+	uint8_t id[5];
+	wearheader h[2];
+	SerialFlashLock lock;
+	SerialFlashSession session;
+
+	wearlen = 0;
+	wearcount = 0;
+	if (flags & FLAG_NAND) return false;
+	wearblocksize = blockSize();
+	if (addr % wearblocksize || len < wearblocksize * 2) return false;
+	readID(id);
+	wearblocks = capacity(id) / wearblocksize;
+	if (wearblocks >= WEAR_NONE) return false;
+	wearaddr = addr;
+	wearhalf = len / wearblocksize / 2 * wearblocksize;
+	// room for a useful log after the snapshot
+	if (wear_logstart(0) + SERIALFLASH_WEAR_BATCH * 2 * 16 > wearhalf) return false;
+	read(addr, &h[0], sizeof(wearheader));
+	read(addr + wearhalf, &h[1], sizeof(wearheader));
+	int use = -1;
+	for (int i=0; i < 2; i++) {
+		if (h[i].magic != WEAR_MAGIC || h[i].blocks != wearblocks
+		  || h[i].blocksize != wearblocksize) continue;
+		if (use < 0 || h[i].generation > h[use].generation) use = i;
+	}
+	if (use < 0) {
+		// a new region
+		for (uint32_t i=0; i < wearhalf; i += wearblocksize) {
+			eraseBlock(addr + i);
+		}
+		wait();
+		h[0].magic = WEAR_MAGIC;
+		h[0].generation = 1;
+		h[0].blocks = wearblocks;
+		h[0].blocksize = wearblocksize;
+		write(addr, &h[0], sizeof(wearheader));
+		wait();
+		use = 0;
+	}
+	wearcur = addr + use * wearhalf;
+	weargen = h[use].generation;
+	// the log is used in order, so find its end by binary search
+	uint32_t batch = SERIALFLASH_WEAR_BATCH * 2;
+	uint32_t lo = 0, hi = (wearcur + wearhalf - wear_logstart(wearcur)) / batch;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		uint16_t entry;
+		read(wear_logstart(wearcur) + mid * batch, &entry, 2);
+		if (entry == WEAR_NONE) hi = mid;
+		else lo = mid + 1;
+	}
+	wearlog = wear_logstart(wearcur) + lo * batch;
+	wearlen = len;
+	return true;
+}
+
+// Called by eraseBlock() for every block erased
+void SerialFlashChip::wearNote(uint32_t addr)
+{
+	// erases while a batch is saved are only lost if it is full
+	if (wearcount < SERIALFLASH_WEAR_BATCH) {
+		wearbatch[wearcount++] = addr / wearblocksize;
+	}
+	if (wearcount >= SERIALFLASH_WEAR_BATCH) flushWear();
+}
+
+void SerialFlashChip::flushWear()
+{
+	uint16_t batch[SERIALFLASH_WEAR_BATCH];
+
+	if (!wearlen || !wearcount || wearsaving) return;
+	SerialFlashLock lock;
+	wearsaving = true;
+	uint32_t n = wearcount;
+	memcpy(batch, wearbatch, n * 2);
+	memset(batch + n, 0xFF, (SERIALFLASH_WEAR_BATCH - n) * 2);
+	wearcount = 0;
+	if (wearlog + sizeof(batch) > wearcur + wearhalf) {
+		wear_compact(wearaddr, batch, n);
+	} else {
+		write(wearlog, batch, sizeof(batch));
+		wearlog += sizeof(batch);
+	}
+	wearsaving = false;
+}
+
+uint32_t SerialFlashChip::eraseCount(uint32_t addr)
+{
+	uint32_t count;
+
+	if (!wearlen) return 0;
+	SerialFlashLock lock;
+	SerialFlashSession session;
+	wear_group(addr / wearblocksize, 1, &count, wearbatch, wearcount);
+	return count;
+}
+
+void SerialFlashChip::wearStats(uint32_t &hotaddr, uint32_t &hotcount,
+	uint32_t &coldaddr, uint32_t &coldcount, uint32_t &remaining)
+{
+	uint32_t count[SERIALFLASH_WEAR_GROUP];
+	uint32_t first, n, i;
+
+	hotaddr = hotcount = coldaddr = coldcount = 0;
+	remaining = SERIALFLASH_ENDURANCE;
+	if (!wearlen) return;
+	SerialFlashLock lock;
+	SerialFlashSession session;
+	coldcount = 0xFFFFFFFF;
+	for (first=0; first < wearblocks; first += n) {
+		n = wearblocks - first;
+		if (n > SERIALFLASH_WEAR_GROUP) n = SERIALFLASH_WEAR_GROUP;
+		wear_group(first, n, count, wearbatch, wearcount);
+		for (i=0; i < n; i++) {
+			if (count[i] > hotcount) {
+				hotcount = count[i];
+				hotaddr = (first + i) * wearblocksize;
+			}
+			if (count[i] < coldcount) {
+				coldcount = count[i];
+				coldaddr = (first + i) * wearblocksize;
+			}
+		}
+	}
+	remaining = (hotcount < SERIALFLASH_ENDURANCE) ? SERIALFLASH_ENDURANCE - hotcount : 0;
+}
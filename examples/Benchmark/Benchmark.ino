@@ -0,0 +1,252 @@
+// Benchmark - Measure SerialFlash speed for reads, writes, erases
+// and directory operations.
+//
+// Every result is printed as one line, with 4 fields separated by
+// commas: test name, size or count, result, units.  Lines beginning
+// with # are comments.  Save the output to compare chips, boards and
+// library versions.  For example:
+//
+//   read_seq,256,4521,kB/s
+//   open,500,84,us
+//
+// WARNING: this benchmark ERASES THE ENTIRE CHIP.  All files and
+// data are lost.
+
+#include <SerialFlash.h>
+#include <SPI.h>
+
+const int FlashChipSelect = 6; // digital pin for flash chip CS pin
+//const int FlashChipSelect = 21; // Arduino 101 built-in SPI Flash
+
+// reduce these on boards with little RAM
+const unsigned long maxReadSize = 4096;
+const unsigned long testFileSize = 65536;
+
+unsigned char buffer[maxReadSize];
+unsigned long seed;
+
+void setup() {
+  //uncomment these if using Teensy audio shield
+  //SPI.setSCK(14);  // Audio shield has SCK on pin 14
+  //SPI.setMOSI(7);  // Audio shield has MOSI on pin 7
+
+  //uncomment these if you have other SPI chips connected
+  //to keep them disabled while using only SerialFlash
+  //pinMode(4, INPUT_PULLUP);
+  //pinMode(10, INPUT_PULLUP);
+
+  Serial.begin(9600);
+
+  // wait up to 10 seconds for Arduino Serial Monitor
+  unsigned long startMillis = millis();
+  while (!Serial && (millis() - startMillis < 10000)) ;
+  delay(100);
+
+  Serial.println(F("# SerialFlash Benchmark"));
+  if (!SerialFlash.begin(FlashChipSelect)) {
+    while (1) {
+      Serial.println(F("# Unable to access SPI Flash chip"));
+      delay(1000);
+    }
+  }
+  unsigned char id[5];
+  SerialFlash.readID(id);
+  result("chip_id", 0, ((unsigned long)id[0] << 16) | ((unsigned long)id[1] << 8) | id[2], "jedec");
+  result("chip_capacity", 0, SerialFlash.capacity(id), "bytes");
+  result("chip_blocksize", 0, SerialFlash.blockSize(), "bytes");
+
+  eraseBenchmark();
+  writeBenchmark();
+  readBenchmark();
+  latencyBenchmark();
+  directoryBenchmark();
+  Serial.println(F("# done"));
+}
+
+void loop() {
+}
+
+void result(const char *test, unsigned long param, unsigned long value, const char *unit) {
+  Serial.print(test);
+  Serial.print(',');
+  Serial.print(param);
+  Serial.print(',');
+  Serial.print(value);
+  Serial.print(',');
+  Serial.println(unit);
+}
+
+// kbytes per second, for len bytes in usec microseconds
+unsigned long speed(unsigned long len, unsigned long usec) {
+  if (usec == 0) usec = 1;
+  return (unsigned long)((float)len * 1000.0 / (float)usec);
+}
+
+// the same "random" numbers every time, for reproducible results
+unsigned long random32() {
+  seed = seed * 1664525 + 1013904223;
+  return seed >> 8;
+}
+
+void fill(unsigned long n) {
+  for (unsigned long i=0; i < maxReadSize; i++) {
+    buffer[i] = i + n;
+  }
+}
+
+void eraseBenchmark() {
+  // the whole chip, which also leaves it blank for the other tests
+  unsigned long ms = millis();
+  SerialFlash.eraseAll();
+  while (!SerialFlash.ready()) ;
+  result("erase_chip", 0, millis() - ms, "ms");
+
+  unsigned long blocksize = SerialFlash.blockSize();
+  SerialFlash.createErasable("erase.bin", blocksize * 4);
+  SerialFlashFile file = SerialFlash.open("erase.bin");
+  unsigned long total = 0, most = 0;
+  for (int i=0; i < 4; i++) {
+    fill(i);
+    file.seek(i * blocksize);
+    file.write(buffer, 256);  // something to erase
+    SerialFlash.wait();
+    unsigned long usec = micros();
+    SerialFlash.eraseBlock(file.getFlashAddress() + i * blocksize);
+    SerialFlash.wait();
+    usec = micros() - usec;
+    total += usec;
+    if (usec > most) most = usec;
+  }
+  result("erase_block", blocksize, total / 4, "us");
+  result("erase_block_max", blocksize, most, "us");
+}
+
+void writeBenchmark() {
+  const unsigned long sizes[] = {16, 256};
+  char filename[16];
+
+  for (int i=0; i < 2; i++) {
+    sprintf(filename, "write%lu.bin", sizes[i]);
+    SerialFlash.create(filename, testFileSize);
+    SerialFlashFile file = SerialFlash.open(filename);
+    fill(i);
+    unsigned long usec = micros();
+    for (unsigned long n=0; n < testFileSize; n += sizes[i]) {
+      file.write(buffer, sizes[i]);
+    }
+    SerialFlash.wait();
+    usec = micros() - usec;
+    result("write", sizes[i], speed(testFileSize, usec), "kB/s");
+  }
+}
+
+void readBenchmark() {
+  const unsigned long sizes[] = {16, 256, maxReadSize};
+  const int count = 200;
+  SerialFlashFile file = SerialFlash.open("write256.bin");
+
+  for (int i=0; i < 3; i++) {
+    file.seek(0);
+    unsigned long usec = micros();
+    for (unsigned long n=0; n < testFileSize; n += sizes[i]) {
+      file.read(buffer, sizes[i]);
+    }
+    usec = micros() - usec;
+    result("read_seq", sizes[i], speed(testFileSize, usec), "kB/s");
+  }
+  for (int i=0; i < 3; i++) {
+    seed = 1;
+    unsigned long usec = micros();
+    for (int n=0; n < count; n++) {
+      file.seek(random32() % (testFileSize - sizes[i]));
+      file.read(buffer, sizes[i]);
+    }
+    usec = micros() - usec;
+    result("read_random", sizes[i], usec / count, "us");
+  }
+}
+
+// time to read 16 bytes from one file, while another is busy
+void latencyRead(SerialFlashFile &file, unsigned long &total, unsigned long &most) {
+  file.seek(random32() % (testFileSize - 16));
+  unsigned long usec = micros();
+  file.read(buffer, 16);
+  usec = micros() - usec;
+  total += usec;
+  if (usec > most) most = usec;
+}
+
+void latencyBenchmark() {
+  const int count = 50;
+  SerialFlashFile other = SerialFlash.open("write256.bin");
+  SerialFlashFile erase = SerialFlash.open("erase.bin");
+  unsigned long blocksize = SerialFlash.blockSize();
+  unsigned long total, most;
+  char filename[16];
+
+  // page programs: reads normally wait, or with a read latency
+  // limit they suspend the program
+  for (int mode=0; mode < 2; mode++) {
+    SerialFlash.setReadLatency(mode ? 2000 : 0);
+    sprintf(filename, "latency%d.bin", mode);
+    SerialFlash.create(filename, count * 256);
+    SerialFlashFile file = SerialFlash.open(filename);
+    total = most = 0;
+    seed = 2;
+    fill(mode);
+    for (int n=0; n < count; n++) {
+      file.write(buffer, 256);
+      latencyRead(other, total, most);
+      SerialFlash.wait();
+    }
+    result(mode ? "read_during_program_suspend" : "read_during_program", 16, total / count, "us");
+    result(mode ? "read_during_program_suspend_max" : "read_during_program_max", 16, most, "us");
+  }
+  SerialFlash.setReadLatency(0);
+
+  // block erases are always suspended by reads
+  total = most = 0;
+  seed = 3;
+  for (int n=0; n < 4; n++) {
+    SerialFlash.eraseBlock(erase.getFlashAddress() + n * blocksize);
+    latencyRead(other, total, most);
+    SerialFlash.wait();
+  }
+  result("read_during_erase", 16, total / 4, "us");
+  result("read_during_erase_max", 16, most, "us");
+}
+
+void directoryBenchmark() {
+  const unsigned long counts[] = {10, 100, 500};
+  unsigned long files = 0, usec;
+  char filename[32];
+
+  for (int i=0; i < 3; i++) {
+    // create the files for this count, except the last
+    while (files + 1 < counts[i]) {
+      sprintf(filename, "dir%lu.txt", files++);
+      SerialFlash.create(filename, 16);
+    }
+    sprintf(filename, "dir%lu.txt", files++);
+    usec = micros();
+    SerialFlash.create(filename, 16);
+    result("create", counts[i], micros() - usec, "us");
+
+    sprintf(filename, "dir%lu.txt", files / 2);
+    usec = micros();
+    SerialFlashFile file = SerialFlash.open(filename);
+    result("open", counts[i], micros() - usec, "us");
+    if (!file) Serial.println(F("# open failed"));
+
+    usec = micros();
+    SerialFlash.exists("missing.txt");
+    result("open_missing", counts[i], micros() - usec, "us");
+
+    uint32_t filesize;
+    unsigned long n = 0;
+    usec = micros();
+    SerialFlash.opendir();
+    while (SerialFlash.readdir(filename, sizeof(filename), filesize)) n++;
+    result("readdir", n, micros() - usec, "us");
+  }
+}
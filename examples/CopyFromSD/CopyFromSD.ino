@@ -6,6 +6,18 @@ const int SDchipSelect = 4;    // Audio Shield has SD card CS on pin 10
 const int FlashChipSelect = 6; // digital pin for flash chip CS pin
 //const int FlashChipSelect = 21; // Arduino 101 built-in SPI Flash
 
+// data read from the SD card but not yet written to the Flash chip
+unsigned char copybuffer[2048];
+SerialFlashCopy copier(copybuffer, sizeof(copybuffer));
+
+// read from the SD card, for SerialFlashCopy
+uint32_t readSD(void *buf, uint32_t len, void *context) {
+  File *file = (File *)context;
+  int n = file->read(buf, len);
+  if (n < 0) return 0;
+  return n;
+}
+
 void setup() {
   //uncomment these if using Teensy audio shield
   //SPI.setSCK(14);  // Audio shield has SCK on pin 14
@@ -23,6 +35,7 @@ void setup() {
   while (!Serial && (millis() - startMillis < 10000)) ;
   delay(100);
   Serial.println(F("Copy all files from SD Card to SPI Flash"));
+  copier.setVerify(true);  // read back every page as it's written
 
   if (!SD.begin(SDchipSelect)) {
     error("Unable to access SD card");
@@ -67,33 +80,19 @@ void setup() {
       SerialFlash.remove(filename);
     }
 
-    // create the file on the Flash chip and copy data
-    if (SerialFlash.create(filename, length)) {
-      SerialFlashFile ff = SerialFlash.open(filename);
-      if (ff) {
-        Serial.print(F("  copying"));
-        // copy data loop
-        unsigned long count = 0;
-        unsigned char dotcount = 9;
-        while (count < length) {
-          char buf[256];
-          unsigned int n;
-          n = f.read(buf, 256);
-          ff.write(buf, n);
-          count = count + n;
-          Serial.print(".");
-          if (++dotcount > 100) {
-             Serial.println();
-             dotcount = 0;
-          }
-        }
-        ff.close();
-        if (dotcount > 0) Serial.println();
-      } else {
-        Serial.println(F("  error opening freshly created file!"));
-      }
+    // create the file on the Flash chip and copy data, reading
+    // the SD card while the Flash chip writes each page
+    Serial.print(F("  copying"));
+    unsigned long usec = micros();
+    if (copier.copy(filename, length, readSD, &f)) {
+      usec = micros() - usec;
+      Serial.print(F(", "));
+      Serial.print(usec / 1000);
+      Serial.print(F(" ms, CRC32 = "));
+      Serial.println(copier.crc(), HEX);
     } else {
-      Serial.println(F("  unable to create file"));
+      Serial.println();
+      Serial.println(F("  unable to create or write file"));
     }
     f.close();
   }
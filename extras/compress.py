@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#
+# Compresses files for SerialFlash.createCompressed().  Each file is
+# divided into chunks, which are compressed separately in the LZ4 block
+# format, so SerialFlash can read any part of the file by decoding only
+# the chunks it needs.  The output file is copied to the Flash chip with
+# createCompressed(name, size of the output file) rather than create().
+# After the whole file is written, SerialFlash.open() returns a read-only
+# file which reads the original, uncompressed data.
+#
+# Uses the lz4 module (pip install lz4) when available, otherwise a
+# simpler built in compressor.  Chunks must not be larger than the
+# SERIALFLASH_MAX_CHUNK setting of the library, 4096 bytes by default.
+#
+###################
+
+import argparse, os, struct, sys
+
+MINMATCH = 4
+LASTLITERALS = 5	# the LZ4 block format ends with literals
+MFLIMIT = 12		# no match may begin in the last 12 bytes
+
+def lz4_length(out, n):
+	while n >= 255:
+		out.append(255)
+		n -= 255
+	out.append(n)
+
+def lz4_sequence(out, data, lit, litlen, offset, matchlen):
+	token = min(litlen, 15) << 4
+	if offset:
+		token |= min(matchlen - MINMATCH, 15)
+	out.append(token)
+	if litlen >= 15:
+		lz4_length(out, litlen - 15)
+	out += data[lit:lit + litlen]
+	if offset:
+		out += struct.pack("<H", offset)
+		if matchlen - MINMATCH >= 15:
+			lz4_length(out, matchlen - MINMATCH - 15)
+
+def lz4_compress(data):
+	try:
+		import lz4.block
+		return lz4.block.compress(data, mode="high_compression", store_size=False)
+	except ImportError:
+		pass
+	out = bytearray()
+	table = {}
+	anchor = 0
+	i = 0
+	end = len(data)
+	while i + MFLIMIT <= end:
+		key = data[i:i + MINMATCH]
+		ref = table.get(key)
+		table[key] = i
+		if ref is None or i - ref > 65535:
+			i += 1
+			continue
+		n = MINMATCH
+		while i + n < end - LASTLITERALS and data[ref + n] == data[i + n]:
+			n += 1
+		lz4_sequence(out, data, anchor, i - anchor, i - ref, n)
+		for j in range(i + 1, min(i + n, end - MINMATCH)):
+			table[data[j:j + MINMATCH]] = j
+		i += n
+		anchor = i
+	lz4_sequence(out, data, anchor, end - anchor, 0, 0)
+	return bytes(out)
+
+def compress(data, chunkbits):
+	chunksize = 1 << chunkbits
+	chunks = []
+	for pos in range(0, len(data), chunksize):
+		raw = data[pos:pos + chunksize]
+		packed = lz4_compress(raw)
+		# chunks which do not get smaller are stored as they are
+		chunks.append(packed if len(packed) < len(raw) else raw)
+	out = bytearray(struct.pack("<IB3x", len(data), chunkbits))
+	end = 8 + 4 * len(chunks)
+	for c in chunks:
+		end += len(c)
+		out += struct.pack("<I", end)
+	for c in chunks:
+		out += c
+	return bytes(out)
+
+def main():
+	parser = argparse.ArgumentParser(description="Compress files for SerialFlash.createCompressed()")
+	parser.add_argument("files", nargs="+")
+	parser.add_argument("-o", "--outdir", default="compressed", help="output directory")
+	parser.add_argument("-c", "--chunk", type=int, default=4096, help="chunk size, 256 to 65536")
+	args = parser.parse_args()
+	chunkbits = args.chunk.bit_length() - 1
+	if args.chunk != 1 << chunkbits or chunkbits < 8 or chunkbits > 16:
+		sys.exit("chunk size must be a power of 2, from 256 to 65536")
+	os.makedirs(args.outdir, exist_ok=True)
+	for name in args.files:
+		with open(name, "rb") as f:
+			data = f.read()
+		out = compress(data, chunkbits)
+		with open(os.path.join(args.outdir, os.path.basename(name)), "wb") as f:
+			f.write(out)
+		print("%s: %d -> %d bytes" % (name, len(data), len(out)))
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,40 @@
+#ifndef ARDUINO_STUB_H
+#define ARDUINO_STUB_H
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#define ARDUINO 10800
+#define OUTPUT 1
+#define INPUT 0
+#define INPUT_PULLUP 2
+#define HIGH 1
+#define LOW 0
+#define MSBFIRST 1
+#define F(s) (s)
+#include <atomic>
+extern std::atomic<uint64_t> sim_us;
+void sim_advance(uint32_t us);
+static inline uint32_t micros() { return (uint32_t)sim_us; }
+static inline uint32_t millis() { return (uint32_t)(sim_us / 1000); }
+static inline void delayMicroseconds(uint32_t us) { sim_advance(us); }
+static inline void delay(uint32_t ms) { sim_advance(ms*1000); }
+void yield(void);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+class Print {
+public:
+	virtual size_t write(uint8_t c) { putchar(c); return 1; }
+	size_t write(const uint8_t *b, size_t n) { for (size_t i=0;i<n;i++) write(b[i]); return n; }
+	void begin(unsigned long) {}
+	operator bool() { return true; }
+	void print(char c) { putchar(c); }
+	void print(const char *s) { printf("%s", s); }
+	void print(unsigned long n) { printf("%lu", n); }
+	void println(const char *s="") { printf("%s\n", s); }
+	void println(unsigned long n) { printf("%lu\n", n); }
+	void printf(const char *fmt, ...) __attribute__((format(printf,2,3)));
+};
+extern Print Serial;
+#endif
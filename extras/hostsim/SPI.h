@@ -0,0 +1,23 @@
+#ifndef SPI_STUB_H
+#define SPI_STUB_H
+#include "Arduino.h"
+#define SPI_MODE0 0
+class SPISettings {
+public:
+	SPISettings() : clock(4000000) {}
+	SPISettings(uint32_t c, uint8_t, uint8_t) : clock(c) {}
+	uint32_t clock;
+};
+class SPIClass {
+public:
+	void begin() {}
+	void beginTransaction(SPISettings s);
+	void endTransaction();
+	uint8_t transfer(uint8_t b);
+	uint16_t transfer16(uint16_t w) { uint16_t r = transfer(w >> 8) << 8; return r | transfer(w); }
+	void transfer(void *buf, size_t n) { uint8_t *p=(uint8_t*)buf; while (n--) { *p = transfer(*p); p++; } }
+	int intrans = 0;
+	uint32_t clock = 0;
+};
+extern SPIClass SPI;
+#endif
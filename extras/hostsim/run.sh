@@ -0,0 +1,31 @@
+#!/bin/sh
+# Builds the library against the simulated chips in sim.cpp and runs
+# every t_*.cpp test.  Extra arguments are passed to the compiler, for
+# example
+#   sh extras/hostsim/run.sh -DSERIALFLASH_FORMAT=2
+# A test's "// build:" line adds its own compiler flags.  Tests built
+# with SERIALFLASH_HOST use the host backend instead of sim.cpp.  When
+# t_name.sh exists, it runs the test, given the test program and the
+# repository directory, with the extra arguments in $SIMFLAGS.
+# Binaries and images go in $TMPDIR/serialflash-hostsim.  Times
+# printed by the tests are in simulated microseconds.
+cd "$(dirname "$0")" || exit 1
+src=$(pwd)
+repo=$(cd ../.. && pwd)
+out=${TMPDIR:-/tmp}/serialflash-hostsim
+mkdir -p "$out" || exit 1
+for t in t_*.cpp; do
+  b=${t%.cpp}
+  fl=$(sed -n 's|^// build: ||p' $t)
+  case "$fl" in
+  *SERIALFLASH_HOST*) sim= ;;
+  *) sim="-I$src $src/sim.cpp" ;;
+  esac
+  g++ -std=gnu++11 -Wall -Wextra -g $fl "$@" -I"$repo" $sim -o "$out/$b" $t "$repo"/*.cpp -lpthread || { echo "FAIL $b"; exit 1; }
+  if [ -f $b.sh ]; then
+    (cd "$out" && SIMFLAGS="$*" sh "$src/$b.sh" "$out/$b" "$repo")
+  else
+    (cd "$out" && "./$b")
+  fi || { echo "FAIL $b"; exit 1; }
+done
+echo "all ok"
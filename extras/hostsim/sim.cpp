@@ -0,0 +1,301 @@
+// Simulated SPI NOR and NAND Flash chips, for running the library and
+// its tests on a host computer.  Time is virtual: sim_us advances only
+// as SPI bytes are sent and by delay(), so results are repeatable.
+#include "SPI.h"
+#include <vector>
+#include <stdarg.h>
+#include <execinfo.h>
+void sim_backtrace() { void *b[40]; int n = backtrace(b, 40); backtrace_symbols_fd(b, n, 2); }
+std::atomic<uint64_t> sim_us(0);
+Print Serial;
+SPIClass SPI;
+void Print::printf(const char *fmt, ...) { va_list a; va_start(a, fmt); vprintf(fmt, a); va_end(a); }
+
+struct Sim {
+	std::vector<uint8_t> mem;
+	uint8_t id[5] = {0xEF, 0x40, 0x18, 0, 0};
+	int cs = 1;
+	std::vector<uint8_t> cmd;
+	bool wel = false, addr4 = false, sleeping = false; uint64_t wakeat = 0;
+	uint64_t busy_until = 0;
+	int busykind = 0; // 1 program 2 erase 3 chip
+	bool suspended = false; uint64_t remaining = 0; int susp_kind=0;
+	uint32_t erase_addr = 0, prog_page = 0;
+	long transactions = 0, commands = 0, bytes = 0, suspends = 0;
+	long pp_us = 700, be_us = 50000, ce_us = 2000000;
+	std::vector<uint8_t> pending; uint32_t pend_addr=0; int pend_kind=0;
+	void finish() {
+		if (busykind && sim_us >= busy_until) { busykind = 0; }
+	}
+};
+Sim SD[2];
+Sim *SP = &SD[0];
+#define S (*SP)
+
+void sim_advance(uint32_t us) { sim_us += us; }
+#include <sched.h>
+static std::atomic<long> yields(0);
+void yield(void) { sim_us += 1; yields++; sched_yield(); }
+long sim_yields() { return yields; }
+void pinMode(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return S.cs; }
+static uint32_t getaddr(size_t off, int *n) {
+	if (S.addr4) { *n = 4; return (S.cmd[off]<<24)|(S.cmd[off+1]<<16)|(S.cmd[off+2]<<8)|S.cmd[off+3]; }
+	*n = 3; return (S.cmd[off]<<16)|(S.cmd[off+1]<<8)|S.cmd[off+2];
+}
+static bool isbusy() { S.finish(); return S.busykind != 0; }
+
+// ---- SPI NAND mode ----
+#include <map>
+struct NandSim {
+	bool on = false;
+	uint8_t id[3];
+	int blocks = 0, planes = 1;
+	std::map<uint32_t, std::vector<uint8_t>> pages; // row -> 2112 bytes
+	std::map<uint32_t, int> nop;
+	std::vector<uint8_t> cache, datareg;
+	int cacheplane = 0;
+	uint8_t feat_a0 = 0x38, feat_b0 = 0x10;
+	bool wel = false;
+	uint64_t busy_until = 0;
+	uint8_t ecc = 0, fail = 0;
+	std::map<uint32_t,uint8_t> eccinject;
+	std::map<uint32_t,int> worn; // blocks whose erases and programs fail
+	long pageread = 0, cacheread = 0, programs = 0, erases = 0;
+	static const int PS = 2112;
+	std::vector<uint8_t> &page(uint32_t row) {
+		auto it = pages.find(row);
+		if (it == pages.end()) it = pages.emplace(row, std::vector<uint8_t>(PS, 0xFF)).first;
+		return it->second;
+	}
+	bool busy() { return sim_us < busy_until; }
+	void chk(uint32_t row) {
+		if ((int)(row / 64) >= blocks) { fprintf(stderr, "NAND: row %u out of range\n", row); abort(); }
+	}
+	int plane(uint32_t row) { return planes == 2 ? (row / 64) & 1 : 0; }
+	uint32_t col(const std::vector<uint8_t> &c) {
+		uint32_t v = (c[1] << 8) | c[2];
+		int pl = (v >> 12) & 1;
+		if (planes == 2 && pl != cacheplane) { fprintf(stderr, "NAND: plane bit %d, cache plane %d\n", pl, cacheplane); abort(); }
+		return v & 0xFFF;
+	}
+	bool isbad(uint32_t blk) { auto it = pages.find(blk*64); return it != pages.end() && it->second[2048] != 0xFF && nop[blk*64] == 0; }
+};
+NandSim ND[2];
+NandSim *NP = &ND[0];
+#define N (*NP)
+static long nand_cut = -1; // programs and erases until power is lost
+static void nand_powercut() {
+	if (nand_cut < 0 || nand_cut-- > 0) return;
+	nand_cut = -1;
+	throw 1;
+}
+static uint32_t nrow(const std::vector<uint8_t> &c) { return (c[1] << 16) | (c[2] << 8) | c[3]; }
+static void nand_release() {
+	std::vector<uint8_t> &c = S.cmd;
+	uint8_t op = c[0];
+	if (op != 0x0F && op != 0x9F && op != 0xC2 && !(op == 0x1F && c[1] == 0xD0) && N.busy()) { fprintf(stderr, "NAND: command %02X while busy\n", op); abort(); }
+	if (op == 0xFF) { N.busy_until = sim_us + 500; N.wel = false; }
+	else if (op == 0x06) N.wel = true;
+	else if (op == 0x1F && c.size() >= 3 && c[1] == 0xD0) { NP = &ND[c[2] >> 6]; }
+	else if (op == 0xC2 && c.size() >= 2) { NP = &ND[c[1] & 1]; }
+	else if (op == 0x1F && c.size() >= 3) { if (c[1] == 0xA0) N.feat_a0 = c[2]; if (c[1] == 0xB0) N.feat_b0 = c[2]; }
+	else if (op == 0x13 && c.size() >= 4) {
+		uint32_t r = nrow(c); N.chk(r);
+		N.datareg = N.page(r); N.cache = N.datareg; N.cacheplane = N.plane(r);
+		N.ecc = N.eccinject.count(r) ? N.eccinject[r] : 0;
+		N.busy_until = sim_us + 50; N.pageread++;
+	} else if (op == 0x30 && c.size() >= 4) {
+		uint32_t r = nrow(c); N.chk(r);
+		if (N.plane(r) != N.cacheplane) { fprintf(stderr, "NAND: cache read across planes\n"); abort(); }
+		N.cache = N.datareg; N.datareg = N.page(r); N.busy_until = sim_us + 3; N.cacheread++;
+		N.ecc = N.eccinject.count(r) ? N.eccinject[r] : 0;
+	} else if (op == 0x3F) { N.cache = N.datareg; N.busy_until = sim_us + 3; }
+	else if ((op == 0x02 || op == 0x84) && c.size() >= 3) {
+		if (op == 0x02) { N.cache.assign(NandSim::PS, 0xFF); N.cacheplane = (c[1] >> 4) & 1; }
+		uint32_t a = N.col(c);
+		for (size_t i = 3; i < c.size(); i++) N.cache[a++] = c[i];
+	} else if (op == 0x10 && c.size() >= 4) {
+		uint32_t r = nrow(c); N.chk(r);
+		if (!N.wel || N.feat_a0) { fprintf(stderr, "NAND: program without WEL/unlock\n"); abort(); }
+		if (N.plane(r) != N.cacheplane) { fprintf(stderr, "NAND: program to other plane\n"); abort(); }
+		if (N.isbad(r / 64)) { fprintf(stderr, "NAND: program bad block %u\n", r/64); abort(); }
+		nand_powercut();
+		// with ECC off, the spare area may be programmed again
+		if (++N.nop[r] > 1 && (N.feat_b0 & 0x10)) { fprintf(stderr, "NAND: page %u programmed twice\n", r); sim_backtrace(); abort(); }
+		std::vector<uint8_t> &pg = N.page(r);
+		bool worn = N.worn.count(r / 64);
+		// a worn block programs only part of the data
+		for (int i = 0; i < NandSim::PS; i++) if (!worn || i < 700 || i >= 2048) pg[i] &= N.cache[i];
+		N.wel = false; N.busy_until = sim_us + 300; N.programs++; N.fail = worn ? 0x08 : 0;
+	} else if (op == 0xD8 && c.size() >= 4) {
+		uint32_t r = nrow(c); N.chk(r);
+		if (!N.wel || N.feat_a0) { fprintf(stderr, "NAND: erase without WEL/unlock\n"); abort(); }
+		if (r % 64) { fprintf(stderr, "NAND: erase row not block aligned\n"); abort(); }
+		if (N.isbad(r / 64)) { fprintf(stderr, "NAND: erase bad block %u\n", r/64); abort(); }
+		nand_powercut();
+		bool worn = N.worn.count(r / 64);
+		// a worn block erases only some pages
+		for (int i = 0; i < (worn ? 10 : 64); i++) { N.pages.erase(r + i); N.nop.erase(r + i); }
+		N.wel = false; N.busy_until = sim_us + 2000; N.erases++; N.fail = worn ? 0x04 : 0;
+	}
+}
+static uint8_t nand_transfer(size_t pos) {
+	std::vector<uint8_t> &c = S.cmd;
+	uint8_t op = c[0];
+	if (op == 0x9F && pos >= 2 && pos <= 4) return N.id[pos-2];
+	if (op == 0x0F && pos >= 2) {
+		if (c[1] == 0xC0) return (N.busy() ? 1 : 0) | (N.ecc << 4) | N.fail;
+		if (c[1] == 0xA0) return N.feat_a0;
+		if (c[1] == 0xB0) return N.feat_b0;
+		return 0;
+	}
+	if (op == 0x03 && pos >= 4) {
+		if (N.busy()) { fprintf(stderr, "NAND: cache read while busy\n"); abort(); }
+		uint32_t a = N.col(c) + pos - 4;
+		return a < (uint32_t)NandSim::PS ? N.cache[a] : 0xFF;
+	}
+	return 0;
+}
+void sim_init_nand(const uint8_t *id, int blocks, int planes, const int *bad, int nbad) {
+	for (int d = 0; d < 2; d++) {
+		NandSim &n = ND[d];
+		n.on = true; memcpy(n.id, id, 3); n.blocks = blocks; n.planes = planes;
+	}
+	for (int i = 0; i < nbad; i++) { ND[bad[i] / blocks].page((bad[i] % blocks)*64)[2048] = 0x00; }
+}
+void sim_nand_ecc(uint32_t row, uint8_t ecc) { N.eccinject[row] = ecc; }
+void sim_nand_wornout(int die, uint32_t block) { ND[die].worn[block] = 1; }
+void sim_nand_powercut(long ops) { nand_cut = ops; }
+void sim_nand_poweron() {
+	for (int d = 0; d < 2; d++) { SD[d].cs = 1; SD[d].cmd.clear(); ND[d].busy_until = 0; ND[d].wel = false; }
+	NP = &ND[0]; SP = &SD[0]; SPI.intrans = 0;
+}
+bool sim_nand_erased(int die, uint32_t block) {
+	for (int i = 0; i < 64; i++) if (ND[die].pages.count(block * 64 + i)) return false;
+	return true;
+}
+void sim_nand_stats(long *pr, long *cr, long *pg, long *er) {
+	*pr = *cr = *pg = *er = 0;
+	for (int d = 0; d < 2; d++) { *pr += ND[d].pageread; *cr += ND[d].cacheread; *pg += ND[d].programs; *er += ND[d].erases; }
+}
+void digitalWrite(uint8_t, uint8_t val) {
+	if (N.on) {
+		if (val == 0 && S.cs) { S.cmd.clear(); S.commands++; }
+		if (val && !S.cs && S.cmd.size()) { nand_release(); S.cmd.clear(); }
+		S.cs = val; return;
+	}
+	if (val == 0 && S.cs) { S.cmd.clear(); S.commands++; }
+	if (val && !S.cs && S.cmd.size()) {
+		uint8_t c = S.cmd[0]; int n;
+		uint32_t sz = S.mem.size();
+		if (S.sleeping && c != 0xAB && c != 0xC2) { fprintf(stderr, "SIM: command %02X while sleeping\n", c); abort(); }
+		if (c != 0xAB && c != 0xC2 && c != 0xB9 && S.wakeat && sim_us < S.wakeat + 3) { fprintf(stderr, "SIM: command %02X before tRES1\n", c); abort(); }
+		if (c == 0xC2 && S.cmd.size() >= 2) {
+			Sim *next = &SD[S.cmd[1] & 1];
+			S.cmd.clear();
+			next->cs = 1; next->cmd.clear();
+			SP = next;
+			return;
+		}
+		if (c == 0x06) S.wel = true;
+		else if (c == 0xB7) S.addr4 = true;
+		else if (c == 0xB9) S.sleeping = true;
+		else if (c == 0xAB) { if (S.sleeping) S.wakeat = sim_us; S.sleeping = false; }
+		else if (c == 0x02 && S.cmd.size() > 4) {
+			if (isbusy()) { fprintf(stderr, "SIM: program while busy\n"); abort(); }
+			if (!S.wel) { fprintf(stderr, "SIM: program without WEL\n"); abort(); }
+			uint32_t a = getaddr(1, &n) % sz;
+			if (S.suspended && S.susp_kind == 2 && (a & ~0xFFFFu) == (S.erase_addr & ~0xFFFFu)) { fprintf(stderr, "SIM: program in suspended erase block\n"); abort(); }
+			uint32_t page = a & ~255u; S.prog_page = page;
+			for (size_t i = 1 + n; i < S.cmd.size(); i++) {
+				S.mem[page | (a & 255)] &= S.cmd[i]; a++;
+			}
+			S.busykind = 1; S.busy_until = sim_us + S.pp_us; S.wel = false;
+		} else if (c == 0xD8 && S.cmd.size() >= 4) {
+			if (isbusy() || S.suspended) { fprintf(stderr, "SIM: erase while busy/suspended\n"); abort(); }
+			uint32_t a = getaddr(1, &n) % sz; a &= ~0xFFFFu;
+			memset(&S.mem[a], 0xFF, 65536);
+			S.erase_addr = a;
+			S.busykind = 2; S.busy_until = sim_us + S.be_us; S.wel = false;
+		} else if (c == 0xC7 || c == 0x60) {
+			if (isbusy()) { fprintf(stderr, "SIM: chip erase while busy\n"); abort(); }
+			memset(&S.mem[0], 0xFF, sz);
+			S.busykind = 3; S.busy_until = sim_us + S.ce_us; S.wel = false;
+		} else if (c == 0x75) {
+			if (isbusy() && S.busykind < 3) {
+				if (S.suspended) { fprintf(stderr, "SIM: nested suspend\n"); abort(); }
+				S.suspended = true; S.susp_kind = S.busykind; S.remaining = S.busy_until - sim_us;
+				S.busykind = 0; S.suspends++;
+			}
+		} else if (c == 0x7A) {
+			if (S.suspended) {
+				if (isbusy()) { fprintf(stderr, "SIM: resume while busy\n"); abort(); }
+				S.suspended = false; S.busykind = S.susp_kind; S.busy_until = sim_us + S.remaining + 20;
+			}
+		}
+		S.cmd.clear();
+	}
+	S.cs = val;
+}
+uint32_t sim_miso_hz, sim_mosi_hz;
+void sim_signal(uint32_t miso, uint32_t mosi) { sim_miso_hz = miso; sim_mosi_hz = mosi; }
+uint8_t sim_byte(uint8_t b);
+void SPIClass::beginTransaction(SPISettings s) {
+	if (intrans) { fprintf(stderr, "SIM: nested beginTransaction\n"); abort(); }
+	intrans = 1; clock = s.clock; S.transactions++; sim_us += 1;
+}
+void SPIClass::endTransaction() {
+	if (!intrans) { fprintf(stderr, "SIM: endTransaction without begin\n"); abort(); }
+	intrans = 0;
+}
+uint8_t SPIClass::transfer(uint8_t b) {
+	if (!intrans) { fprintf(stderr, "SIM: transfer outside transaction\n"); abort(); }
+	if (S.cs) return 0xFF;
+	S.bytes++;
+	static uint64_t frac = 0; frac += 8000000000ull / (clock ? clock : 1); sim_us += frac / 1000; frac %= 1000;
+	if (sim_mosi_hz && clock > sim_mosi_hz) b ^= 0x10;
+	uint8_t r = sim_byte(b);
+	if (sim_miso_hz && clock > sim_miso_hz) r ^= 0x01;
+	return r;
+}
+uint8_t sim_byte(uint8_t b) {
+	S.cmd.push_back(b);
+	uint8_t c = S.cmd[0];
+	size_t pos = S.cmd.size() - 1;
+	if (N.on) return nand_transfer(pos);
+	if (S.sleeping && c != 0xAB && c != 0xC2) { fprintf(stderr, "SIM: transfer while sleeping\n"); abort(); }
+	if (c == 0x9F && pos >= 1 && pos <= 5) return S.id[pos-1];
+	if (c == 0x05 && pos >= 1) { return isbusy() ? 0x01 : 0x00; }
+	if (c == 0x70 && pos >= 1) { return isbusy() ? 0x00 : 0x80; }
+	if (c == 0x4B && pos >= 5) return 0x42;
+	if (c == 0x03 || c == 0x0B) {
+		int n = S.addr4 ? 4 : 3;
+		if (pos == 1 && c == 0x03 && SPI.clock > 50000000) { fprintf(stderr, "SIM: read (03) at %u Hz\n", SPI.clock); abort(); }
+		if (c == 0x0B) { if ((int)pos <= n + 1) return 0; pos--; }
+		if ((int)pos > n) {
+			if (isbusy() && sim_miso_hz) return 0xFF;
+			if (isbusy()) { fprintf(stderr, "SIM: read while busy (kind %d)\n", S.busykind); sim_backtrace(); abort(); }
+			int k; uint32_t a = getaddr(1, &k);
+			a += pos - n - 1;
+			if (S.suspended && S.susp_kind == 1 && (a & ~255u) == S.prog_page) { fprintf(stderr, "SIM: read of suspended program page\n"); sim_backtrace(); abort(); }
+			return S.mem[a % S.mem.size()];
+		}
+	}
+	return 0;
+}
+void sim_init(uint32_t size, const uint8_t *id) {
+	S.mem.assign(size, 0xFF);
+	if (id) memcpy(S.id, id, 5);
+}
+void sim_init_die2(uint32_t size, const uint8_t *id) {
+	SD[1].mem.assign(size, 0xFF);
+	memcpy(SD[1].id, id, 5);
+}
+int sim_die() { return SP == &SD[1]; }
+long sim_die_suspends(int d) { return SD[d].suspends; }
+void sim_stats(long *t, long *c, long *b) { *t = S.transactions; *c = S.commands; *b = S.bytes; }
+uint8_t *sim_mem() { return &S.mem[0]; }
+long sim_suspends() { return S.suspends; }
+
+bool sim_sleeping(int d) { return SD[d].sleeping; }
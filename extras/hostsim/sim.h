@@ -0,0 +1,17 @@
+void sim_init(uint32_t size, const uint8_t *id);
+void sim_stats(long *t, long *c, long *b);
+uint8_t *sim_mem();
+long sim_suspends();
+long sim_yields();
+void sim_init_nand(const uint8_t *id, int blocks, int planes, const int *bad, int nbad);
+void sim_nand_ecc(uint32_t row, uint8_t ecc);
+void sim_nand_stats(long *pr, long *cr, long *pg, long *er);
+void sim_init_die2(uint32_t size, const uint8_t *id);
+int sim_die();
+long sim_die_suspends(int d);
+bool sim_sleeping(int d);
+void sim_signal(uint32_t miso, uint32_t mosi);
+void sim_nand_wornout(int die, uint32_t block);
+void sim_nand_powercut(long ops);
+void sim_nand_poweron();
+bool sim_nand_erased(int die, uint32_t block);
@@ -0,0 +1,43 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	char name[32];
+	for (int i=0; i < 300; i++) {
+		snprintf(name, sizeof(name), "voices/en/%04d.raw", i);
+		assert(SerialFlash.create(name, 1000 + i, (i % 7 == 0) ? SerialFlash.blockSize() : 0));
+	}
+	assert(!SerialFlash.create("voices/en/0005.raw", 10));
+	// blank chips get the original directory format unless built with
+	// SERIALFLASH_FORMAT 2, and only version 2 has checked files
+	uint32_t sig; SerialFlash.read(0, &sig, 4);
+	bool v2 = sig == 0xFA96554D;
+	assert(v2 || sig == 0xFA96554C);
+	assert(SerialFlash.createChecked("checked", 100) == v2);
+	if (v2) assert(SerialFlash.remove("checked"));
+	SerialFlashFile f = SerialFlash.open("voices/en/0123.raw");
+	assert(f && f.size() == 1123);
+	uint8_t buf[300]; for (int i=0;i<300;i++) buf[i]=i*7;
+	assert(f.write(buf, 300) == 300);
+	while (!SerialFlash.ready());
+	uint8_t rb[300]; f.seek(0); f.read(rb, 300);
+	assert(memcmp(buf, rb, 300) == 0);
+	assert(SerialFlash.remove("voices/en/0010.raw"));
+	assert(!SerialFlash.exists("voices/en/0010.raw"));
+	long t0, c0, b0, t1, c1, b1;
+	sim_stats(&t0, &c0, &b0);
+	SerialFlash.opendir();
+	uint32_t sz; int n = 0;
+	while (SerialFlash.readdir(name, sizeof(name), sz)) {
+		n++;
+	}
+	sim_stats(&t1, &c1, &b1);
+	printf("readdir: %d files, %ld transactions, %ld commands, %ld bytes\n", n, t1-t0, c1-c0, b1-b0);
+	assert(n == 299);
+	// SerialFlashDir reads the directory in large chunks
+	assert(t1 - t0 < 200);
+	printf("basic ok\n");
+	return 0;
+}
@@ -0,0 +1,7 @@
+#include "SerialFlash.h"
+#include "sim.h"
+// prototypes, as the Arduino IDE generates
+void result(const char *, unsigned long, unsigned long, const char *);
+void eraseBenchmark(); void writeBenchmark(); void readBenchmark(); void latencyBenchmark(); void directoryBenchmark();
+#include "examples/Benchmark/Benchmark.ino"
+int main() { sim_init(16*1024*1024, NULL); setup(); return 0; }
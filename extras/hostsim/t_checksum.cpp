@@ -0,0 +1,115 @@
+// build: -DSERIALFLASH_FORMAT=2
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <stdio.h>
+static uint32_t crc_ref(const uint8_t *p, uint32_t n) {
+	uint32_t c = 0xFFFFFFFF;
+	while (n--) { c ^= *p++; for (int i=0;i<8;i++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1; }
+	return ~c;
+}
+// set the last 4 bytes of p so its CRC-32 is want, the CRC being affine in them
+static void forge(uint8_t *p, uint32_t n, uint32_t want) {
+	uint32_t col[32], rows[32], x = 0;
+	memset(p + n - 4, 0, 4);
+	uint32_t c0 = crc_ref(p, n);
+	for (int b = 0; b < 32; b++) {
+		p[n - 4 + b / 8] = 1 << (b % 8);
+		col[b] = crc_ref(p, n) ^ c0;
+		p[n - 4 + b / 8] = 0;
+	}
+	// solve sum of x_b col[b] = want ^ c0 by elimination on an augmented basis
+	uint32_t rhs = want ^ c0;
+	int used[32] = {0};
+	for (int b = 0; b < 32; b++) rows[b] = 1u << b; // which inputs make col[b]
+	for (int bit = 31; bit >= 0; bit--) {
+		int piv = -1;
+		for (int b = 0; b < 32; b++) if (!used[b] && (col[b] >> bit & 1)) { piv = b; break; }
+		assert(piv >= 0);
+		used[piv] = 1;
+		for (int b = 0; b < 32; b++) if (b != piv && (col[b] >> bit & 1)) { col[b] ^= col[piv]; rows[b] ^= rows[piv]; }
+		if (rhs >> bit & 1) { rhs ^= col[piv]; x ^= rows[piv]; }
+	}
+	assert(rhs == 0);
+	for (int i = 0; i < 4; i++) p[n - 4 + i] = x >> (i * 8);
+	assert(crc_ref(p, n) == want);
+}
+static int foundcount; static char foundname[32]; static uint32_t foundoffset;
+static void found(const char *name, uint32_t offset) { foundcount++; strcpy(foundname, name); foundoffset = offset; }
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	static uint8_t data[10000], buf[10000];
+	for (int i=0;i<10000;i++) data[i] = i * 7 + (i >> 8);
+	assert(SerialFlashCRC32(0, "123456789", 9) == 0xCBF43926);
+	assert(SerialFlashCRC32(SerialFlashCRC32(0, data, 5000), data + 5000, 5000) == crc_ref(data, 10000));
+	assert(SerialFlash.create("plain", 100));
+	assert(SerialFlash.createChecked("a", 10000));
+	assert(!SerialFlash.createChecked("a", 10));
+	SerialFlashFile f = SerialFlash.open("a");
+	assert(f && f.size() == 10000);
+	for (int i=0; i < 10000; i += 1000) assert(f.write(data + i, 1000) == 1000);
+	SerialFlash.wait();
+	// the table holds the CRC of each chunk
+	uint32_t table[3];
+	SerialFlash.read(f.getFlashAddress() - 12, table, 12);
+	assert(table[0] == ~crc_ref(data, 4096) && table[1] == ~crc_ref(data + 4096, 4096) && table[2] == ~crc_ref(data + 8192, 1808));
+	f = SerialFlash.open("a");
+	assert(f.read(buf, 10000) == 10000 && !memcmp(buf, data, 10000) && !f.damaged());
+	// damage one bit in the second chunk
+	uint32_t bad = f.getFlashAddress() + 5000;
+	sim_mem()[bad] = data[5000] ^ 1;
+	f = SerialFlash.open("a");
+	assert(f.read(buf, 100) == 100 && !f.damaged());
+	f.seek(9000);
+	assert(f.read(buf, 100) == 100 && !memcmp(buf, data + 9000, 100) && !f.damaged());
+	f.seek(4000);
+	assert(f.read(buf, 200) == 0 && f.damaged() && f.position() == 4000);
+	f = SerialFlash.open("a");
+	f.seek(8000);
+	assert(f.read(buf, 2000) == 0 && f.damaged());
+	f = SerialFlash.open("a");
+	f.seek(8192);
+	assert(f.read(buf, 2000) == 1808 && !memcmp(buf, data + 8192, 1808) && !f.damaged());
+	f.seek(0);
+	assert(f.read(buf, 10000) == 0 && f.damaged());
+	// a file never finished, and an empty one
+	assert(SerialFlash.createChecked("b", 5000));
+	SerialFlashFile b = SerialFlash.open("b");
+	b.write(data, 3000);
+	assert(SerialFlash.createChecked("z", 0));
+	SerialFlashFile z = SerialFlash.open("z");
+	assert(z && z.size() == 0 && z.read(buf, 10) == 0);
+	b = SerialFlash.open("b");
+	assert(b.read(buf, 3000) == 3000 && !memcmp(buf, data, 3000) && !b.damaged());
+	// scrub in short slices
+	SerialFlashScrub state;
+	memset(&state, 0, sizeof(state));
+	state.found = found;
+	int calls = 1;
+	while (SerialFlash.scrub(state, 100)) calls++;
+	printf("scrub: %d calls, files %u chunks %u damaged %u unfinished %u\n", calls, state.files, state.chunks, state.damaged, state.unfinished);
+	assert(calls > 3 && state.files == 3 && state.chunks == 2 && state.damaged == 1 && state.unfinished == 2);
+	assert(foundcount == 1 && !strcmp(foundname, "a") && foundoffset == 4096);
+	assert(!SerialFlash.scrub(state, 1000));
+	SerialFlashCheck result;
+	assert(SerialFlash.check(result) && result.files == 4);
+	// chunks whose CRC-32 is all ones or zero are still verified
+	static const uint32_t crcs[2] = {0xFFFFFFFF, 0};
+	for (int k = 0; k < 2; k++) {
+		char name[8];
+		snprintf(name, sizeof(name), "c%d", k);
+		memcpy(buf, data, 4096);
+		forge(buf, 4096, crcs[k]);
+		assert(SerialFlash.createChecked(name, 4096));
+		SerialFlashFile c = SerialFlash.open(name);
+		c.write(buf, 4096);
+		SerialFlash.wait();
+		c = SerialFlash.open(name);
+		assert(c.read(data, 4096) == 4096 && !memcmp(data, buf, 4096) && !c.damaged());
+		sim_mem()[c.getFlashAddress() + 10] ^= 4;
+		c = SerialFlash.open(name);
+		assert(c.read(data, 4096) == 0 && c.damaged());
+	}
+	printf("checksum ok\n");
+}
@@ -0,0 +1,52 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <stdio.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	uint32_t r, p, s;
+	SerialFlash.getClock(r, p, s);
+	assert(r == 50000000 && p == 50000000 && s == 50000000);
+	assert(SerialFlash.create("data", 1000));
+	SerialFlashFile f = SerialFlash.open("data");
+	f.write("hello world", 12);
+	assert(SerialFlash.createErasable("cal", 65536));
+	SerialFlashFile cal = SerialFlash.open("cal");
+	assert(!SerialFlash.calibrate(cal.getFlashAddress() + 256, 65536)); // not aligned
+	// board limits: data from the chip fails above 40 MHz, to it above 80
+	sim_signal(40000000, 80000000);
+	assert(SerialFlash.calibrate(cal.getFlashAddress(), cal.size()));
+	SerialFlash.getClock(r, p, s);
+	printf("calibrated: read %u program %u status %u\n", r, p, s);
+	assert(r == 40000000 && p == 80000000 && s == 40000000);
+	// a faster board, reads use fast read above 50 MHz
+	sim_signal(100000000, 0);
+	assert(SerialFlash.calibrate(cal.getFlashAddress(), cal.size()));
+	SerialFlash.getClock(r, p, s);
+	printf("calibrated: read %u program %u status %u\n", r, p, s);
+	assert(r == 100000000 && p == 104000000 && s == 100000000);
+	// the region is left erased
+	SerialFlash.wait();
+	static uint8_t blk[65536];
+	SerialFlash.read(cal.getFlashAddress(), blk, sizeof(blk));
+	for (uint32_t i=0; i < sizeof(blk); i++) assert(blk[i] == 0xFF);
+	char buf[12];
+	f = SerialFlash.open("data");
+	f.read(buf, 12); assert(!strcmp(buf, "hello world"));
+	// sessions change clocks between reads and writes
+	SerialFlash.beginSession();
+	assert(SerialFlash.create("two", 300));
+	SerialFlashFile t = SerialFlash.open("two");
+	t.write("abc", 4);
+	SerialFlash.read(f.getFlashAddress(), buf, 12); assert(!strcmp(buf, "hello world"));
+	SerialFlash.endSession();
+	SerialFlash.wait();
+	// stored settings
+	SerialFlash.setClock(30000000, 50000000, 20000000);
+	SerialFlash.getClock(r, p, s);
+	assert(r == 30000000 && p == 50000000 && s == 20000000);
+	t.seek(0); t.read(buf, 4); assert(!strcmp(buf, "abc"));
+	printf("clock ok\n");
+	return 0;
+}
@@ -0,0 +1,60 @@
+// build: -DSERIALFLASH_FORMAT=2
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <vector>
+static std::vector<uint8_t> load(const char *n) {
+	FILE *f = fopen(n, "rb"); assert(f); std::vector<uint8_t> v; int c;
+	while ((c = fgetc(f)) != EOF) v.push_back(c);
+	fclose(f); return v;
+}
+static uint32_t zeros(void *buf, uint32_t len, void *) {
+	memset(buf, 0, len);
+	return len;
+}
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	std::vector<uint8_t> orig = load("cin.bin");
+	const char *names[2] = {"cout/cin.bin", "cout256/cin.bin"};
+	for (int k = 0; k < 2; k++) {
+		std::vector<uint8_t> z = load(names[k]);
+		char fn[16]; sprintf(fn, "img%d.bin", k);
+		assert(SerialFlash.createCompressed(fn, z.size()));
+		SerialFlashFile f = SerialFlash.open(fn);
+		assert(f && f.size() == z.size());
+		for (size_t i = 0; i < z.size(); i += 1000) f.write(&z[i], std::min<size_t>(1000, z.size() - i));
+		SerialFlash.wait();
+		f = SerialFlash.open(fn);
+		assert(f && f.size() == orig.size());
+		assert(f.write("x", 1) == 0);
+		static uint8_t cbuf[1024];
+		SerialFlashCopy copier(cbuf, sizeof(cbuf));
+		assert(!copier.copy(f, 1000, zeros, NULL));
+		f.seek(0);
+		// sequential whole-file read in odd sizes
+		std::vector<uint8_t> out(orig.size());
+		uint32_t p = 0; long c0, t0, b0; sim_stats(&t0, &c0, &b0);
+		while (p < orig.size()) { uint32_t n = f.read(&out[p], 777); assert(n > 0); p += n; }
+		long c1, t1, b1; sim_stats(&t1, &c1, &b1);
+		assert(memcmp(&out[0], &orig[0], orig.size()) == 0);
+		printf("%s: %zu -> %zu, SPI bytes %ld for sequential read\n", fn, orig.size(), z.size(), b1 - b0);
+		// random access
+		srand(k);
+		for (int r = 0; r < 2000; r++) {
+			uint32_t off = rand() % orig.size(), len = rand() % 9000;
+			uint8_t buf[9000];
+			f.seek(off);
+			uint32_t n = f.read(buf, len);
+			assert(n == std::min<uint32_t>(len, orig.size() - off));
+			assert(memcmp(buf, &orig[off], n) == 0);
+		}
+		// aligned whole-chunk reads
+		f.seek(4096); uint8_t big[8192]; assert(f.read(big, 8192) == 8192); assert(!memcmp(big, &orig[4096], 8192));
+	}
+	// ordinary files unaffected, v1-style checks
+	assert(SerialFlash.create("plain", 100));
+	SerialFlashFile pl = SerialFlash.open("plain"); assert(pl.size() == 100);
+	printf("compress ok\n");
+	return 0;
+}
@@ -0,0 +1,13 @@
+# input for t_compress: text, some random bytes and zeros, compressed
+# with the default and the smallest chunk size
+python3 - cin.bin <<'END'
+import random, sys
+random.seed(1)
+words = b"alpha beta gamma delta serial flash".split()
+data = b" ".join(random.choice(words) for i in range(16000))[:100000]
+data += bytes(random.randrange(256) for i in range(4000)) + bytes(25003)
+open(sys.argv[1], "wb").write(data)
+END
+python3 "$2/extras/compress.py" -o cout cin.bin > /dev/null || exit 1
+python3 "$2/extras/compress.py" -c 256 -o cout256 cin.bin > /dev/null || exit 1
+"$1"
@@ -0,0 +1,97 @@
+// build: -DSERIALFLASH_FORMAT=2
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <stdio.h>
+// an SD card: 800 us per read call, plus 0.25 us per byte
+struct src { const uint8_t *data; uint32_t pos, len; };
+static uint32_t sdread(void *buf, uint32_t len, void *context) {
+	src *s = (src *)context;
+	if (len > s->len - s->pos) len = s->len - s->pos;
+	memcpy(buf, s->data + s->pos, len);
+	s->pos += len;
+	sim_advance(800 + len / 4);
+	return len;
+}
+static uint32_t crc32(const uint8_t *p, uint32_t len) {
+	uint32_t c = 0xFFFFFFFF;
+	while (len--) { c ^= *p++; for (int i = 0; i < 8; i++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1; }
+	return ~c;
+}
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	const uint32_t LEN = 100000;
+	static uint8_t data[LEN];
+	for (uint32_t i = 0; i < LEN; i++) data[i] = i * 7 + (i >> 9);
+	// the old way: read 256, write 256
+	assert(SerialFlash.create("old", LEN));
+	SerialFlashFile f = SerialFlash.open("old");
+	src s = {data, 0, LEN};
+	uint32_t t0 = micros();
+	for (uint32_t n = 0; n < LEN; ) { uint8_t b[256]; uint32_t k = sdread(b, 256, &s); f.write(b, k); n += k; }
+	SerialFlash.wait();
+	uint32_t told = micros() - t0;
+	static uint8_t buffer[2048];
+	SerialFlashCopy copier(buffer, sizeof(buffer));
+	s.pos = 0;
+	t0 = micros();
+	assert(copier.copy("new", LEN, sdread, &s));
+	SerialFlash.wait();
+	uint32_t tnew = micros() - t0;
+	uint32_t su, fu; copier.stats(su, fu);
+	printf("copy 100000 bytes: read/write loop %u us, SerialFlashCopy %u us (source %u, flash wait %u)\n", told, tnew, su, fu);
+	assert(copier.crc() == crc32(data, LEN));
+	f = SerialFlash.open("new");
+	static uint8_t back[LEN]; f.read(back, LEN); assert(!memcmp(back, data, LEN));
+	assert(!copier.copy("new", LEN, sdread, &s)); // exists
+	// verified copy, with a bad spot in the Flash
+	copier.setVerify(true);
+	s.pos = 0;
+	assert(copier.copy("ver", LEN, sdread, &s));
+	assert(SerialFlash.create("bad", LEN));
+	f = SerialFlash.open("bad");
+	sim_mem()[f.getFlashAddress() + 50000] = 0;
+	s.pos = 0;
+	assert(!copier.copy(f, LEN, sdread, &s));
+	// a source which ends too soon
+	assert(SerialFlash.create("short", LEN));
+	f = SerialFlash.open("short");
+	s.pos = 0; s.len = 5000;
+	assert(!copier.copy(f, LEN, sdread, &s));
+	// too small a buffer fails before creating the file
+	SerialFlashCopy small(buffer, 511);
+	s.pos = 0; s.len = LEN;
+	assert(!small.copy("small", 1000, sdread, &s));
+	assert(!SerialFlash.exists("small"));
+	// a checked file gets its chunk checksums, so damage is found
+	copier.setVerify(false);
+	assert(SerialFlash.createChecked("checked", LEN));
+	f = SerialFlash.open("checked");
+	s.pos = 0;
+	assert(copier.copy(f, LEN, sdread, &s));
+	SerialFlash.wait();
+	f.seek(0); assert(f.read(back, LEN) == LEN && !f.damaged());
+	assert(!memcmp(back, data, LEN));
+	sim_mem()[f.getFlashAddress() + 70000] &= 0x7F;
+	f = SerialFlash.open("checked");
+	f.read(back, LEN); assert(f.damaged());
+	// NAND pages are 2048 bytes, so 2 pages need 4096
+	const uint8_t nid[3] = {0xEF, 0xAA, 0x21}; // W25N01GV
+	const int bad[] = {5};
+	sim_init_nand(nid, 1024, 1, bad, 1);
+	assert(SerialFlash.begin(6));
+	s.pos = 0;
+	assert(!copier.copy("nand", LEN, sdread, &s));
+	assert(!SerialFlash.exists("nand"));
+	static uint8_t nbuf[8192 + 100];
+	SerialFlashCopy ncopier(nbuf, sizeof(nbuf));
+	ncopier.setVerify(true);
+	s.pos = 0;
+	assert(ncopier.copy("nand", LEN, sdread, &s));
+	assert(ncopier.crc() == crc32(data, LEN));
+	f = SerialFlash.open("nand");
+	memset(back, 0, LEN); f.read(back, LEN); assert(!memcmp(back, data, LEN));
+	printf("copy ok\n");
+	return 0;
+}
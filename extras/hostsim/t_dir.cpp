@@ -0,0 +1,26 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	char name[64];
+	for (int i=0; i < 100; i++) {
+		snprintf(name, sizeof(name), "dir%d/file-with-a-long-name-%04d.bin", i%3, i);
+		assert(SerialFlash.create(name, 100 + i));
+	}
+	SerialFlash.remove("dir0/file-with-a-long-name-0003.bin");
+	SerialFlashDir d;
+	uint32_t sz, addr; uint16_t idx; int n=0;
+	while (d.read(name, sizeof(name), sz, addr, idx)) {
+		SerialFlashFile f = SerialFlash.open(name);
+		assert(f && f.getFlashAddress() == addr && f.size() == sz);
+		n++;
+	}
+	assert(n == 99);
+	SerialFlash.opendir();
+	char small[8];
+	assert(SerialFlash.readdir(small, sizeof(small), sz));
+	assert(strcmp(small, "dir0/fi") == 0);
+	printf("dir ok\n");
+}
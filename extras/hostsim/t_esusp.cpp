@@ -0,0 +1,42 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	assert(SerialFlash.createErasable("buf.raw", 4 * 65536));
+	assert(SerialFlash.create("log.txt", 200000));
+	SerialFlashFile a = SerialFlash.open("buf.raw"), lg = SerialFlash.open("log.txt");
+	uint8_t buf[256], rb[256];
+	memset(buf, 0x11, 256);
+	a.write(buf, 256);
+	SerialFlash.wait();
+	a.erase();  // 4 blocks, the first starts now
+	uint32_t maxw = 0; int n = 0;
+	long s0 = sim_suspends();
+	while (!SerialFlash.ready() || n < 50) {
+		for (int i = 0; i < 256; i++) buf[i] = n + i;
+		uint32_t t = micros();
+		lg.write(buf, 256);
+		uint32_t dt = micros() - t;
+		if (dt > maxw) maxw = dt;
+		n++;
+		if (n > 2000) break;
+		sim_advance(2000);
+	}
+	printf("log writes during erase: %d, max %u us, suspends %ld\n", n, maxw, sim_suspends() - s0);
+	assert(maxw < 5000);
+	SerialFlash.wait();
+	a.seek(0); a.read(rb, 256); for (int i = 0; i < 256; i++) assert(rb[i] == 0xFF);
+	lg.seek(0);
+	for (int k = 0; k < n; k++) { lg.read(rb, 256); for (int i = 0; i < 256; i++) assert(rb[i] == (uint8_t)(k + i)); }
+	// writing into the block being erased waits for the erase
+	SerialFlash.eraseBlock(a.getFlashAddress());
+	memset(buf, 0x22, 256);
+	a.seek(0); uint64_t t0 = sim_us; a.write(buf, 256);
+	printf("write in erasing block waited %lu us\n", (unsigned long)(sim_us - t0));
+	SerialFlash.wait();
+	a.seek(0); a.read(rb, 256); assert(memcmp(rb, buf, 256) == 0);
+	printf("esusp ok\n");
+	return 0;
+}
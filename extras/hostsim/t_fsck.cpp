@@ -0,0 +1,60 @@
+// build: -DSERIALFLASH_FORMAT=2
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <stdio.h>
+#define HASH(i) (8 + (i)*4)
+#define INFO(i) (8 + 600*4 + (i)*12)
+static SerialFlashCheck r;
+static void clean(uint32_t files, uint32_t deleted) {
+	assert(SerialFlash.check(r));
+	if (r.files != files || r.deleted != deleted || r.damaged || r.unfinished) {
+		printf("files %u del %u dmg %u unf %u\n", r.files, r.deleted, r.damaged, r.unfinished); assert(0);
+	}
+}
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	uint8_t *m = sim_mem();
+	char name[40];
+	for (int i = 0; i < 500; i++) { sprintf(name, "file%03d.wav", i); assert(SerialFlash.create(name, 1000 + i)); }
+	assert(SerialFlash.remove("file007.wav"));
+	long t0, c0, b0, t1, c1, b1; sim_stats(&t0, &c0, &b0);
+	clean(499, 1);
+	sim_stats(&t1, &c1, &b1);
+	printf("check: %ld transactions %ld commands %ld bytes, free %u\n", t1-t0, c1-c0, b1-b0, r.free);
+	// power lost after writing only the name
+	uint32_t info[3]; memcpy(info, m + INFO(499), 12);
+	uint32_t straddr = 9608 + (info[2] & 0xFFFF)*4 + ((info[2]>>16)&255) + 1;
+	straddr = (straddr + 3) & ~3;
+	memcpy(m + straddr, "orphan_na", 9); // torn, no terminator
+	assert(!SerialFlash.check(r) && r.unfinished == 1 && r.repaired == 0);
+	assert(SerialFlash.check(r, true) && r.repaired == 1);
+	clean(499, 2);
+	assert(SerialFlash.create("after1", 10));
+	assert(SerialFlash.open("after1").size() == 10);
+	clean(500, 2);
+	// power lost before writing the hash
+	assert(SerialFlash.create("nohash", 10));
+	SerialFlash.wait();
+	int idx = 502;
+	memset(m + HASH(idx), 0xFF, 4);
+	assert(!SerialFlash.exists("nohash"));
+	assert(!SerialFlash.check(r) && r.unfinished == 1);
+	assert(SerialFlash.check(r, true));
+	assert(SerialFlash.create("after2", 20));
+	clean(501, 3);
+	// a damaged hash
+	m[HASH(10)+1] &= m[HASH(10)+1] - 1;
+	assert(!SerialFlash.check(r) && r.damaged == 1);
+	assert(SerialFlash.check(r, true) && r.repaired == 1);
+	clean(500, 4);
+	// overlapping files are reported, not repaired
+	m[INFO(20) + 1] &= 0x00;
+	assert(!SerialFlash.check(r, true) && r.damaged >= 1 && r.repaired == 0);
+	// all names still readable
+	SerialFlashFile f = SerialFlash.open("file499.wav");
+	assert(f && f.size() == 1499);
+	printf("fsck ok\n");
+	return 0;
+}
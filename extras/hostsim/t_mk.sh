@@ -0,0 +1,3 @@
+# an image written and read back by the same build, see t_mk.cpp to
+# check one written by an older release
+"$1" w img.bin && "$1" r img.bin
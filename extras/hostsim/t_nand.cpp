@@ -0,0 +1,101 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+// with any argument, a W25N01GV instead of an MT29F2G01ABAGD
+int main(int argc, char **) {
+	bool w25n = argc > 1;
+	const uint8_t id[3] = {0x2C, 0x24, 0x00}; // MT29F2G01ABAGD
+	const uint8_t idw[3] = {0xEF, 0xAA, 0x21}; // W25N01GV
+	const int bad[] = {0, 5, 2047 - 45};
+	const int badw[] = {0, 5, 1000};
+	if (w25n) sim_init_nand(idw, 1024, 1, badw, 3);
+	else sim_init_nand(id, 2048, 2, bad, 3);
+	assert(SerialFlash.begin(6));
+	uint8_t rid[5]; SerialFlash.readID(rid);
+	if (w25n) assert(rid[0] == 0xEF && rid[1] == 0xAA && SerialFlash.capacity(rid) == (1024u - 22) * 131072);
+	else assert(rid[0] == 0x2C && rid[1] == 0x24 && SerialFlash.capacity(rid) == (2048u - 42) * 131072);
+	assert(SerialFlash.blockSize() == 131072);
+	uint32_t c, u, f, b;
+	SerialFlash.nandStats(c, u, f, b); assert(b == 3);
+	char name[32];
+	for (int i = 0; i < 40; i++) {
+		snprintf(name, sizeof(name), "smp/%03d.raw", i);
+		assert(SerialFlash.create(name, 5000 + i * 777, (i % 9 == 0) ? SerialFlash.blockSize() : 0));
+	}
+	// write all files in odd sized chunks
+	static uint8_t buf[300];
+	for (int i = 0; i < 40; i++) {
+		snprintf(name, sizeof(name), "smp/%03d.raw", i);
+		SerialFlashFile ff = SerialFlash.open(name);
+		assert(ff);
+		assert((ff.getFlashAddress() & 2047) == 0);
+		uint32_t n = 0;
+		while (ff.available()) {
+			uint32_t len = 1 + (n * 37) % 299;
+			for (uint32_t k = 0; k < len; k++) buf[k] = (n + k) * 13 + i;
+			n += ff.write(buf, len);
+		}
+		ff.close();
+	}
+	long pr0, cr0, pg0, er0;
+	sim_nand_stats(&pr0, &cr0, &pg0, &er0);
+	for (int i = 0; i < 40; i++) {
+		snprintf(name, sizeof(name), "smp/%03d.raw", i);
+		SerialFlashFile ff = SerialFlash.open(name);
+		assert(ff);
+		static uint8_t all[262144];
+		uint32_t sz = ff.size();
+		assert(ff.read(all, sz) == sz);
+		uint32_t n = 0;
+		while (n < sz) {
+			uint32_t len = 1 + (n * 37) % 299;
+			for (uint32_t k = 0; k < len && n + k < sz; k++) {
+				if (all[n + k] != (uint8_t)((n + k) * 13 + i)) { printf("mismatch file %d at %u\n", i, n+k); return 1; }
+			}
+			n += len;
+		}
+	}
+	long pr1, cr1, pg1, er1;
+	sim_nand_stats(&pr1, &cr1, &pg1, &er1);
+	printf("read back: %ld page reads, %ld cache reads\n", pr1 - pr0, cr1 - cr0);
+	assert(SerialFlash.remove("smp/003.raw"));
+	assert(!SerialFlash.exists("smp/003.raw"));
+	assert(SerialFlash.exists("smp/004.raw"));
+	SerialFlash.opendir();
+	uint32_t sz; int n = 0;
+	while (SerialFlash.readdir(name, sizeof(name), sz)) n++;
+	assert(n == 39);
+	// erasable file: erase and rewrite
+	SerialFlashFile ef = SerialFlash.open("smp/009.raw");
+	ef.erase();
+	while (!SerialFlash.ready()) ;
+	ef.seek(0); memset(buf, 0x5A, 300); ef.write(buf, 300); ef.flush();
+	uint8_t rb[300]; ef.seek(0); ef.read(rb, 300); assert(memcmp(rb, buf, 300) == 0);
+	// ecc counters
+	sim_nand_ecc(64 + 3, 1); sim_nand_ecc(64 + 4, 2);
+	SerialFlash.read(3 * 2048, rb, 10); SerialFlash.read(4 * 2048, rb, 10);
+	SerialFlash.nandStats(c, u, f, b);
+	printf("ecc corrected %u uncorrectable %u failed %u\n", c, u, f);
+	assert(c >= 1 && u >= 1 && f == 0);
+	// restart, bad block scan must give the same mapping
+	uint64_t t0 = sim_us;
+	assert(SerialFlash.begin(6));
+	printf("begin: %lu us\n", (unsigned long)(sim_us - t0));
+	SerialFlashFile g = SerialFlash.open("smp/009.raw");
+	g.read(rb, 300); assert(memcmp(rb, buf, 300) == 0);
+	t0 = sim_us;
+	assert(SerialFlash.create("late.raw", 100));
+	g = SerialFlash.open("late.raw"); assert(g);
+	printf("create: %lu us\n", (unsigned long)(sim_us - t0));
+	// a read during eraseAll() waits for one block, not the whole chip
+	SerialFlash.eraseAll();
+	t0 = sim_us;
+	SerialFlash.read(0, rb, 10);
+	printf("read during eraseAll: %lu us\n", (unsigned long)(sim_us - t0));
+	assert(sim_us - t0 < 10000);
+	while (!SerialFlash.ready()) ;
+	SerialFlash.read(0, rb, 10);
+	for (int i = 0; i < 10; i++) assert(rb[i] == 0xFF);
+	printf("nand ok\n");
+	return 0;
+}
@@ -0,0 +1,2 @@
+# both NAND chips, the Micron with 2 planes and the Winbond with 1
+"$1" && "$1" w25n
@@ -0,0 +1,112 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+// blocks failing after begin(), and power loss during directory rewrites
+static const uint32_t BS = 131072;
+static uint32_t phys(uint32_t addr) { uint32_t b = addr / BS; return b >= 5 ? b + 1 : b; }
+static void fill(uint8_t *buf, uint32_t len, int seed) { for (uint32_t i = 0; i < len; i++) buf[i] = i * 7 + seed; }
+static bool check(const char *name, uint32_t len, int seed) {
+	static uint8_t buf[8192], want[8192];
+	SerialFlashFile f = SerialFlash.open(name);
+	if (!f) return false;
+	f.read(buf, len); fill(want, len, seed);
+	return memcmp(buf, want, len) == 0;
+}
+int main() {
+	const uint8_t id[3] = {0x2C, 0x24, 0x00}; // MT29F2G01ABAGD, 2 planes
+	const int bad[] = {5};
+	sim_init_nand(id, 2048, 2, bad, 1);
+	assert(SerialFlash.begin(6));
+	static uint8_t buf[8192];
+	uint32_t c, u, fl, b;
+	// an erase which fails, even block so plane 0
+	assert(SerialFlash.createErasable("e.bin", BS));
+	SerialFlashFile e = SerialFlash.open("e.bin");
+	if (phys(e.getFlashAddress()) & 1) {
+		assert(SerialFlash.createErasable("e2.bin", BS));
+		e = SerialFlash.open("e2.bin");
+	}
+	assert(!(phys(e.getFlashAddress()) & 1));
+	assert(SerialFlash.create("a.bin", 6000));
+	SerialFlashFile a = SerialFlash.open("a.bin");
+	fill(buf, 6000, 1); a.write(buf, 6000); a.flush();
+	fill(buf, 5000, 2); e.write(buf, 5000); e.flush();
+	SerialFlash.wait();
+	sim_nand_wornout(0, phys(e.getFlashAddress()));
+	e.erase();
+	SerialFlash.wait();
+	SerialFlash.nandStats(c, u, fl, b);
+	printf("erase failed: failed %u bad %u\n", fl, b); fflush(stdout);
+	assert(fl == 1 && b == 2);
+	e.seek(0); e.read(buf, 16);
+	for (int i = 0; i < 16; i++) assert(buf[i] == 0xFF);
+	fill(buf, 5000, 3); e.seek(0); e.write(buf, 5000); e.flush();
+	const char *ename = e.getFlashAddress() == SerialFlash.open("e.bin").getFlashAddress() ? "e.bin" : "e2.bin";
+	assert(check(ename, 5000, 3) && check("a.bin", 6000, 1));
+	// the replacement is kept by the next begin()
+	assert(SerialFlash.begin(6));
+	SerialFlash.nandStats(c, u, fl, b); assert(b == 2);
+	assert(check(ename, 5000, 3) && check("a.bin", 6000, 1));
+	// the replacement fails too (first spare of plane 0), and is replaced again
+	sim_nand_wornout(0, 2008);
+	e = SerialFlash.open(ename);
+	e.erase(); SerialFlash.wait();
+	fill(buf, 5000, 4); e.seek(0); e.write(buf, 5000); e.flush();
+	assert(check(ename, 5000, 4));
+	assert(SerialFlash.begin(6));
+	SerialFlash.nandStats(c, u, fl, b); assert(b == 3);
+	assert(check(ename, 5000, 4) && check("a.bin", 6000, 1));
+	// a program which fails moves the block's pages
+	assert(SerialFlash.create("p.bin", 8192, BS));
+	SerialFlashFile p = SerialFlash.open("p.bin");
+	fill(buf, 4096, 5); p.write(buf, 4096); p.flush();
+	SerialFlash.wait();
+	sim_nand_wornout(0, phys(p.getFlashAddress()));
+	fill(buf, 8192, 5); p.seek(4096); p.write(buf + 4096, 4096); p.flush();
+	SerialFlash.nandStats(c, u, fl, b);
+	printf("program failed: failed %u bad %u\n", fl, b);
+	assert(fl >= 3 && b == 4);
+	assert(check("p.bin", 8192, 5));
+	assert(SerialFlash.begin(6));
+	assert(check("p.bin", 8192, 5) && check(ename, 5000, 4) && check("a.bin", 6000, 1));
+	// power lost at every program or erase of a create
+	int created = 0;
+	for (long k = 0; ; k++) {
+		char name[16];
+		snprintf(name, sizeof(name), "x%03d", created);
+		sim_nand_powercut(k);
+		bool cut = false;
+		try {
+			if (SerialFlash.create(name, 2048)) {
+				SerialFlashFile x = SerialFlash.open(name);
+				fill(buf, 2048, created); x.write(buf, 2048); x.flush();
+				SerialFlash.wait();
+			}
+		} catch (int) {
+			cut = true;
+		}
+		sim_nand_powercut(-1);
+		sim_nand_poweron();
+		assert(SerialFlash.begin(6));
+		assert(check("a.bin", 6000, 1) && check("p.bin", 8192, 5) && check(ename, 5000, 4));
+		for (int i = 0; i < created; i++) {
+			snprintf(name, sizeof(name), "x%03d", i);
+			assert(check(name, 2048, i));
+		}
+		if (!cut) break;
+		// a file whose create was cut may exist, with its data not written
+		snprintf(name, sizeof(name), "x%03d", created);
+		if (SerialFlash.exists(name)) {
+			if (!check(name, 2048, created)) {
+				SerialFlashFile x = SerialFlash.open(name);
+				x.read(buf, 2048);
+				for (int i = 0; i < 2048; i++) assert(buf[i] == 0xFF);
+				fill(buf, 2048, created); x.seek(0); x.write(buf, 2048); x.flush();
+			}
+			created++;
+		}
+	}
+	printf("power loss: %d files created\n", created);
+	printf("nand fail ok\n");
+	return 0;
+}
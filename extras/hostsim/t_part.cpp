@@ -0,0 +1,57 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	SerialFlashPartition parts[] = {
+		{"fw", 1024*1024, SERIALFLASH_RAW},
+		{"files", 8*1024*1024, SERIALFLASH_FILESYSTEM},
+		{"samples", 4*1024*1024, SERIALFLASH_RAW},
+		{"data", 0, SERIALFLASH_FILESYSTEM},
+	};
+	assert(SerialFlash.createPartitions(parts, 4));
+	assert(!SerialFlash.createPartitions(parts, 4)); // not blank
+	SerialFlashFile fw = SerialFlash.openPartition("fw");
+	assert(fw && fw.getFlashAddress() == 65536 && fw.size() == 1024*1024);
+	assert(!SerialFlash.openPartition("files"));
+	assert(!SerialFlash.openPartition("nope"));
+	SerialFlashFile smp = SerialFlash.openPartition("samples");
+	assert(smp.getFlashAddress() == 65536 + 9*1024*1024);
+	// files go to the first filesystem
+	assert(SerialFlash.create("a.txt", 1000));
+	SerialFlashFile a = SerialFlash.open("a.txt");
+	assert(a && a.getFlashAddress() >= 65536 + 1024*1024 && a.getFlashAddress() < 65536 + 9*1024*1024);
+	a.write("hello", 6);
+	assert(!SerialFlash.create("big", 9*1024*1024));
+	// second filesystem
+	assert(SerialFlash.useFilesystem("data"));
+	assert(!SerialFlash.exists("a.txt"));
+	assert(SerialFlash.create("b.txt", 1000));
+	SerialFlashFile b = SerialFlash.open("b.txt");
+	assert(b.getFlashAddress() >= 65536 + 13*1024*1024);
+	char name[64]; uint32_t sz; int n = 0;
+	SerialFlash.opendir();
+	while (SerialFlash.readdir(name, sizeof(name), sz)) { assert(!strcmp(name, "b.txt")); n++; }
+	assert(n == 1);
+	assert(!SerialFlash.useFilesystem("samples"));
+	assert(SerialFlash.useFilesystem(""));
+	assert(SerialFlash.exists("a.txt"));
+	SerialFlashDir d; n = 0; while (d.read(name, sizeof(name), sz)) n++; assert(n == 1);
+	SerialFlashPathEntry pe[10]; SerialFlashPathIndex pi(pe, 10);
+	assert(SerialFlash.create("x/y.txt", 10)); assert(pi.build()); assert(pi.count("x") == 1);
+	char rn[32]; assert(pi.opendir("x") && pi.readdir(rn, 32, sz) && !strcmp(rn, "x/y.txt"));
+	// raw streaming write, read, erase
+	uint8_t buf[1000], rb[1000];
+	for (int i = 0; i < 1000; i++) buf[i] = i * 7;
+	for (int k = 0; k < 100; k++) fw.write(buf, 1000);
+	SerialFlash.wait();
+	fw.seek(0); for (int k = 0; k < 100; k++) { fw.read(rb, 1000); assert(!memcmp(rb, buf, 1000)); }
+	assert(!SerialFlash.remove(fw));
+	fw.erase(); SerialFlash.wait();
+	fw.seek(0); fw.read(rb, 1000); for (int i = 0; i < 1000; i++) assert(rb[i] == 0xFF);
+	assert(SerialFlash.exists("a.txt"));
+	a = SerialFlash.open("a.txt"); char hb[6]; a.read(hb, 6); assert(!strcmp(hb, "hello"));
+	printf("partitions ok\n");
+	return 0;
+}
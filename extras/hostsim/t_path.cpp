@@ -0,0 +1,38 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	char name[64];
+	for (int i=0; i < 200; i++) {
+		const char *lang = (i%4==0) ? "en" : (i%4==1) ? "de" : (i%4==2) ? "fr" : "enx";
+		snprintf(name, sizeof(name), "voices/%s/%04d.raw", lang, i);
+		assert(SerialFlash.create(name, 100));
+	}
+	assert(SerialFlash.create("top.bin", 10));
+	assert(SerialFlash.create("music/a.raw", 10));
+	static SerialFlashPathEntry ent[600];
+	SerialFlashPathIndex idx(ent, 600);
+	assert(idx.build());
+	assert(idx.entries() == 401);
+	assert(idx.count("voices") == 200);
+	assert(idx.count("voices/en/") == 50);
+	assert(idx.count("voices/en") == 50);
+	assert(idx.count("voices/e") == 0);
+	assert(idx.count("music") == 1);
+	long t0,c0,b0,t1,c1,b1; sim_stats(&t0,&c0,&b0);
+	assert(idx.opendir("voices/de"));
+	uint32_t sz; int n=0;
+	while (idx.readdir(name, sizeof(name), sz)) { assert(strncmp(name, "voices/de/", 10)==0 && sz==100); n++; }
+	sim_stats(&t1,&c1,&b1);
+	printf("list 50: %ld transactions\n", t1-t0);
+	assert(n == 50);
+	assert(idx.remove("voices/fr") == 50);
+	assert(idx.count("voices") == 150);
+	assert(!SerialFlash.exists("voices/fr/0002.raw"));
+	assert(SerialFlash.exists("voices/en/0000.raw"));
+	SerialFlashPathIndex small(ent, 10);
+	assert(!small.build());
+	printf("path ok\n");
+}
@@ -0,0 +1,59 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	assert(SerialFlash.createErasable("cfg.bin", 8 * 65536));
+	assert(SerialFlash.create("other.bin", 4096));
+	SerialFlashFile f = SerialFlash.open("cfg.bin"), o = SerialFlash.open("other.bin");
+	uint8_t buf[256], rb[256];
+	memset(buf, 0x11, 256);
+	for (int i = 0; i < 8; i++) { f.seek(i * 65536); f.write(buf, 256); }
+	SerialFlash.wait();
+	assert(f.recycle());
+	// idle loop: ready() should return true quickly, erases progress
+	int polls = 0;
+	while (SerialFlash.poll()) { sim_advance(1000); polls++; assert(polls < 100000); }
+	printf("recycled after %d polls, %lu us\n", polls, (unsigned long)sim_us);
+	uint64_t t0 = sim_us;
+	f.erase();
+	assert(SerialFlash.ready());
+	f.seek(0); f.write(buf, 256);
+	printf("erase+first write took %lu us\n", (unsigned long)(sim_us - t0));
+	assert(sim_us - t0 < 5000);
+	SerialFlash.wait();
+	for (int i = 1; i < 8; i++) { f.seek(i * 65536); f.read(rb, 256); for (int k=0;k<256;k++) assert(rb[k]==0xFF); }
+	// partial: recycle, poll a bit, write to other file meanwhile, then erase
+	assert(f.recycle());
+	assert(SerialFlash.ready()); // starts first block, ready still true
+	assert(SerialFlash.ready());
+	o.write(buf, 256); // suspends background erase
+	assert(SerialFlash.ready());
+	f.erase(); // remaining blocks
+	SerialFlash.wait();
+	for (int i = 0; i < 8; i++) { f.seek(i * 65536); f.read(rb, 256); for (int k=0;k<256;k++) assert(rb[k]==0xFF); }
+	o.seek(0); o.read(rb, 256); assert(memcmp(rb, buf, 256)==0);
+	// writing a recycled file drops it from the pool
+	assert(f.recycle());
+	while (SerialFlash.poll()) sim_advance(1000);
+	f.seek(0); f.write(buf, 256);
+	assert(SerialFlash.recycled(f.getFlashAddress(), 8*65536) == 0);
+	f.erase(); SerialFlash.wait();
+	f.seek(0); f.read(rb, 256); for (int k=0;k<256;k++) assert(rb[k]==0xFF);
+	// creating a file does not wait for a background erase
+	assert(f.recycle());
+	assert(SerialFlash.ready());
+	uint64_t t1 = sim_us;
+	assert(SerialFlash.create("new.bin", 256));
+	printf("create during recycle took %lu us\n", (unsigned long)(sim_us - t1));
+	assert(sim_us - t1 < 5000);
+	// unaligned
+	assert(!SerialFlash.recycle(o.getFlashAddress(), 4096));
+	// readID() asks the chip, even after begin()
+	sim_init(8*1024*1024, (const uint8_t *)"\xEF\x40\x17\0\0");
+	uint8_t id[5]; SerialFlash.readID(id);
+	assert(id[0] == 0xEF && id[2] == 0x17);
+	printf("recycle ok\n");
+	return 0;
+}
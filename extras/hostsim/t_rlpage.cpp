@@ -0,0 +1,33 @@
+// build: -DSERIALFLASH_FORMAT=2
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <stdio.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	SerialFlash.setReadLatency(2000);
+	assert(SerialFlash.create("f", 4096));
+	SerialFlashFile f = SerialFlash.open("f");
+	uint8_t data[300], buf[300];
+	for (int i=0;i<300;i++) data[i]=i*3;
+	f.write(data, 300);
+	// read back the page still programming
+	SerialFlash.read(f.getFlashAddress() + 256, buf, 44);
+	assert(!memcmp(buf, data + 256, 44));
+	// reads elsewhere still suspend
+	f.write(data, 256);
+	long s0 = sim_suspends();
+	SerialFlash.read(f.getFlashAddress(), buf, 16);
+	assert(sim_suspends() == s0 + 1 && !memcmp(buf, data, 16));
+	// checked files read back each chunk as it completes
+	assert(SerialFlash.createChecked("c", 8192));
+	SerialFlashFile c = SerialFlash.open("c");
+	static uint8_t big[8192];
+	for (int i=0;i<8192;i++) big[i]=i^(i>>8);
+	c.write(big, 8192);
+	c = SerialFlash.open("c");
+	static uint8_t back[8192];
+	assert(c.read(back, 8192) == 8192 && !c.damaged());
+	printf("read latency page ok\n");
+}
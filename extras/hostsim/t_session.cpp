@@ -0,0 +1,44 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	char name[16];
+	for (int i=0; i < 20; i++) {
+		snprintf(name, sizeof(name), "f%02d", i);
+		assert(SerialFlash.create(name, 100));
+	}
+	uint8_t buf[16];
+	long t0, c0, b0, t1, c1, b1, t2, c2, b2;
+	// 100 small reads, each its own transaction
+	sim_stats(&t0, &c0, &b0);
+	for (int i=0; i < 100; i++) SerialFlash.read(i * 16, buf, 16);
+	sim_stats(&t1, &c1, &b1);
+	// and in one session
+	{
+		SerialFlashSession session;
+		for (int i=0; i < 100; i++) SerialFlash.read(i * 16, buf, 16);
+	}
+	sim_stats(&t2, &c2, &b2);
+	printf("100 reads: %ld transactions, %ld in a session\n", t1 - t0, t2 - t1);
+	// a session begins with the program clock, and changes once to
+	// the read clock, which may differ (see setClock())
+	assert(t1 - t0 == 100 && t2 - t1 <= 2);
+	assert(c2 - c1 == c1 - c0 && b2 - b1 == b1 - b0);
+	// open() uses one session for its whole lookup
+	sim_stats(&t0, &c0, &b0);
+	SerialFlashFile f = SerialFlash.open("f13");
+	sim_stats(&t1, &c1, &b1);
+	printf("open: %ld transactions, %ld commands\n", t1 - t0, c1 - c0);
+	assert(f && t1 - t0 <= 2);
+	// sessions nest, and other operations work inside them
+	SerialFlash.beginSession();
+	SerialFlash.beginSession();
+	assert(SerialFlash.open("f07"));
+	SerialFlash.endSession();
+	assert(SerialFlash.exists("f19"));
+	SerialFlash.endSession();
+	printf("session ok\n");
+	return 0;
+}
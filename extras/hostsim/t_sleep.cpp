@@ -0,0 +1,47 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+// with any argument, a W25M512JV with two dies
+int main(int argc, char **) {
+	bool stacked = argc > 1;
+	if (stacked) { const uint8_t id[3] = {0xEF, 0x71, 0x19}; sim_init(32*1024*1024, id); sim_init_die2(32*1024*1024, id); }
+	else sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	assert(SerialFlash.create("a.bin", 65536));
+	SerialFlashFile f = SerialFlash.open("a.bin");
+	uint8_t buf[256], rb[256];
+	memset(buf, 0x5A, 256);
+	// manual sleep leaves no open transaction and wakes lazily
+	SerialFlash.sleep();
+	assert(sim_sleeping(0));
+	f.read(rb, 256);
+	assert(!sim_sleeping(0));
+	SerialFlash.setAutoSleep(100);
+	f.seek(0); f.write(buf, 256);
+	assert(!SerialFlash.ready() || true);
+	while (!SerialFlash.ready()) sim_advance(100);
+	assert(!sim_sleeping(0));
+	sim_advance(50000); SerialFlash.ready(); assert(!sim_sleeping(0));
+	sim_advance(60000); SerialFlash.ready(); assert(sim_sleeping(0));
+	if (stacked) assert(sim_sleeping(1));
+	sim_advance(1000000);
+	uint64_t t0 = sim_us;
+	f.seek(0); f.read(rb, 256); assert(memcmp(rb, buf, 256) == 0);
+	printf("read after sleep %lu us\n", (unsigned long)(sim_us - t0));
+	uint32_t ms, n, us;
+	SerialFlash.sleepStats(ms, n, us);
+	printf("asleep %u ms, %u wakeups, %u us\n", ms, n, us);
+	assert(n == 2 && ms >= 1000 && us >= 60);
+	// erase keeps it awake
+	assert(SerialFlash.createErasable("e.bin", 65536));
+	SerialFlashFile e = SerialFlash.open("e.bin");
+	e.erase();
+	while (!SerialFlash.ready()) sim_advance(20000);
+	assert(!sim_sleeping(0));
+	SerialFlash.setAutoSleep(0);
+	sim_advance(1000000); SerialFlash.ready(); assert(!sim_sleeping(0));
+	SerialFlash.sleep(); SerialFlash.wakeup(); assert(!sim_sleeping(0));
+	SerialFlash.readID(rb);
+	printf("sleep ok\n");
+	return 0;
+}
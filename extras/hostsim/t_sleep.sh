@@ -0,0 +1,2 @@
+# one chip, and two stacked dies
+"$1" && "$1" stacked
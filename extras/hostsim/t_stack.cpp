@@ -0,0 +1,94 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+static void nor() {
+	const uint8_t id[5] = {0xEF, 0x71, 0x19, 0, 0}; // W25M512JV
+	sim_init(32u << 20, id);
+	sim_init_die2(32u << 20, id);
+	assert(SerialFlash.begin(6));
+	uint8_t rid[5]; SerialFlash.readID(rid);
+	assert(SerialFlash.capacity(rid) == 64u << 20);
+	assert(SerialFlash.dieSize() == 32u << 20);
+	// fill most of die 0, the next file must start on die 1
+	assert(SerialFlash.create("big0.raw", 30u << 20));
+	assert(SerialFlash.create("rec.raw", 4u << 20, SerialFlash.blockSize()));
+	SerialFlashFile big = SerialFlash.open("big0.raw");
+	SerialFlashFile rec = SerialFlash.open("rec.raw");
+	assert(rec.getFlashAddress() == 32u << 20);
+	// read die 0 while die 1 programs and erases: no suspends, no waits
+	uint8_t buf[256], rb[256];
+	for (int i = 0; i < 256; i++) buf[i] = i;
+	long s0 = sim_die_suspends(0), s1 = sim_die_suspends(1);
+	uint32_t maxlat = 0;
+	for (int i = 0; i < 200; i++) {
+		rec.write(buf, 256);
+		uint32_t t = micros();
+		big.read(rb, 256);
+		uint32_t dt = micros() - t;
+		if (dt > maxlat) maxlat = dt;
+	}
+	rec.seek(0); rec.read(rb, 256); assert(memcmp(rb, buf, 256) == 0);
+	rec.erase();
+	for (int i = 0; i < 20; i++) {
+		uint32_t t = micros();
+		big.read(rb, 256);
+		uint32_t dt = micros() - t;
+		if (dt > maxlat) maxlat = dt;
+	}
+	printf("nor stacked: max read %u us, suspends %ld/%ld\n", maxlat,
+		sim_die_suspends(0) - s0, sim_die_suspends(1) - s1);
+	assert(sim_die_suspends(0) == s0 && sim_die_suspends(1) == s1);
+	SerialFlash.wait();
+	rec.seek(0); rec.read(rb, 256); for (int i = 0; i < 256; i++) assert(rb[i] == 0xFF);
+	// a read crossing dies
+	SerialFlash.write((32u << 20) - 100, buf, 200);
+	SerialFlash.read((32u << 20) - 100, rb, 200);
+	assert(memcmp(rb, buf, 200) == 0);
+	// both dies erase together
+	uint64_t t0 = sim_us;
+	SerialFlash.eraseAll();
+	while (!SerialFlash.ready()) ;
+	printf("eraseAll: %lu ms\n", (unsigned long)((sim_us - t0) / 1000));
+	SerialFlash.read((32u << 20) - 100, rb, 200);
+	for (int i = 0; i < 200; i++) assert(rb[i] == 0xFF);
+}
+static void nand(bool micron) {
+	const uint8_t idw[3] = {0xEF, 0xAB, 0x21}; // W25M02GV
+	const uint8_t idm[3] = {0x2C, 0x36, 0x00}; // MT29F4G01ADAGD
+	int blocks = micron ? 2048 : 1024;
+	const int bad[] = {3, blocks + 0, blocks + 9};
+	sim_init_nand(micron ? idm : idw, blocks, micron ? 2 : 1, bad, 3);
+	assert(SerialFlash.begin(6));
+	uint8_t rid[5]; SerialFlash.readID(rid);
+	uint32_t die = micron ? (2048u - 42) * 131072 : (1024u - 22) * 131072;
+	assert(SerialFlash.capacity(rid) == 2 * die);
+	assert(SerialFlash.dieSize() == die);
+	uint32_t c, u, f, b;
+	SerialFlash.nandStats(c, u, f, b); assert(b == 3);
+	assert(SerialFlash.create("a.raw", die - 300000));
+	assert(SerialFlash.create("b.raw", 500000));
+	SerialFlashFile fa = SerialFlash.open("a.raw"), fb = SerialFlash.open("b.raw");
+	assert(fb.getFlashAddress() == die);
+	static uint8_t buf[4096], rb[4096];
+	for (int i = 0; i < 4096; i++) buf[i] = i * 3 + 1;
+	for (int i = 0; i < 100; i++) { fa.write(buf, 1000); fb.write(buf + 7, 1000); }
+	fa.close(); fb.close();
+	fa.seek(0); fb.seek(0);
+	for (int i = 0; i < 100; i++) {
+		fa.read(rb, 1000); assert(memcmp(rb, buf, 1000) == 0);
+		fb.read(rb, 1000); assert(memcmp(rb, buf + 7, 1000) == 0);
+	}
+	uint64_t t0 = sim_us;
+	SerialFlash.eraseAll();
+	while (!SerialFlash.ready()) ;
+	printf("nand eraseAll: %lu ms\n", (unsigned long)((sim_us - t0) / 1000));
+	SerialFlash.read(die - 1000, rb, 3000); for (int i = 0; i < 3000; i++) assert(rb[i] == 0xFF);
+	// write and read across the die boundary
+	SerialFlash.write(die - 1000, buf, 3000); SerialFlash.flush();
+	SerialFlash.read(die - 1000, rb, 3000); for (int i = 0; i < 3000; i++) if (rb[i] != buf[i]) { fprintf(stderr, "diff at %d: %02x %02x\n", i, rb[i], buf[i]); break; } assert(memcmp(rb, buf, 3000) == 0);
+}
+int main(int argc, char **argv) {
+	if (argc > 1) nand(argv[1][0] == 'm'); else nor();
+	printf("stack ok\n");
+	return 0;
+}
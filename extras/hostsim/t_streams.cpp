@@ -0,0 +1,46 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <algorithm>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	const int V = 8; const uint32_t L = 100000 + 37;
+	static uint8_t bufs[V][4096];
+	SerialFlashFile f[V];
+	for (int v = 0; v < V; v++) {
+		char n[16]; sprintf(n, "voice%d.raw", v);
+		assert(SerialFlash.create(n, L));
+		f[v] = SerialFlash.open(n);
+		for (uint32_t i = 0; i < L; i += 256) { uint8_t b[256]; for (int k = 0; k < 256; k++) b[k] = (i + k) * (v + 1) + ((i + k) >> 8); f[v].write(b, std::min<uint32_t>(256, L - i)); }
+		f[v].seek(v * 1000);
+	}
+	SerialFlash.wait();
+	SerialFlashStreams st;
+	int id[V];
+	for (int v = 0; v < V; v++) { id[v] = st.open(f[v], bufs[v], sizeof(bufs[v])); assert(id[v] == v); }
+	uint32_t pos[V]; for (int v = 0; v < V; v++) pos[v] = v * 1000;
+	long t0, c0, b0, t1, c1, b1; sim_stats(&t0, &c0, &b0);
+	int blocks = 0;
+	while (1) {
+		st.update();
+		bool any = false;
+		for (int v = 0; v < V; v++) {
+			uint8_t b[256];
+			uint32_t n = st.read(id[v], b, 256);
+			for (uint32_t k = 0; k < n; k++) { uint32_t i = pos[v] + k; assert(b[k] == (uint8_t)(i * (v + 1) + (i >> 8))); }
+			pos[v] += n;
+			if (!st.eof(id[v])) any = true;
+		}
+		blocks++;
+		if (!any) break;
+	}
+	sim_stats(&t1, &c1, &b1);
+	for (int v = 0; v < V; v++) assert(pos[v] == L);
+	uint32_t u, lo; st.stats(0, u, lo);
+	printf("streams: %d blocks, %ld transactions, %ld commands (direct would be %d), underruns %u lowest %u\n", blocks, t1 - t0, c1 - c0, blocks * V, u, lo);
+	assert(u == 0);
+	st.close(0); assert(st.eof(0));
+	printf("streams ok\n");
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <thread>
+#include <mutex>
+static std::recursive_mutex mtx;
+static void lk() { mtx.lock(); }
+static void ul() { mtx.unlock(); }
+static thread_local char threadid;
+static void *tid() { return &threadid; }
+static volatile bool done = false;
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	SerialFlash.setLock(lk, ul, tid);
+	assert(SerialFlash.create("big.bin", 256*1024));
+	assert(SerialFlash.createErasable("erase.bin", 256*1024));
+	assert(SerialFlash.create("small.bin", 4096));
+	for (int i=0;i<20;i++) { char n[20]; snprintf(n,20,"x%d",i); assert(SerialFlash.create(n, 10)); }
+	uint8_t pat[4096]; for (int i=0;i<4096;i++) pat[i]=i*13+1;
+	SerialFlashFile s = SerialFlash.open("small.bin"); s.write(pat, 4096);
+	while (!SerialFlash.ready());
+	// time is shared, so a read's time includes the other threads'
+	// delays, up to 2 ms for the lister
+	std::atomic<uint64_t> maxlat(0); std::atomic<long> nreads(0);
+	auto readfunc = [&]{
+		uint8_t b[256];
+		while (!done) {
+			SerialFlashFile f = SerialFlash.open("small.bin");
+			uint32_t off = (nreads * 256) % 4096;
+			f.seek(off);
+			uint64_t t0 = sim_us;
+			f.read(b, 256);
+			uint64_t t = sim_us - t0; if (t > maxlat) maxlat = t;
+			assert(memcmp(b, pat + off, 256) == 0);
+			nreads++;
+			delayMicroseconds(300);
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	};
+	std::thread reader(readfunc), reader2(readfunc);
+	std::thread lister([&]{
+		while (!done) {
+			SerialFlashDir d; char n[32]; uint32_t sz; int c=0;
+			while (d.read(n, 32, sz)) c++;
+			assert(c == 23);
+			delayMicroseconds(2000);
+			std::this_thread::sleep_for(std::chrono::microseconds(500));
+		}
+	});
+	std::thread writer([&]{
+		SerialFlashFile f = SerialFlash.open("big.bin");
+		uint8_t b[4096];
+		for (int k=0; k<64; k++) { for (int i=0;i<4096;i++) b[i]=k+i; f.write(b, 4096); }
+		SerialFlashFile e = SerialFlash.open("erase.bin");
+		e.erase();
+	});
+	writer.join();
+	while (!SerialFlash.ready()) ;
+	done = true;
+	reader.join(); reader2.join(); lister.join();
+	SerialFlashFile f = SerialFlash.open("big.bin");
+	uint8_t b[4096];
+	for (int k=0; k<64; k++) { f.read(b, 4096); for (int i=0;i<4096;i++) assert(b[i]==(uint8_t)(k+i)); }
+	printf("threads: %ld reads, longest read %llu us, %ld suspends\n", (long)nreads, (unsigned long long)maxlat, sim_suspends());
+	// a read waits for a page program (700 us) and the other threads,
+	// usually under 5 ms, but never for a block erase (50 ms).  The
+	// host may stop a reader while the others advance the time.
+	assert(maxlat < 25000);
+	// a thread waiting for the chip doesn't hold the lock, even when
+	// another thread held it as the wait began
+	std::atomic<int> step(0);
+	SerialFlash.eraseAll();
+	std::thread holder([&]{
+		SerialFlash.lock(); step = 1;
+		while (step < 2) std::this_thread::yield();
+		SerialFlash.unlock();
+	});
+	std::thread eraser([&]{
+		while (step < 1) std::this_thread::yield();
+		SerialFlash.eraseBlock(0);
+	});
+	while (step < 1) std::this_thread::yield();
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	step = 2;
+	holder.join();
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	bool free = false; // it takes the lock only to poll the status
+	for (int i=0; i < 100000 && !free; i++) {
+		free = mtx.try_lock();
+		if (!free) std::this_thread::yield(); // let a poll finish
+	}
+	assert(free);
+	assert(!SerialFlash.ready());
+	mtx.unlock();
+	eraser.join();
+	printf("threads ok\n");
+}
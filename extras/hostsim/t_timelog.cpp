@@ -0,0 +1,56 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <vector>
+static std::vector<uint32_t> times;
+struct rec { uint32_t time; uint16_t v[6]; };  // 16 bytes
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	assert(SerialFlash.create("tele.log", 15*1024*1024));
+	SerialFlashFile f = SerialFlash.open("tele.log");
+	SerialFlashTimeLog log;
+	assert(log.begin(f, sizeof(rec)));
+	assert(log.records() == 0);
+	assert(!log.seek(5));
+	// fill with 500000 records, times with gaps and duplicates
+	uint32_t N = 100000, t = 1000;
+	for (uint32_t i = 0; i < N; i++) {
+		times.push_back(t); rec r; r.time = t; r.v[0] = i; r.v[1] = i >> 16;
+		assert(log.append(&r));
+		if (i % 3) t += (i % 7);
+	}
+	rec bad = {}; assert(!log.append(&bad));
+	SerialFlash.wait();
+	SerialFlashTimeLog log2;
+	long c0,t0,b0,c1,t1,b1;
+	sim_stats(&t0,&c0,&b0);
+	assert(log2.begin(f, sizeof(rec)));
+	sim_stats(&t1,&c1,&b1);
+	printf("begin: %u records, %ld commands\n", log2.records(), c1-c0);
+	assert(log2.records() == N);
+	srand(3);
+	long maxc = 0;
+	for (int k = 0; k < 3000; k++) {
+		uint32_t q = 900 + rand() % (t + 200 - 900);
+		sim_stats(&t0,&c0,&b0);
+		bool ok = log2.seek(q);
+		sim_stats(&t1,&c1,&b1);
+		if (c1 - c0 > maxc) maxc = c1 - c0;
+		rec r;
+		if (!ok) { assert(q > times.back()); continue; }
+		assert(log2.read(&r));
+		assert(r.time >= q);
+		uint32_t idx = r.v[0] | (r.v[1] << 16);
+		if (idx > 0) assert(times[idx - 1] < q);
+	}
+	printf("seek: max %ld commands\n", maxc);
+	// continue appending after reopen, within the partial page
+	rec r; r.time = t + 5; assert(log2.append(&r));
+	rec old; old.time = 10; assert(!log2.append(&old));
+	assert(log2.seek(t + 5)); rec rr; assert(log2.read(&rr) && rr.time == t + 5); assert(!log2.read(&rr));
+	// too-large record
+	SerialFlashTimeLog l3; assert(!l3.begin(f, 300)); assert(!l3.begin(f, 3));
+	printf("timelog ok\n");
+	return 0;
+}
@@ -0,0 +1,40 @@
+// build: -DSERIALFLASH_TRACE=256
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <stdio.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	assert(SerialFlash.createErasable("e", 65536));
+	assert(SerialFlash.create("d", 1000));
+	SerialFlashFile e = SerialFlash.open("e"), d = SerialFlash.open("d");
+	SerialFlash.wait();
+	SerialFlash.clearTrace();
+	char buf[16];
+	SerialFlash.eraseBlock(e.getFlashAddress());
+	d.read(buf, 16);
+	d.seek(0);
+	d.write("0123456789", 10);
+	SerialFlash.wait();
+	SerialFlash.sleep();
+	d.seek(0);
+	d.read(buf, 10);
+	SerialFlashTraceEvent ev[64];
+	uint32_t n = SerialFlash.readTrace(ev, 64);
+	const char *names[] = {"", "read", "program", "erase", "suspend", "resume", "wait", "waited", "sleep", "wakeup"};
+	for (uint32_t i=0; i < n; i++) fprintf(stderr, "%s %02X %08X %u busy %d\n", names[ev[i].event >> 4], ev[i].cmd, ev[i].addr, ev[i].len, ev[i].event & 15);
+	int want[] = {3, 4, 1, 5, 2, 6, 7, 8, 9, 1};
+	uint32_t j = 0;
+	for (uint32_t i=0; i < n && j < 10; i++) if ((ev[i].event >> 4) == want[j]) j++;
+	assert(j == 10);
+	assert(ev[0].cmd == 0xD8 && ev[0].addr == e.getFlashAddress() && (ev[0].event & 15) == 0);
+	assert(SerialFlash.readTrace(ev, 2) == 2);
+	SerialFlash.dumpTrace(Serial);
+	// ring buffer keeps the newest
+	for (int i=0; i < 300; i++) d.read(buf, 1);
+	assert(SerialFlash.readTrace(ev, 64) == 64);
+	SerialFlash.clearTrace();
+	assert(SerialFlash.readTrace(ev, 64) == 0);
+	fprintf(stderr, "trace ok\n");
+}
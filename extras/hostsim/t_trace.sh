@@ -0,0 +1,2 @@
+# the trace printed by t_trace, decoded
+"$1" > trace.txt && python3 "$2/extras/trace-decode.py" trace.txt
@@ -0,0 +1,50 @@
+// build: -O2
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <time.h>
+// built by run.sh with the chip detected, and by t_traits.sh with
+// SERIALFLASH_CHIP, which must send exactly the same SPI commands
+static uint64_t nsec() {
+	struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+int main() {
+	sim_init(16*1024*1024, NULL); // W25Q128FV
+	assert(SerialFlash.begin(6));
+	assert(SerialFlash.createErasable("data", 65536));
+	SerialFlashFile f = SerialFlash.open("data");
+	uint32_t addr = f.getFlashAddress();
+	static uint8_t buf[65536];
+	for (int i=0; i < 65536; i++) buf[i] = i * 11;
+	f.write(buf, 65536);
+	f.erase();
+	f.seek(0);
+	f.write(buf, 4096);
+	SerialFlash.wait();
+	long t0, c0, b0, t1, c1, b1;
+	sim_stats(&t0, &c0, &b0);
+	uint64_t start = nsec();
+	for (int i=0; i < 100000; i++) {
+		SerialFlash.read(addr + (i * 16) % 4096, buf, 16);
+	}
+	uint64_t ns = nsec() - start;
+	sim_stats(&t1, &c1, &b1);
+	uint32_t last = (99999 * 16) % 4096;
+	for (int i=0; i < 16; i++) assert(buf[i] == (uint8_t)((last + i) * 11));
+	printf("spi: %ld transactions, %ld commands, %ld bytes\n", t1, c1, b1);
+	printf("# %s: %.0f ns per 16 byte read, with the simulator\n",
+#if defined(SERIALFLASH_CHIP)
+		"SERIALFLASH_CHIP",
+#else
+		"detected",
+#endif
+		ns / 100000.0);
+#if defined(SERIALFLASH_CHIP)
+	// begin() refuses a chip other than the one built for
+	sim_init(32*1024*1024, (const uint8_t *)"\xEF\x40\x19\0\0"); // W25Q256FV
+	assert(!SerialFlash.begin(6));
+#endif
+	printf("traits ok\n");
+	return 0;
+}
@@ -0,0 +1,12 @@
+# t_traits built with SERIALFLASH_CHIP must send the same SPI commands
+# as when built to detect the chip.  Also prints the code size of each.
+src=$(dirname "$0")
+chip=-DSERIALFLASH_CHIP=SerialFlash_W25Q128FV
+g++ -std=gnu++11 -Wall -Wextra -O2 $SIMFLAGS $chip -I"$2" -I"$src" -o t_traits_chip "$src/t_traits.cpp" "$src/sim.cpp" "$2"/*.cpp || exit 1
+"$1" > traits.txt && ./t_traits_chip > traits_chip.txt || exit 1
+cat traits.txt traits_chip.txt
+[ "$(grep ^spi traits.txt)" = "$(grep ^spi traits_chip.txt)" ] || exit 1
+for fl in "" $chip; do
+	g++ -std=gnu++11 -Os $fl -I"$2" -I"$src" -c -o traits.o "$2/SerialFlashChip.cpp" || exit 1
+	echo "# SerialFlashChip.o ${fl:-detected}: $(size traits.o | awk 'NR==2 {print $1}') bytes of code"
+done
@@ -0,0 +1,56 @@
+#include "SerialFlash.h"
+#include "sim.h"
+#include <assert.h>
+#include <stdio.h>
+int main() {
+	sim_init(16*1024*1024, NULL);
+	assert(SerialFlash.begin(6));
+	SerialFlashPartition parts[] = {
+		{"files", 8*1024*1024, SERIALFLASH_FILESYSTEM},
+		{"wear", 128*1024, SERIALFLASH_RAW},
+	};
+	assert(SerialFlash.createPartitions(parts, 2));
+	SerialFlashFile w = SerialFlash.openPartition("wear");
+	assert(!SerialFlash.beginWear(w.getFlashAddress(), 65536)); // too small
+	assert(SerialFlash.beginWear(w.getFlashAddress(), w.size()));
+	assert(SerialFlash.createErasable("hot", 2*65536));
+	assert(SerialFlash.createErasable("cold", 65536));
+	SerialFlashFile hot = SerialFlash.open("hot");
+	uint32_t hb = hot.getFlashAddress();
+	long t0, c0, b0, t1, c1, b1; sim_stats(&t0, &c0, &b0);
+	for (int i = 0; i < 10; i++) { hot.erase(); SerialFlash.wait(); }
+	sim_stats(&t1, &c1, &b1);
+	assert(SerialFlash.eraseCount(hb) == 10 && SerialFlash.eraseCount(hb + 65536) == 10);
+	SerialFlashFile cold = SerialFlash.open("cold");
+	cold.erase(); SerialFlash.wait();
+	assert(SerialFlash.eraseCount(cold.getFlashAddress()) == 1);
+	// persists across begin, except the unsaved batch
+	SerialFlash.flushWear();
+	SerialFlash.wait(); assert(SerialFlash.begin(6));
+	assert(SerialFlash.beginWear(w.getFlashAddress(), w.size()));
+	assert(SerialFlash.eraseCount(hb) == 10);
+	// enough erases to fill the log and compact several times
+	for (int i = 0; i < 1500; i++) { SerialFlash.eraseBlock(hb); SerialFlash.flushWear(); }
+	SerialFlash.wait();
+	uint32_t ha, hc, ca, cc, rem;
+	SerialFlash.wearStats(ha, hc, ca, cc, rem);
+	printf("hot %08X %u cold %08X %u remaining %u\n", ha, hc, ca, cc, rem);
+	assert(ha == hb && hc == 1510 && cc == 0 && rem == 100000 - 1510);
+	SerialFlash.flushWear();
+	SerialFlash.wait(); assert(SerialFlash.begin(6));
+	assert(SerialFlash.beginWear(w.getFlashAddress(), w.size()));
+	assert(SerialFlash.eraseCount(hb) == 1510);
+	assert(SerialFlash.eraseCount(hb + 65536) == 10);
+	// a full erase counts every block once, and keeps the counts
+	SerialFlash.eraseAll();
+	SerialFlash.wait();
+	SerialFlash.flushWear();
+	assert(SerialFlash.eraseCount(hb) == 1511);
+	assert(SerialFlash.eraseCount(0) == 1);
+	assert(SerialFlash.eraseCount(w.getFlashAddress() + 65536) > 0);
+	SerialFlash.wait(); assert(SerialFlash.begin(6));
+	assert(SerialFlash.beginWear(w.getFlashAddress(), w.size()));
+	assert(SerialFlash.eraseCount(hb) == 1511);
+	printf("wear ok\n");
+	return 0;
+}
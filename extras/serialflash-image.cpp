@@ -0,0 +1,148 @@
+// Lists, extracts and adds files in a SerialFlash image on Linux, such
+// as a copy of a chip read from a returned unit, or a new image to be
+// programmed onto chips.  The library's own directory code is used,
+// with SerialFlashHost.cpp in place of a chip.  Build it with:
+//
+//   g++ -O2 -DSERIALFLASH_HOST -I.. -o serialflash-image serialflash-image.cpp ../*.cpp
+//
+// Add -DSERIALFLASH_FORMAT=2 to give new images version 2 directories.
+//
+// Usage:
+//
+//   serialflash-image new image.bin 16777216    create a blank image
+//   serialflash-image list image.bin
+//   serialflash-image get image.bin name [out]  copy a file out (stdout)
+//   serialflash-image put image.bin file [name] copy a file in
+//   serialflash-image remove image.bin name
+//   serialflash-image check image.bin [repair]
+//   serialflash-image dump image.bin addr len   raw bytes to stdout
+//
+// Images use 64K erase blocks, unless SERIALFLASH_BLOCKSIZE is set in
+// the environment, for example to 262144 for large Spansion chips.
+
+#include <SerialFlash.h>
+#include <stdio.h>
+
+static int usage()
+{
+	fprintf(stderr, "usage: serialflash-image new|list|get|put|remove|check|dump image.bin ...\n");
+	return 2;
+}
+
+static int list()
+{
+	char filename[256];
+	uint32_t filesize;
+	SerialFlash.opendir();
+	while (SerialFlash.readdir(filename, sizeof(filename), filesize)) {
+		printf("%10u  %s\n", (unsigned int)filesize, filename);
+	}
+	return 0;
+}
+
+static int get(const char *name, const char *outname)
+{
+	SerialFlashFile file = SerialFlash.open(name);
+	if (!file) {
+		fprintf(stderr, "%s: not found\n", name);
+		return 1;
+	}
+	FILE *out = outname ? fopen(outname, "wb") : stdout;
+	if (!out) {
+		perror(outname);
+		return 1;
+	}
+	static uint8_t buf[1048576];
+	uint32_t n;
+	while ((n = file.read(buf, sizeof(buf))) > 0) {
+		fwrite(buf, 1, n, out);
+	}
+	if (outname) fclose(out);
+	return 0;
+}
+
+static int put(const char *inname, const char *name)
+{
+	FILE *in = fopen(inname, "rb");
+	if (!in) {
+		perror(inname);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	uint32_t length = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	if (!SerialFlash.create(name, length)) {
+		fprintf(stderr, "%s: unable to create, already exists or no space\n", name);
+		fclose(in);
+		return 1;
+	}
+	SerialFlashFile file = SerialFlash.open(name);
+	static uint8_t buf[1048576];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		file.write(buf, n);
+	}
+	fclose(in);
+	return 0;
+}
+
+static int check(bool repair)
+{
+	SerialFlashCheck result;
+	bool ok = SerialFlash.check(result, repair);
+	printf("files %u, deleted %u, damaged %u, unfinished %u, repaired %u, free %u\n",
+		(unsigned int)result.files, (unsigned int)result.deleted,
+		(unsigned int)result.damaged, (unsigned int)result.unfinished,
+		(unsigned int)result.repaired, (unsigned int)result.free);
+	return ok ? 0 : 1;
+}
+
+static int dump(uint32_t addr, uint32_t len)
+{
+	// straight from the memory mapped image, without copying
+	const uint8_t *p = SerialFlash.map(addr, len);
+	if (!p) {
+		fprintf(stderr, "beyond the end of the image\n");
+		return 1;
+	}
+	fwrite(p, 1, len, stdout);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) return usage();
+	const char *cmd = argv[1];
+	const char *blocksize = getenv("SERIALFLASH_BLOCKSIZE");
+	uint32_t size = 0;
+	if (strcmp(cmd, "new") == 0) {
+		if (argc < 4) return usage();
+		size = strtoul(argv[3], NULL, 0);
+		if (size == 0) return usage();
+	}
+	if (!SerialFlash.begin(argv[2], size, blocksize ? strtoul(blocksize, NULL, 0) : 65536)) {
+		fprintf(stderr, "%s: unable to use image\n", argv[2]);
+		return 1;
+	}
+	int r = 0;
+	if (strcmp(cmd, "new") == 0) {
+	} else if (strcmp(cmd, "list") == 0) {
+		r = list();
+	} else if (strcmp(cmd, "get") == 0 && argc >= 4) {
+		r = get(argv[3], argc >= 5 ? argv[4] : NULL);
+	} else if (strcmp(cmd, "put") == 0 && argc >= 4) {
+		const char *name = strrchr(argv[3], '/');  // without the path
+		name = name ? name + 1 : argv[3];
+		r = put(argv[3], argc >= 5 ? argv[4] : name);
+	} else if (strcmp(cmd, "remove") == 0 && argc >= 4) {
+		r = SerialFlash.remove(argv[3]) ? 0 : 1;
+	} else if (strcmp(cmd, "check") == 0) {
+		r = check(argc >= 4 && strcmp(argv[3], "repair") == 0);
+	} else if (strcmp(cmd, "dump") == 0 && argc >= 5) {
+		r = dump(strtoul(argv[3], NULL, 0), strtoul(argv[4], NULL, 0));
+	} else {
+		r = usage();
+	}
+	SerialFlash.end();
+	return r;
+}
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+#
+# Turns events traced by SerialFlash into a timeline.  Compile the
+# library with SERIALFLASH_TRACE defined as the number of events to keep,
+# for example -DSERIALFLASH_TRACE=1024, and print them with
+# SerialFlash.dumpTrace(Serial).  Save the output (other lines are
+# ignored, so a whole serial log may be used) and run:
+#
+#   trace-decode.py log.txt
+#
+# With --binary, the input is instead the raw 12 byte events from
+# SerialFlash.readTrace(), for example saved to a file by the sketch.
+#
+# Each line shows the time since the first event, the time since the
+# previous event, the event, SPI command, address, length and what the
+# chip was doing.  Waits and suspended programs or erases also show how
+# long they lasted.
+#
+###################
+
+import argparse, struct, sys
+
+EVENTS = {1: "read", 2: "program", 3: "erase", 4: "suspend", 5: "resume",
+	6: "wait", 7: "waited", 8: "sleep", 9: "wakeup"}
+BUSY = {0: "idle", 1: "program", 2: "erase", 3: "busy", 4: "program",
+	5: "erase, suspended for write"}
+
+def read_text(f):
+	events = []
+	for line in f:
+		fields = line.split()
+		if len(fields) != 6 or fields[0] != "T":
+			continue
+		try:
+			events.append(tuple(int(x, 16) for x in fields[1:]))
+		except ValueError:
+			continue
+	return events
+
+def read_binary(data):
+	events = []
+	for pos in range(0, len(data) - 11, 12):
+		events.append(struct.unpack_from("<IIHBB", data, pos))
+	return events
+
+def elapsed(a, b):
+	return (b - a) & 0xFFFFFFFF  # micros() wraps after 71 minutes
+
+def decode(events, out):
+	if not events:
+		out.write("no events\n")
+		return
+	start = prev = events[0][0]
+	waitbegin = suspendbegin = None
+	longestwait = longestsuspend = 0
+	counts = {}
+	out.write("    time us    +us  event    cmd  address   length  chip\n")
+	for micros, addr, length, cmd, event in events:
+		kind = EVENTS.get(event >> 4, "event %d" % (event >> 4))
+		busy = BUSY.get(event & 15, str(event & 15))
+		counts[kind] = counts.get(kind, 0) + 1
+		note = ""
+		if kind == "wait":
+			waitbegin = micros
+		elif kind == "waited" and waitbegin is not None:
+			n = elapsed(waitbegin, micros)
+			longestwait = max(longestwait, n)
+			note = "  waited %d us" % n
+			waitbegin = None
+		elif kind == "suspend":
+			suspendbegin = micros
+		elif kind == "resume" and suspendbegin is not None:
+			n = elapsed(suspendbegin, micros)
+			longestsuspend = max(longestsuspend, n)
+			note = "  suspended %d us" % n
+			suspendbegin = None
+		size = "%d+" % length if length == 0xFFFF else str(length)
+		out.write("%11d %6d  %-8s %02X  %08X %7s  %s%s\n" % (elapsed(start, micros),
+			elapsed(prev, micros), kind, cmd, addr, size, busy, note))
+		prev = micros
+	out.write("\n%d events over %d us" % (len(events), elapsed(start, prev)))
+	out.write(", longest wait %d us, longest suspend %d us\n" % (longestwait, longestsuspend))
+	out.write(", ".join("%s %d" % (k, counts[k]) for k in sorted(counts)) + "\n")
+
+def main():
+	parser = argparse.ArgumentParser(description="Decode SerialFlash traces into a timeline")
+	parser.add_argument("file", nargs="?", help="dumpTrace() output, default stdin")
+	parser.add_argument("-b", "--binary", action="store_true", help="raw events from readTrace()")
+	args = parser.parse_args()
+	if args.binary:
+		f = open(args.file, "rb") if args.file else sys.stdin.buffer
+		events = read_binary(f.read())
+	else:
+		f = open(args.file, errors="replace") if args.file else sys.stdin
+		events = read_text(f)
+	decode(events, sys.stdout)
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,46 @@
+#ifndef SerialFlash_chiptraits_h_
+#define SerialFlash_chiptraits_h_
+
+#include <inttypes.h>
+
+// Chip feature flags, normally detected by SerialFlashChip::begin()
+
+#define FLAG_32BIT_ADDR		0x01	// larger than 16 MByte address
+#define FLAG_STATUS_CMD70	0x02	// requires special busy flag check
+#define FLAG_DIFF_SUSPEND	0x04	// uses 2 different suspend commands
+#define FLAG_MULTI_DIE		0x08	// multiple die, don't read cross 32M barrier
+#define FLAG_256K_BLOCKS	0x10	// has 256K erase blocks
+#define FLAG_NAND		0x20	// SPI NAND, 2K pages and 128K blocks
+#define FLAG_DIE_MASK		0xC0	// top 2 bits count during multi-die erase
+
+// Compile time chip traits.  Normally SerialFlash detects the chip
+// and tests these flags on every read, write and erase.  Products
+// which always use the same chip can instead build with one of the
+// traits below, for example -DSERIALFLASH_CHIP=SerialFlash_W25Q128FV,
+// so the flags become constants and the compiler removes the code
+// for other chips.  The address width, status command, suspend
+// commands and erase block size all follow from the flags.  Clock is
+// the fastest SPI clock for the read (0x03) and program commands.
+
+template <uint8_t Flags, uint32_t Clock>
+struct SerialFlashTraits {
+	static const uint8_t flags = Flags;
+	static const uint32_t clock = Clock;
+};
+
+typedef SerialFlashTraits<0, 50000000> SerialFlash_W25Q80BV;
+typedef SerialFlashTraits<0, 50000000> SerialFlash_W25Q64FV;
+typedef SerialFlashTraits<0, 50000000> SerialFlash_W25Q128FV;
+typedef SerialFlashTraits<FLAG_32BIT_ADDR, 50000000> SerialFlash_W25Q256FV;
+typedef SerialFlashTraits<FLAG_DIFF_SUSPEND, 50000000> SerialFlash_S25FL127S;
+typedef SerialFlashTraits<FLAG_32BIT_ADDR | FLAG_DIFF_SUSPEND | FLAG_256K_BLOCKS,
+	50000000> SerialFlash_S25FL512S;
+typedef SerialFlashTraits<FLAG_STATUS_CMD70, 54000000> SerialFlash_N25Q128A;
+typedef SerialFlashTraits<FLAG_32BIT_ADDR | FLAG_STATUS_CMD70 | FLAG_MULTI_DIE,
+	54000000> SerialFlash_N25Q512A;
+typedef SerialFlashTraits<FLAG_32BIT_ADDR | FLAG_STATUS_CMD70 | FLAG_MULTI_DIE,
+	54000000> SerialFlash_N25Q00AA;
+typedef SerialFlashTraits<FLAG_32BIT_ADDR | FLAG_STATUS_CMD70 | FLAG_MULTI_DIE,
+	50000000> SerialFlash_MT25QL02GC;
+
+#endif